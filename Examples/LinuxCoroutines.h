@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <StdLinuxModbusCoroutines.h>
+
+// Server and master coroutines sharing one executor thread. Each of Workers master coroutines reads and
+// writes holding registers in a loop, so Workers transactions are in flight on the one pipelined connection.
+// Usage: coroutines [port] [workers] [transactions per worker]
+
+std::array<int16_t, 100> DS;
+HoldingRegister Integers(0, 99, std::vector<ModbusFunction>{ReadHoldingRegisters, WriteSingleHoldingRegister, WriteMultipleHoldingRegisters}, (uint16_t *)DS.data());
+Registers registers(std::vector<Register *>{&Integers});
+
+uint32_t Failures = 0;
+bool Done = false;
+
+uint32_t Working = 0;
+
+Task<void> Worker(AsyncModbusClient &client, const uint16_t id, const uint32_t count)
+{
+    const uint16_t address = id % 100;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        const ModbusResponsePDU written = co_await client.WriteHolding(address, static_cast<uint16_t>(i));
+        const ModbusResponsePDU read = co_await client.ReadHolding(address, 1);
+        if (written.Error != ModbusError::NoError || read.Error != ModbusError::NoError || read.RegisterValue.size() != 2)
+        {
+            Failures++;
+        }
+    }
+    Working--;
+}
+
+Task<void> Master(ModbusExecutor &executor, const uint16_t port, const uint32_t workers, const uint32_t count)
+{
+    AsyncModbusClient client(executor);
+    if (!co_await client.Connect("127.0.0.1", port))
+    {
+        Failures++;
+        Done = true;
+        co_return;
+    }
+    const uint32_t start = MonotonicMillis();
+    Working = workers;
+    for (uint32_t id = 0; id < workers; id++)
+    {
+        executor.Spawn(Worker(client, id, count));
+    }
+    while (Working > 0)
+    {
+        co_await executor.Sleep(1);
+    }
+    const uint32_t elapsed = MonotonicMillis() - start;
+    printf("%u transactions in %u ms, %u failed\n", 2 * workers * count, elapsed, Failures);
+    client.Close();
+    co_await executor.Sleep(10); // Let the reader task see the close
+    Done = true;
+}
+
+int main(int argc, char **argv)
+{
+    const uint16_t port = argc > 1 ? atoi(argv[1]) : 1502;
+    const uint32_t workers = argc > 2 ? atoi(argv[2]) : 1000;
+    const uint32_t count = argc > 3 ? atoi(argv[3]) : 100;
+
+    ModbusExecutor executor;
+    executor.Spawn(ServeModbusTCP(executor, registers, port));
+    executor.Spawn(Master(executor, port, workers, count));
+    // The server runs forever, stop once the master is done
+    while (!Done && executor.RunOnce(100))
+    {
+    }
+    return Failures == 0 ? 0 : 1;
+}
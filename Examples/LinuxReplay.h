@@ -0,0 +1,39 @@
+#include <vector>
+#include <string.h>
+
+#include <StdLinuxModbusReplay.h>
+
+// Replays a capture recorded with CaptureFileWriter (NativeCapture) against this register map and prints the
+// throughput and latency. Usage: replay <capture file> [--timed] [repetitions]
+// Build the register map as the server does, only requests to it are answered the same way
+
+std::array<bool, 2000> C;
+CoilRegister Coils(0x4000, 0x47CF, std::vector<ModbusFunction>{ReadCoils, WriteSingleCoil, WriteMultipleCoils}, (uint8_t *)C.data());
+std::array<int16_t, 4500> DS;
+HoldingRegister Integers(0, 0x1193, std::vector<ModbusFunction>{ReadHoldingRegisters, WriteSingleHoldingRegister, WriteMultipleHoldingRegisters}, (uint16_t *)DS.data());
+std::array<float, 500> DF;
+HoldingRegister Floats(0x7000, 0x73E6, std::vector<ModbusFunction>{ReadHoldingRegisters, WriteSingleHoldingRegister, WriteMultipleHoldingRegisters}, (uint16_t *)DF.data(), false, true);
+
+Registers registers(std::vector<Register *>{&Coils, &Integers, &Floats});
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        printf("usage: %s <capture file> [--timed] [repetitions]\n", argv[0]);
+        return 1;
+    }
+
+    CaptureReplay replay;
+    if (!replay.Load(argv[1]))
+    {
+        printf("%s is not a capture file\n", argv[1]);
+        return 1;
+    }
+
+    const bool timed = argc > 2 && strcmp(argv[2], "--timed") == 0;
+    const int repetitions = argc > 2 + timed ? atoi(argv[2 + timed]) : 1;
+    printf("replaying %zu requests\n", replay.Count());
+    PrintReplayReport(replay.Run(registers, timed ? OriginalTiming : AsFastAsPossible, repetitions > 0 ? repetitions : 1));
+    return 0;
+}
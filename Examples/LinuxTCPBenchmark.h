@@ -0,0 +1,119 @@
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <StdLinuxModbusUring.h>
+
+// Loopback benchmark of the io_uring server against the epoll server. Each client thread keeps Depth read
+// requests in flight on its own connection for Seconds and the completed transactions per second are printed.
+// Usage: benchmark [clients] [depth] [seconds]
+
+std::array<int16_t, 4500> DS;
+HoldingRegister Integers(0, 0x1193, std::vector<ModbusFunction>{ReadHoldingRegisters, WriteSingleHoldingRegister, WriteMultipleHoldingRegisters}, (uint16_t *)DS.data());
+Registers registers(std::vector<Register *>{&Integers});
+
+std::atomic<bool> running;
+std::atomic<bool> serving;
+std::atomic<uint64_t> transactions;
+
+void Client(const uint16_t port, const int depth)
+{
+    const int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0)
+    {
+        close(fd);
+        return;
+    }
+
+    const uint8_t request[12] = {0, 1, 0, 0, 0, 6, 1, ReadHoldingRegisters, 0, 0, 0, 10};
+    std::vector<uint8_t> requests(12 * depth);
+    for (int i = 0; i < depth; i++)
+    {
+        memcpy(requests.data() + 12 * i, request, 12);
+    }
+    std::vector<uint8_t> responses(29 * depth);
+    uint64_t completed = 0;
+    while (running)
+    {
+        if (write(fd, requests.data(), requests.size()) != static_cast<ssize_t>(requests.size()))
+        {
+            break;
+        }
+        size_t received = 0;
+        while (received < responses.size())
+        {
+            const ssize_t count = read(fd, responses.data() + received, responses.size() - received);
+            if (count <= 0)
+            {
+                close(fd);
+                return;
+            }
+            received += count;
+        }
+        completed += depth;
+    }
+    transactions += completed;
+    close(fd);
+}
+
+template <typename Server>
+void Run(const char *name, Server &server, const uint16_t port, const int clients, const int depth, const int seconds)
+{
+    running = true;
+    serving = true;
+    transactions = 0;
+    std::thread serverThread([&server]()
+                             {
+                                 while (serving)
+                                 {
+                                     server.Poll(10);
+                                 } });
+    std::vector<std::thread> clientThreads;
+    for (int i = 0; i < clients; i++)
+    {
+        clientThreads.emplace_back(Client, port, depth);
+    }
+    sleep(seconds);
+    running = false;
+    for (auto &thread : clientThreads)
+    {
+        thread.join();
+    }
+    serving = false; // Clients may still be waiting on responses until here
+    serverThread.join();
+    printf("%-8s %10.0f transactions/s\n", name, static_cast<double>(transactions) / seconds);
+}
+
+int main(int argc, char **argv)
+{
+    const int clients = argc > 1 ? atoi(argv[1]) : 4;
+    const int depth = argc > 2 ? atoi(argv[2]) : 8;
+    const int seconds = argc > 3 ? atoi(argv[3]) : 5;
+    printf("%d clients, %d requests in flight each\n", clients, depth);
+
+    StdLinuxModbusTCPServer epoll({.ServerPort = 15020, .ClientTimeout = 0}, registers);
+    if (epoll.Initialize())
+    {
+        Run("epoll", epoll, 15020, clients, depth, seconds);
+        epoll.Close();
+    }
+
+    StdLinuxModbusUringServer uring({.ServerPort = 15021, .ClientTimeout = 0}, registers);
+    if (uring.Initialize())
+    {
+        Run("io_uring", uring, 15021, clients, depth, seconds);
+        uring.Close();
+    }
+    else
+    {
+        printf("io_uring is not available\n");
+    }
+    return 0;
+}
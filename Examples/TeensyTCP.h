@@ -62,7 +62,8 @@ extern "C" int main(void)
         // Loop();
         {
             ModbusServer.ConnectNewClients();
-            ModbusServer.ProcessClients();
+            ModbusServer.ProcessClients(); // or ModbusServer.Poll(200); to bound the time spent servicing Modbus each loop
+            ModbusServer.FlushLog(Serial, 1); // Connection events are queued, print them where it won't disturb timing
 
             // Use and set values
             Y[1] = true;
@@ -0,0 +1,198 @@
+#ifndef H_ModbusAllocator_IP
+#define H_ModbusAllocator_IP
+
+// Allocation control for targets using std::vector (not AVR). PDU buffers are taken from the arena of the
+// transaction being processed, set with an ArenaScope, and what the scope allocated is released when it ends,
+// so steady state operation makes no general purpose heap allocations. Without an active arena, or when it
+// overflows, allocations fall back to the heap and are counted in ModbusAllocationStats of the thread
+
+#include <stddef.h>
+#include <stdint.h>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+#ifndef ModbusArenaSize
+#define ModbusArenaSize 1024 // Enough for the request, response and their copies in one transaction
+#endif
+
+struct AllocationStats
+{
+    uint32_t ArenaAllocations;
+    uint32_t ArenaOverflows; // Arena was full, the heap was used instead
+    uint32_t HeapAllocations;
+    uint32_t PoolAllocations; // Objects handed out by a SlabPool
+    uint32_t PoolGrowths;     // Slabs a SlabPool had to allocate from the heap
+};
+
+thread_local AllocationStats ModbusAllocationStats = {};
+
+class TransactionArena
+{
+private:
+    uint8_t *buffer;
+    const size_t capacity;
+    size_t used = 0;
+
+public:
+    TransactionArena(uint8_t *buffer, size_t capacity) : buffer{buffer}, capacity{capacity} {};
+    ~TransactionArena() {};
+
+    // nullptr when the arena is full
+    void *Allocate(const size_t bytes, const size_t alignment)
+    {
+        const size_t start = (used + alignment - 1) & ~(alignment - 1);
+        if (start + bytes > capacity)
+        {
+            return nullptr;
+        }
+        used = start + bytes;
+        return buffer + start;
+    }
+    bool Owns(const void *pointer) const
+    {
+        return pointer >= buffer && pointer < buffer + capacity;
+    }
+    void Reset() { used = 0; }
+    void Rewind(const size_t mark) { used = mark; } // Releases everything allocated since Used() returned mark
+    size_t Used() const { return used; }
+};
+
+template <size_t Size>
+class FixedArena : public TransactionArena
+{
+private:
+    alignas(max_align_t) uint8_t storage[Size];
+
+public:
+    FixedArena() : TransactionArena(storage, Size) {};
+    FixedArena(const FixedArena &) : FixedArena() {}; // Copies start empty, contents never outlive a transaction
+    FixedArena &operator=(const FixedArena &)
+    {
+        Reset();
+        return *this;
+    }
+};
+
+thread_local TransactionArena *CurrentArena = nullptr;
+
+// Makes arena the allocation source for PDUs on this thread until the scope ends, then releases what was
+// allocated from it in the meantime. Scopes can be nested on the same arena
+class ArenaScope
+{
+private:
+    TransactionArena &arena;
+    TransactionArena *previous;
+    const size_t mark;
+
+public:
+    explicit ArenaScope(TransactionArena &arena) : arena{arena}, previous{CurrentArena}, mark{arena.Used()} { CurrentArena = &arena; };
+    ~ArenaScope()
+    {
+        arena.Rewind(mark);
+        CurrentArena = previous;
+    };
+};
+
+// Takes memory from the arena current when the allocator was made, while that arena is still current. Memory from
+// the arena is released all at once, objects using it must not outlive the ArenaScope they were made in
+template <typename T>
+struct ModbusAllocator
+{
+    using value_type = T;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+
+    TransactionArena *Arena;
+
+    ModbusAllocator() : Arena{CurrentArena} {};
+    template <typename U>
+    ModbusAllocator(const ModbusAllocator<U> &other) : Arena{other.Arena} {};
+
+    T *allocate(const size_t count)
+    {
+        if (Arena != nullptr && Arena == CurrentArena)
+        {
+            void *memory = Arena->Allocate(count * sizeof(T), alignof(T));
+            if (memory != nullptr)
+            {
+                ModbusAllocationStats.ArenaAllocations++;
+                return static_cast<T *>(memory);
+            }
+            ModbusAllocationStats.ArenaOverflows++;
+        }
+        ModbusAllocationStats.HeapAllocations++;
+        return static_cast<T *>(::operator new(count * sizeof(T)));
+    }
+    void deallocate(T *pointer, size_t)
+    {
+        if (Arena != nullptr && Arena->Owns(pointer))
+        {
+            return;
+        }
+        ::operator delete(pointer);
+    }
+};
+
+template <typename T, typename U>
+bool operator==(const ModbusAllocator<T> &a, const ModbusAllocator<U> &b) { return a.Arena == b.Arena; }
+template <typename T, typename U>
+bool operator!=(const ModbusAllocator<T> &a, const ModbusAllocator<U> &b) { return a.Arena != b.Arena; }
+
+// Fixed size object pool, grows a slab at a time and keeps released objects on a free list for reuse
+template <typename T, size_t SlabSize = 16>
+class SlabPool
+{
+private:
+    union Slot
+    {
+        Slot *next;
+        alignas(T) uint8_t object[sizeof(T)];
+    };
+    std::vector<Slot *> slabs;
+    Slot *freeList = nullptr;
+
+    void grow()
+    {
+        Slot *slab = new Slot[SlabSize];
+        ModbusAllocationStats.PoolGrowths++;
+        slabs.push_back(slab);
+        for (size_t i = 0; i < SlabSize; i++)
+        {
+            slab[i].next = freeList;
+            freeList = &slab[i];
+        }
+    }
+
+public:
+    SlabPool() {};
+    SlabPool(const SlabPool &) = delete;
+    ~SlabPool()
+    {
+        for (Slot *slab : slabs)
+        {
+            delete[] slab;
+        }
+    };
+
+    T *Create()
+    {
+        if (freeList == nullptr)
+        {
+            grow();
+        }
+        Slot *slot = freeList;
+        freeList = slot->next;
+        ModbusAllocationStats.PoolAllocations++;
+        return new (slot->object) T();
+    }
+    void Destroy(T *object)
+    {
+        object->~T();
+        Slot *slot = reinterpret_cast<Slot *>(object);
+        slot->next = freeList;
+        freeList = slot;
+    }
+};
+
+#endif
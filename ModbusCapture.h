@@ -0,0 +1,153 @@
+#ifndef H_ModbusCapture_IP
+#define H_ModbusCapture_IP
+
+// Traffic capture for diagnosing what masters actually sent. The Receive*Frame and Reject*Frame functions in registers.h
+// record every request and response they handle (responses to broadcasts are never sent and aren't recorded) into the CaptureRing made active on the calling thread with
+// SetActiveCapture(). The ring is a lock free single producer, single consumer byte queue, so the serving thread
+// only copies the frame while a background writer drains it (see StdLinuxModbusCapture.h). With no active
+// capture the cost is one pointer test per frame. Not available on AVR, where CaptureFrame() does nothing.
+//
+// Records are stored on the ring, and in capture files, as a CaptureRecordHeader followed by Length frame bytes.
+// Frames are as seen on the wire, including the MBAP header or the RTU address and CRC.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+const size_t ModbusCaptureMaxFrame = 513; // Largest frame of any framing (ASCII)
+
+enum CaptureDirection : uint8_t
+{
+    CapturedRequest,
+    CapturedResponse,
+};
+
+struct CaptureRecordHeader
+{
+    uint64_t Micros;      // From the ring's clock
+    uint32_t Transaction; // Pairs a response with its request
+    uint16_t Length;
+    uint8_t Framing; // ModbusFraming of the transport
+    uint8_t Direction;
+};
+static_assert(sizeof(CaptureRecordHeader) == 16, "Capture record layout must stay fixed");
+
+// Start of a native capture file, followed by the records
+struct CaptureFileHeader
+{
+    uint32_t Magic;
+    uint16_t Version;
+    uint16_t Reserved;
+    uint64_t StartMicros; // Clock reading when the file was opened
+};
+static_assert(sizeof(CaptureFileHeader) == 16, "Capture file header layout must stay fixed");
+
+const uint32_t CaptureFileMagic = 0x4D424350; // "MBCP"
+const uint16_t CaptureFileVersion = 1;
+
+#ifdef __AVR__
+
+size_t CaptureFrame(uint8_t, CaptureDirection, const uint8_t *, size_t byteCount) { return byteCount; }
+
+#else
+#include <atomic>
+
+class CaptureRing
+{
+private:
+    uint8_t *buffer;
+    const size_t mask;
+    uint64_t (*clock)();
+    std::atomic<size_t> head{0}; // Written by the producer only
+    std::atomic<size_t> tail{0}; // Written by the consumer only
+    uint32_t transaction = 0;
+
+    void copyIn(size_t position, const void *data, size_t count)
+    {
+        const uint8_t *bytes = static_cast<const uint8_t *>(data);
+        position &= mask;
+        const size_t first = count < mask + 1 - position ? count : mask + 1 - position;
+        memcpy(buffer + position, bytes, first);
+        memcpy(buffer, bytes + first, count - first);
+    }
+    void copyOut(size_t position, void *data, size_t count) const
+    {
+        uint8_t *bytes = static_cast<uint8_t *>(data);
+        position &= mask;
+        const size_t first = count < mask + 1 - position ? count : mask + 1 - position;
+        memcpy(bytes, buffer + position, first);
+        memcpy(bytes + first, buffer, count - first);
+    }
+
+public:
+    std::atomic<uint32_t> Dropped{0}; // Records lost because the ring was full
+
+    // Size must be a power of two, MicrosClock supplies the record timestamps (eg. a wrapper around micros())
+    CaptureRing(uint8_t *buffer, size_t Size, uint64_t (*MicrosClock)()) : buffer{buffer}, mask{Size - 1}, clock{MicrosClock} {};
+    CaptureRing(const CaptureRing &) = delete;
+    ~CaptureRing() {};
+
+    // Producer side, called from the serving thread. Returns false if the record was dropped
+    bool Record(const uint8_t Framing, const CaptureDirection Direction, const uint8_t *frame, const size_t byteCount)
+    {
+        if (Direction == CapturedRequest)
+        {
+            transaction++;
+        }
+        const size_t needed = sizeof(CaptureRecordHeader) + byteCount;
+        const size_t position = head.load(std::memory_order_relaxed);
+        if (byteCount > ModbusCaptureMaxFrame || mask + 1 - (position - tail.load(std::memory_order_acquire)) < needed)
+        {
+            Dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+
+        const CaptureRecordHeader header = {.Micros = clock(),
+                                            .Transaction = transaction,
+                                            .Length = static_cast<uint16_t>(byteCount),
+                                            .Framing = Framing,
+                                            .Direction = Direction};
+        copyIn(position, &header, sizeof(header));
+        copyIn(position + sizeof(header), frame, byteCount);
+        head.store(position + needed, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side. frame must hold ModbusCaptureMaxFrame bytes, returns false when the ring is empty
+    bool Next(CaptureRecordHeader &header, uint8_t *frame)
+    {
+        const size_t position = tail.load(std::memory_order_relaxed);
+        if (head.load(std::memory_order_acquire) == position)
+        {
+            return false;
+        }
+        copyOut(position, &header, sizeof(header));
+        copyOut(position + sizeof(header), frame, header.Length);
+        tail.store(position + sizeof(header) + header.Length, std::memory_order_release);
+        return true;
+    }
+
+    uint64_t Now() const { return clock(); }
+};
+
+thread_local CaptureRing *ActiveCapture = nullptr;
+
+// Each serving thread records into its own ring, nullptr stops capturing
+void SetActiveCapture(CaptureRing *ring)
+{
+    ActiveCapture = ring;
+}
+
+// Returns byteCount so the response can be recorded as it is returned
+size_t CaptureFrame(const uint8_t Framing, const CaptureDirection Direction, const uint8_t *frame, const size_t byteCount)
+{
+    if (ActiveCapture != nullptr)
+    {
+        ActiveCapture->Record(Framing, Direction, frame, byteCount);
+    }
+    return byteCount;
+}
+
+#endif
+
+#endif
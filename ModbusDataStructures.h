@@ -19,12 +19,20 @@ uint8_t responseBuffer[64] = {0};
 #else
 #include <vector>
 #include <array>
+#include <ModbusAllocator.h>
 using std::array;
 using std::vector;
 #endif
 
+// PDU payloads, taken from the current transaction arena where one is set (see ModbusAllocator.h)
+#ifdef __AVR__
+typedef vector<uint8_t> ByteVector;
+#else
+typedef std::vector<uint8_t, ModbusAllocator<uint8_t>> ByteVector;
+#endif
+
 uint8_t CompressBooleans(const uint8_t *b, int8_t limit = 8);
-bool CRC16Check(const uint8_t *data, uint8_t byteCount);
+bool CRC16Check(const uint8_t *data, size_t byteCount);
 
 enum ModbusError : uint8_t
 {
@@ -34,6 +42,8 @@ enum ModbusError : uint8_t
     IllegalDataValue,
     SlaveDeviceFailure,
     SlaveDeviceBusy,
+    GatewayPathUnavailable = 10,
+    GatewayTargetFailedToRespond, // Also reported by masters when a request times out
     CRCError = 12,
 };
 
@@ -47,8 +57,13 @@ enum ModbusFunction : uint8_t
     WriteSingleHoldingRegister,
     WriteMultipleCoils = 15,
     WriteMultipleHoldingRegisters,
+    ReadFileRecord = 20,
+    WriteFileRecord,
+    ReadFIFOQueue = 24,
 };
 
+const uint8_t ModbusFIFOMaxCount = 31; // Entries returned by one FC24 response
+
 struct ModbusRequestPDU
 {
     ModbusFunction FunctionCode;
@@ -56,7 +71,7 @@ struct ModbusRequestPDU
     uint16_t NumberOfRegisters;
     uint16_t RegisterValue;
     uint8_t DataByteCount;
-    vector<uint8_t> Values;
+    ByteVector Values;
 };
 
 ModbusRequestPDU ParseRequestPDU(uint8_t *data)
@@ -66,7 +81,11 @@ ModbusRequestPDU ParseRequestPDU(uint8_t *data)
         .Address = CombineBytes(data[1], data[2]),
         .NumberOfRegisters = CombineBytes(data[3], data[4]),
         .RegisterValue = CombineBytes(data[3], data[4]),
-        .DataByteCount = data[5]};
+        .DataByteCount = 0};
+    if (req.FunctionCode == ModbusFunction::WriteMultipleCoils || req.FunctionCode == ModbusFunction::WriteMultipleHoldingRegisters)
+    {
+        req.DataByteCount = data[5]; // Only these carry values, for the rest data[5] is past the end of the request
+    }
 
 #ifdef __AVR__
     req.Values.setStorage(requestBuffer, req.DataByteCount);
@@ -100,11 +119,26 @@ void getRequestBytes(ModbusRequestPDU PDU, uint8_t *bytesBuffer) // Primarily fo
         bytesBuffer[5] = PDU.DataByteCount;
         memcpy(bytesBuffer + 6, PDU.Values.data(), PDU.DataByteCount);
         break;
+    case ModbusFunction::ReadFIFOQueue:
+        break; // Only the FIFO pointer address
+    case ModbusFunction::ReadFileRecord:
+    case ModbusFunction::WriteFileRecord:
+        bytesBuffer[1] = PDU.DataByteCount; // Values holds the sub-requests as sent
+        memcpy(bytesBuffer + 2, PDU.Values.data(), PDU.DataByteCount);
+        break;
     }
 }
 
 uint8_t getRequestByteLength(ModbusRequestPDU PDU)
 {
+    if (PDU.FunctionCode == ModbusFunction::ReadFIFOQueue)
+    {
+        return 3; // Only the FIFO pointer address
+    }
+    if (PDU.FunctionCode == ModbusFunction::ReadFileRecord || PDU.FunctionCode == ModbusFunction::WriteFileRecord)
+    {
+        return 2 + PDU.DataByteCount;
+    }
     return 5 + PDU.DataByteCount + (PDU.DataByteCount > 0 ? 1 : 0);
 }
 
@@ -114,7 +148,7 @@ struct ModbusResponsePDU
     uint16_t Address = 0; // Unchanged from request PDU
     uint8_t DataByteCount = 0;
     uint16_t NumberOfRegistersChanged = 0; // Unchanged from request PDU
-    vector<uint8_t> RegisterValue;
+    ByteVector RegisterValue;
     ModbusError Error = NoError;
 };
 
@@ -172,6 +206,19 @@ ModbusResponsePDU ParseResponsePDU(const uint8_t *data)
         resp.NumberOfRegistersChanged = CombineBytes(data[3], data[4]);
         break;
 
+    case ModbusFunction::ReadFIFOQueue:
+    {
+        const uint16_t count = CombineBytes(data[3], data[4]); // After the 2 byte byte count
+        resp.DataByteCount = 2 * (count > ModbusFIFOMaxCount ? ModbusFIFOMaxCount : count);
+#ifdef __AVR__
+        resp.RegisterValue.setStorage(responseBuffer, resp.DataByteCount);
+#else
+        resp.RegisterValue.resize(resp.DataByteCount);
+#endif
+        memcpy(resp.RegisterValue.data(), data + 5, resp.DataByteCount);
+    }
+    break;
+
     default:
         resp.Error = ModbusError::IllegalFunction;
         break;
@@ -189,6 +236,16 @@ uint8_t ModbusResponsePDUtoStream(const ModbusResponsePDU responseData, uint8_t
         return 2;
     }
 
+    if (responseData.FunctionCode == ModbusFunction::ReadFIFOQueue)
+    {
+        SplitBytes(responseData.DataByteCount + 2, Big, DataBuffer + 1);
+        SplitBytes(responseData.DataByteCount / 2, Big, DataBuffer + 3);
+        memcpy(DataBuffer + 5,
+               responseData.RegisterValue.data(),
+               responseData.DataByteCount);
+        return responseData.DataByteCount + 5;
+    }
+
     if (responseData.FunctionCode <= 4)
     {
         DataBuffer[1] = responseData.DataByteCount;
@@ -226,10 +283,10 @@ void getMBAPBytes(const MBAPHead MBAPHeader, uint8_t *bytes) // Primarily for te
 }
 
 // #ifdef ModbusRTU
-bool CRC16Check(const uint8_t *data, uint8_t byteCount)
+bool CRC16Check(const uint8_t *data, size_t byteCount)
 {
     FastCRC16 CRC16;
-    return (CRC16.modbus(data, byteCount - 2) == CombineBytes(data[byteCount - 1], data[byteCount - 2]));
+    return byteCount >= 2 && (CRC16.modbus(data, byteCount - 2) == CombineBytes(data[byteCount - 1], data[byteCount - 2]));
 }
 // #endif
 
@@ -251,4 +308,16 @@ array<bool, 8> DecompressBooleans(const uint8_t b)
     return c;
 }
 
+// Copies count packed bits from source (starting at bit sourceBit) into destination at bit destinationBit, other destination bits are kept
+void CopyBits(const uint8_t *source, const uint16_t sourceBit, uint8_t *destination, const uint16_t destinationBit, const uint16_t count)
+{
+    for (uint16_t i = 0; i < count; i++)
+    {
+        const uint16_t from = sourceBit + i;
+        const uint16_t to = destinationBit + i;
+        const uint8_t bit = (source[from / 8] >> (from % 8)) & 1;
+        destination[to / 8] = (destination[to / 8] & ~(1 << (to % 8))) | (bit << (to % 8));
+    }
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,59 @@
+#ifndef H_ModbusFileRecords_IP
+#define H_ModbusFileRecords_IP
+
+// Storage behind Read File Record (FC20) and Write File Record (FC21), set with Registers::SetFileStore().
+// Records are 16 bit words kept big endian, as they appear in the frame, so a request is served with one copy
+// between the store and the frame. Files are numbered from 1 as in the Modbus specification.
+
+#include <stdint.h>
+#include <stddef.h>
+
+class FileRecordStore
+{
+public:
+    virtual ~FileRecordStore() {};
+
+    // Length records of File starting at Record, nullptr if any of them doesn't exist
+    virtual const uint8_t *ReadRecords(const uint16_t File, const uint16_t Record, const uint16_t Length) = 0;
+    // As ReadRecords, also nullptr if the file can't be written
+    virtual uint8_t *WriteRecords(const uint16_t File, const uint16_t Record, const uint16_t Length) = 0;
+};
+
+struct RecordFile
+{
+    uint8_t *Data;    // 2 * Records bytes
+    uint16_t Records;
+    bool Writable;
+};
+
+// Files held in application memory, Files[0] is file 1
+class MemoryFileStore : public FileRecordStore
+{
+protected:
+    RecordFile *files;
+    const uint16_t fileCount;
+
+    uint8_t *locate(const uint16_t File, const uint16_t Record, const uint16_t Length) const
+    {
+        if (File == 0 || File > fileCount || files[File - 1].Data == nullptr || static_cast<uint32_t>(Record) + Length > files[File - 1].Records)
+        {
+            return nullptr;
+        }
+        return files[File - 1].Data + 2 * static_cast<size_t>(Record);
+    }
+
+public:
+    MemoryFileStore(RecordFile *Files, const uint16_t Count) : files{Files}, fileCount{Count} {};
+    ~MemoryFileStore() {};
+
+    const uint8_t *ReadRecords(const uint16_t File, const uint16_t Record, const uint16_t Length) override
+    {
+        return locate(File, Record, Length);
+    }
+    uint8_t *WriteRecords(const uint16_t File, const uint16_t Record, const uint16_t Length) override
+    {
+        return File > 0 && File <= fileCount && files[File - 1].Writable ? locate(File, Record, Length) : nullptr;
+    }
+};
+
+#endif
@@ -0,0 +1,204 @@
+#ifndef H_ModbusHotReload_IP
+#define H_ModbusHotReload_IP
+
+// Replacing the whole register map while the servers keep running, eg. after a configuration change, without
+// dropping connections. Each thread serving requests registers a ReloadReader and pins the current map for the length
+// of a request with PinnedRegisters, which costs an atomic load and two stores and never blocks. Swap() installs a new
+// map for the following requests; the map it replaces is released once every reader that could still be using it has
+// finished its request (epoch based reclamation).
+// Swap() and Reclaim() must be called from one thread at a time. Not available on AVR.
+
+#include <atomic>
+#include <stdint.h>
+#include <vector>
+#include <registers.h>
+
+// Per thread state, the epoch the thread entered its current request in, 0 between requests
+struct ReloadReader
+{
+    std::atomic<uint64_t> Epoch{0};
+    std::atomic<bool> Claimed{true};
+    ReloadReader *Next = nullptr;
+};
+
+class RegisterMapSwitch
+{
+private:
+    struct InstalledMap
+    {
+        Registers *Map;
+        void (*Release)(Registers &Map, void *Context);
+        void *Context;
+        uint64_t Retired; // Epoch it was replaced in
+    };
+
+    std::atomic<InstalledMap *> current;
+    std::atomic<uint64_t> epoch{1};
+    std::atomic<ReloadReader *> readers{nullptr}; // Only grows, records are reused once removed
+    std::vector<InstalledMap *> retired;
+    uint32_t swaps = 0;
+
+    static void release(InstalledMap *installed)
+    {
+        if (installed->Release != nullptr)
+        {
+            installed->Release(*installed->Map, installed->Context);
+        }
+        delete installed;
+    }
+
+public:
+    // Initial stays owned by the caller, Release is called for it when it is replaced and no longer in use
+    explicit RegisterMapSwitch(Registers &Initial, void (*Release)(Registers &Map, void *Context) = nullptr, void *Context = nullptr)
+        : current{new InstalledMap{&Initial, Release, Context, 0}} {};
+    // All servers using the switch must be closed first
+    ~RegisterMapSwitch()
+    {
+        for (InstalledMap *installed : retired)
+        {
+            release(installed);
+        }
+        release(current.load());
+        ReloadReader *reader = readers.load();
+        while (reader != nullptr)
+        {
+            ReloadReader *next = reader->Next;
+            delete reader;
+            reader = next;
+        }
+    };
+
+    // One per serving thread, kept until RemoveReader()
+    ReloadReader &AddReader()
+    {
+        for (ReloadReader *reader = readers.load(); reader != nullptr; reader = reader->Next)
+        {
+            bool claimed = false;
+            if (reader->Claimed.compare_exchange_strong(claimed, true))
+            {
+                return *reader;
+            }
+        }
+        ReloadReader *reader = new ReloadReader();
+        ReloadReader *head = readers.load();
+        do
+        {
+            reader->Next = head;
+        } while (!readers.compare_exchange_weak(head, reader));
+        return *reader;
+    }
+    void RemoveReader(ReloadReader &Reader)
+    {
+        Reader.Epoch.store(0);
+        Reader.Claimed.store(false);
+    }
+
+    // Pins the current map until Exit(), readers can't be nested
+    Registers &Enter(ReloadReader &Reader)
+    {
+        // Publishing the epoch before loading the map (both sequentially consistent) means a Swap() that doesn't see
+        // this reader active can't have been followed by the reader loading the map it replaced
+        Reader.Epoch.store(epoch.load());
+        return *current.load()->Map;
+    }
+    void Exit(ReloadReader &Reader) { Reader.Epoch.store(0, std::memory_order_release); }
+
+    // Requests entered from now on use Next. The map replaced is released by this or a later Swap() or Reclaim() once
+    // the requests using it have finished. Release is called for Next in turn when it is replaced
+    void Swap(Registers &Next, void (*Release)(Registers &Map, void *Context) = nullptr, void *Context = nullptr)
+    {
+        InstalledMap *previous = current.exchange(new InstalledMap{&Next, Release, Context, 0});
+        previous->Retired = epoch.fetch_add(1) + 1;
+        retired.push_back(previous);
+        swaps++;
+        Reclaim();
+    }
+
+    // Releases the replaced maps no reader can still be using, returns how many are still waiting on a reader
+    size_t Reclaim()
+    {
+        uint64_t oldest = UINT64_MAX;
+        for (ReloadReader *reader = readers.load(); reader != nullptr; reader = reader->Next)
+        {
+            const uint64_t entered = reader->Epoch.load();
+            if (entered != 0 && entered < oldest)
+            {
+                oldest = entered;
+            }
+        }
+
+        // A reader that entered in epoch e can only hold maps replaced after e
+        size_t kept = 0;
+        for (InstalledMap *installed : retired)
+        {
+            if (installed->Retired <= oldest)
+            {
+                release(installed);
+            }
+            else
+            {
+                retired[kept++] = installed;
+            }
+        }
+        retired.resize(kept);
+        return kept;
+    }
+
+    // The map new requests use, for the thread calling Swap()
+    Registers &Current() const { return *current.load()->Map; }
+    uint32_t Swaps() const { return swaps; }
+};
+
+// Pins the current map of Maps for the lifetime of the object, eg. around one ReceiveFrame() call
+class PinnedRegisters
+{
+private:
+    RegisterMapSwitch &maps;
+    ReloadReader &reader;
+    Registers &map;
+
+public:
+    PinnedRegisters(RegisterMapSwitch &Maps, ReloadReader &Reader) : maps{Maps}, reader{Reader}, map{Maps.Enter(Reader)} {};
+    ~PinnedRegisters() { maps.Exit(reader); };
+    PinnedRegisters(const PinnedRegisters &) = delete;
+    PinnedRegisters &operator=(const PinnedRegisters &) = delete;
+
+    Registers &Map() const { return map; }
+};
+
+// The map a server answers from, either fixed or the current map of a RegisterMapSwitch pinned around each request.
+// Only the switch is kept in that case, as the map current when the server was made may since have been released
+class ServedRegisters
+{
+private:
+    Registers *fixed = nullptr;
+    RegisterMapSwitch *maps = nullptr;
+    ReloadReader *reader = nullptr;
+
+public:
+    explicit ServedRegisters(Registers &Map) : fixed{&Map} {};
+    // Adds a reader for the serving thread, removed again when destroyed
+    explicit ServedRegisters(RegisterMapSwitch &Maps) : maps{&Maps}, reader{&Maps.AddReader()} {};
+    ServedRegisters(const ServedRegisters &) = delete;
+    ServedRegisters &operator=(const ServedRegisters &) = delete;
+    ~ServedRegisters()
+    {
+        if (maps != nullptr)
+        {
+            maps->RemoveReader(*reader);
+        }
+    };
+
+    // As ReceiveFrame(), Frame must have room for MaxFrameLength(Framing) bytes
+    size_t Receive(const ModbusFraming Framing, uint8_t *Frame, const uint16_t Length)
+    {
+        if (maps == nullptr)
+        {
+            return ReceiveFrame(Framing, *fixed, Frame, MaxFrameLength(Framing), Length);
+        }
+        PinnedRegisters pinned(*maps, *reader);
+        return ReceiveFrame(Framing, pinned.Map(), Frame, MaxFrameLength(Framing), Length);
+    }
+};
+
+#endif
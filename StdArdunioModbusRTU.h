@@ -14,6 +14,23 @@ const uint8_t ModbusAddress = 1;
 // ModbusSerial.transmitterEnable(pinNumber); on teensy's this can be used to easily control RS485/422 transmission enable
 // }
 
+const uint32_t InterFrameMicros = 750; // inter character time out
+
+template <size_t BufferSize>
+void RespondRTU(Registers &registers, Stream &ModbusSerial, array<uint8_t, BufferSize> &ModbusFrame, const uint16_t bufferIndex)
+{
+    const auto broadcast = ModbusFrame[0] == 0;
+    if (ModbusAddress == ModbusFrame[0] || broadcast) // Match ID
+    {
+        const auto responseSize = ReceiveRTUStream(registers, ModbusFrame, bufferIndex);
+        if (responseSize > 0 && !broadcast)
+        {
+            ModbusSerial.write(ModbusFrame.data(), responseSize);
+            // ModbusSerial.flush(); // Finish transmitting all bytes, not strictly necessary and .flush() sometimes has a different function in Arduino
+        }
+    }
+}
+
 void Process(Registers &registers, Stream &ModbusSerial)
 {
     array<uint8_t, 128> ModbusFrame = {0}; // Should limit size to the same as the serial ring buffer
@@ -33,20 +50,58 @@ void Process(Registers &registers, Stream &ModbusSerial)
 
         if (!ModbusSerial.available())
         {
-            delayMicroseconds(750); // inter character time out
+            delayMicroseconds(InterFrameMicros);
         }
     }
 
-    const auto broadcast = ModbusFrame[0] == 0;
-    if (ModbusAddress == ModbusFrame[0] || broadcast) // Match ID
+    RespondRTU(registers, ModbusSerial, ModbusFrame, bufferIndex);
+}
+
+// Frame assembly state kept between calls to Poll() so it never has to wait on the inter character time out
+struct RTUPollState
+{
+    array<uint8_t, 128> ModbusFrame = {0}; // Should limit size to the same as the serial ring buffer
+    uint16_t bufferIndex = 0;
+    uint32_t lastByteTime = 0;
+};
+
+struct RTUPollResult
+{
+    bool FrameProcessed;
+    uint16_t BytesDeferred; // Bytes left waiting in the serial buffer when the budget ran out
+    uint32_t ElapsedMicros;
+};
+
+// Non blocking alternative to Process(), reads for at most maxMicros and resumes the partial frame on the next call
+RTUPollResult Poll(Registers &registers, Stream &ModbusSerial, RTUPollState &state, const uint32_t maxMicros)
+{
+    const uint32_t start = micros();
+    RTUPollResult result = {.FrameProcessed = false, .BytesDeferred = 0, .ElapsedMicros = 0};
+
+    while (ModbusSerial.available() > 0 && micros() - start < maxMicros)
     {
-        const auto responseSize = ReceiveRTUStream(registers, ModbusFrame, bufferIndex);
-        if (responseSize > 0 && !broadcast)
+        if (state.bufferIndex < state.ModbusFrame.size())
         {
-            ModbusSerial.write(ModbusFrame.data(), responseSize);
-            // ModbusSerial.flush(); // Finish transmitting all bytes, not strictly necessary and .flush() sometimes has a different function in Arduino
+            state.ModbusFrame[state.bufferIndex] = ModbusSerial.read();
+            state.bufferIndex++;
+        }
+        else
+        {
+            ModbusSerial.read();
         }
+        state.lastByteTime = micros();
     }
+
+    if (state.bufferIndex > 0 && ModbusSerial.available() == 0 && micros() - state.lastByteTime >= InterFrameMicros)
+    {
+        RespondRTU(registers, ModbusSerial, state.ModbusFrame, state.bufferIndex);
+        state.bufferIndex = 0;
+        result.FrameProcessed = true;
+    }
+
+    result.BytesDeferred = ModbusSerial.available();
+    result.ElapsedMicros = micros() - start;
+    return result;
 }
 
 #endif
\ No newline at end of file
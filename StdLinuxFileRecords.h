@@ -0,0 +1,77 @@
+#ifndef H_StdLinuxFileRecords_IP
+#define H_StdLinuxFileRecords_IP
+
+// File records (FC20/FC21) served straight from mmap'ed files, eg. waveform captures written by another process.
+// The files hold big endian 16 bit records. Writable files are mapped shared, so Modbus writes reach the file.
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <registers.h>
+
+class MappedFileStore : public MemoryFileStore
+{
+private:
+    void unmap(const uint16_t File)
+    {
+        RecordFile &file = files[File - 1];
+        if (file.Data != nullptr)
+        {
+            munmap(file.Data, 2 * static_cast<size_t>(file.Records));
+            file = {nullptr, 0, false};
+        }
+    }
+
+public:
+    // Files is user owned storage for Count entries, Files[0] is file 1
+    MappedFileStore(RecordFile *Files, const uint16_t Count) : MemoryFileStore(Files, Count)
+    {
+        for (uint16_t i = 0; i < Count; i++)
+        {
+            Files[i] = {nullptr, 0, false};
+        }
+    };
+    ~MappedFileStore()
+    {
+        for (uint16_t file = 1; file <= fileCount; file++)
+        {
+            unmap(file);
+        }
+    };
+
+    // Serves path as File, up to the first 65535 records. Returns false if it can't be mapped
+    bool Map(const uint16_t File, const char *path, const bool Writable)
+    {
+        if (File == 0 || File > fileCount)
+        {
+            return false;
+        }
+        unmap(File);
+        const int fd = open(path, Writable ? O_RDWR : O_RDONLY);
+        if (fd < 0)
+        {
+            return false;
+        }
+        struct stat status;
+        const bool sized = fstat(fd, &status) == 0 && status.st_size >= 2;
+        const uint16_t records = sized ? (status.st_size / 2 > 0xFFFF ? 0xFFFF : status.st_size / 2) : 0;
+        void *data = sized ? mmap(nullptr, 2 * static_cast<size_t>(records), Writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+        close(fd);
+        if (data == MAP_FAILED)
+        {
+            return false;
+        }
+        files[File - 1] = {static_cast<uint8_t *>(data), records, Writable};
+        return true;
+    }
+    void Unmap(const uint16_t File)
+    {
+        if (File > 0 && File <= fileCount)
+        {
+            unmap(File);
+        }
+    }
+};
+
+#endif
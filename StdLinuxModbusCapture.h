@@ -0,0 +1,182 @@
+#ifndef H_StdLinuxModbusCapture_IP
+#define H_StdLinuxModbusCapture_IP
+
+// Background writer draining a CaptureRing to a file, so the serving thread never waits on disk.
+// NativeCapture files hold every record (see ModbusCapture.h for the layout). PcapCapture files can be opened in
+// Wireshark: MBAP frames are wrapped in synthetic IPv4/TCP headers between 10.0.0.2 (master) and 10.0.0.1:502,
+// RTU and ASCII frames have no pcap equivalent and are counted in Skipped instead.
+
+#include <atomic>
+#include <stdio.h>
+#include <thread>
+#include <time.h>
+#include <registers.h>
+
+uint64_t MonotonicMicros()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return static_cast<uint64_t>(now.tv_sec) * 1000000 + now.tv_nsec / 1000;
+}
+
+enum CaptureFileFormat : uint8_t
+{
+    NativeCapture,
+    PcapCapture,
+};
+
+class CaptureFileWriter
+{
+private:
+    CaptureRing &ring;
+    FILE *file = nullptr;
+    CaptureFileFormat format = NativeCapture;
+    std::thread writer;
+    std::atomic<bool> running{false};
+    uint64_t epochOffset = 0;                 // Added to the ring clock for pcap wall clock timestamps
+    uint32_t sequence[2] = {0x1000, 0x80000}; // TCP sequence numbers per direction
+
+    void writePcapHeader()
+    {
+        const uint32_t magic = 0xA1B2C3D4;
+        const uint16_t version[2] = {2, 4};
+        const uint32_t zone[2] = {0, 0};
+        const uint32_t snapLength = 65535;
+        const uint32_t linkType = 101; // LINKTYPE_RAW, packets start at the IP header
+        fwrite(&magic, sizeof(magic), 1, file);
+        fwrite(version, sizeof(version), 1, file);
+        fwrite(zone, sizeof(zone), 1, file);
+        fwrite(&snapLength, sizeof(snapLength), 1, file);
+        fwrite(&linkType, sizeof(linkType), 1, file);
+    }
+
+    void writePcapRecord(const CaptureRecordHeader &header, const uint8_t *frame)
+    {
+        const bool request = header.Direction == CapturedRequest;
+        const uint16_t total = 40 + header.Length;
+        uint8_t packet[40] = {0x45, 0, static_cast<uint8_t>(total >> 8), static_cast<uint8_t>(total), 0, 0, 0x40, 0, 64, 6};
+        const uint8_t master[4] = {10, 0, 0, 2};
+        const uint8_t server[4] = {10, 0, 0, 1};
+        memcpy(packet + 12, request ? master : server, 4);
+        memcpy(packet + 16, request ? server : master, 4);
+        uint32_t checksum = 0;
+        for (size_t i = 0; i < 20; i += 2)
+        {
+            checksum += CombineBytes(packet[i], packet[i + 1]);
+        }
+        checksum = (checksum & 0xFFFF) + (checksum >> 16);
+        SplitBytes(static_cast<uint16_t>(~checksum), Big, packet + 10);
+
+        // TCP header, the checksum is left 0 which Wireshark accepts by default
+        uint8_t *tcp = packet + 20;
+        SplitBytes(request ? 49152 : 502, Big, tcp);
+        SplitBytes(request ? 502 : 49152, Big, tcp + 2);
+        const uint32_t seq = sequence[request ? 0 : 1];
+        const uint32_t ack = sequence[request ? 1 : 0];
+        const uint8_t numbers[8] = {static_cast<uint8_t>(seq >> 24), static_cast<uint8_t>(seq >> 16), static_cast<uint8_t>(seq >> 8), static_cast<uint8_t>(seq),
+                                    static_cast<uint8_t>(ack >> 24), static_cast<uint8_t>(ack >> 16), static_cast<uint8_t>(ack >> 8), static_cast<uint8_t>(ack)};
+        memcpy(tcp + 4, numbers, 8);
+        tcp[12] = 0x50;
+        tcp[13] = 0x18; // PSH ACK
+        tcp[14] = 0xFF;
+        tcp[15] = 0xFF;
+        sequence[request ? 0 : 1] += header.Length;
+
+        const uint64_t micros = header.Micros + epochOffset;
+        const uint32_t record[4] = {static_cast<uint32_t>(micros / 1000000), static_cast<uint32_t>(micros % 1000000), total, total};
+        fwrite(record, sizeof(record), 1, file);
+        fwrite(packet, sizeof(packet), 1, file);
+        fwrite(frame, header.Length, 1, file);
+    }
+
+    // Returns the number of records written
+    size_t drain()
+    {
+        CaptureRecordHeader header;
+        uint8_t frame[ModbusCaptureMaxFrame];
+        size_t count = 0;
+        while (ring.Next(header, frame))
+        {
+            if (format == NativeCapture)
+            {
+                fwrite(&header, sizeof(header), 1, file);
+                fwrite(frame, header.Length, 1, file);
+            }
+            else if (header.Framing == MBAPFraming)
+            {
+                writePcapRecord(header, frame);
+            }
+            else
+            {
+                Skipped.fetch_add(1, std::memory_order_relaxed);
+            }
+            count++;
+        }
+        return count;
+    }
+
+public:
+    std::atomic<uint32_t> Skipped{0}; // Records with no pcap representation, counted by the writer thread
+
+    explicit CaptureFileWriter(CaptureRing &ring) : ring{ring} {};
+    CaptureFileWriter(const CaptureFileWriter &) = delete;
+    ~CaptureFileWriter() { Close(); };
+
+    // Starts the writer thread, returns false if the file could not be created
+    bool Open(const char *path, const CaptureFileFormat Format)
+    {
+        Close();
+        file = fopen(path, "wb");
+        if (file == nullptr)
+        {
+            return false;
+        }
+        format = Format;
+
+        timespec wall;
+        clock_gettime(CLOCK_REALTIME, &wall);
+        epochOffset = static_cast<uint64_t>(wall.tv_sec) * 1000000 + wall.tv_nsec / 1000 - ring.Now();
+        if (format == NativeCapture)
+        {
+            const CaptureFileHeader header = {.Magic = CaptureFileMagic, .Version = CaptureFileVersion, .Reserved = 0, .StartMicros = ring.Now()};
+            fwrite(&header, sizeof(header), 1, file);
+        }
+        else
+        {
+            writePcapHeader();
+        }
+
+        running = true;
+        writer = std::thread([this]()
+                             {
+                                 while (running.load(std::memory_order_relaxed))
+                                 {
+                                     if (drain() == 0)
+                                     {
+                                         fflush(file);
+                                         timespec pause = {0, 10000000}; // 10ms
+                                         nanosleep(&pause, nullptr);
+                                     }
+                                 } });
+        return true;
+    }
+
+    // Stops the writer after draining what was recorded so far
+    void Close()
+    {
+        if (file == nullptr)
+        {
+            return;
+        }
+        running = false;
+        if (writer.joinable())
+        {
+            writer.join();
+        }
+        drain();
+        fclose(file);
+        file = nullptr;
+    }
+};
+
+#endif
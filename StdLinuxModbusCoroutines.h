@@ -0,0 +1,768 @@
+#ifndef H_StdLinuxModbusCoroutines_IP
+#define H_StdLinuxModbusCoroutines_IP
+
+// C++20 coroutine interface for Modbus TCP on Linux. A single threaded ModbusExecutor runs Task<> coroutines and
+// resumes them when their socket is ready (epoll, edge triggered), so servers and masters are written as straight
+// line code, eg.
+//   Task<> Master(AsyncModbusClient &client) { auto response = co_await client.ReadHolding(0, 10); ... }
+// and thousands of transactions can be in flight without threads. AsyncModbusClient pipelines requests on one
+// connection and matches responses by MBAP transaction id. Objects passed to a task by reference (executor,
+// registers, client) must outlive it. Built on ReceiveTCPFrame, ParseResponsePDU and the PDU structs.
+
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <queue>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include <arpa/inet.h>
+#include <StdLinuxModbusTCP.h>
+
+template <typename T>
+class Task;
+
+struct TaskPromiseBase
+{
+    std::coroutine_handle<> continuation = std::noop_coroutine();
+
+    struct FinalAwaiter
+    {
+        bool await_ready() noexcept { return false; }
+        template <typename Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept
+        {
+            return handle.promise().continuation; // Resume whoever awaited the task
+        }
+        void await_resume() noexcept {}
+    };
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    FinalAwaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() { std::terminate(); } // No exceptions are used by this library
+};
+
+template <typename T>
+struct TaskPromise : TaskPromiseBase
+{
+    T value{};
+    Task<T> get_return_object();
+    void return_value(T result) { value = std::move(result); }
+};
+
+template <>
+struct TaskPromise<void> : TaskPromiseBase
+{
+    Task<void> get_return_object();
+    void return_void() {}
+};
+
+// Lazily started coroutine, runs when awaited or spawned on an executor
+template <typename T = void>
+class Task
+{
+public:
+    using promise_type = TaskPromise<T>;
+
+    explicit Task(std::coroutine_handle<promise_type> handle) : handle{handle} {};
+    Task(Task &&other) noexcept : handle{std::exchange(other.handle, {})} {};
+    Task(const Task &) = delete;
+    ~Task()
+    {
+        if (handle)
+        {
+            handle.destroy();
+        }
+    };
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+    {
+        handle.promise().continuation = awaiting;
+        return handle;
+    }
+    T await_resume()
+    {
+        if constexpr (!std::is_void_v<T>)
+        {
+            return std::move(handle.promise().value);
+        }
+    }
+
+private:
+    std::coroutine_handle<promise_type> handle;
+};
+
+template <typename T>
+Task<T> TaskPromise<T>::get_return_object() { return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this)); }
+inline Task<void> TaskPromise<void>::get_return_object() { return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this)); }
+
+class ModbusExecutor;
+
+// Owns a spawned task, removes itself from the executor and frees itself when done
+struct SpawnedTask
+{
+    struct promise_type
+    {
+        ModbusExecutor *executor = nullptr;
+
+        struct FinalAwaiter
+        {
+            bool await_ready() noexcept { return false; }
+            void await_suspend(std::coroutine_handle<promise_type> handle) noexcept;
+            void await_resume() noexcept {}
+        };
+
+        SpawnedTask get_return_object() { return {std::coroutine_handle<promise_type>::from_promise(*this)}; }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        FinalAwaiter final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+    std::coroutine_handle<promise_type> handle;
+};
+
+// Coroutines waiting on one socket, a reader and a writer at most
+struct SocketWaiters
+{
+    std::coroutine_handle<> reader;
+    std::coroutine_handle<> writer;
+    bool readable = false; // Edge seen with nobody waiting
+    bool writable = false;
+};
+
+class ModbusExecutor
+{
+private:
+    int epollFd = -1;
+    std::vector<std::coroutine_handle<>> ready;
+    std::priority_queue<std::pair<uint32_t, std::coroutine_handle<>>, std::vector<std::pair<uint32_t, std::coroutine_handle<>>>, std::greater<>> timers;
+    std::unordered_set<void *> spawned; // Frame addresses of the SpawnedTasks still running
+
+    static SpawnedTask runSpawned(Task<void> task)
+    {
+        co_await task;
+    }
+
+    struct SocketAwaiter
+    {
+        SocketWaiters &waiters;
+        const bool write;
+
+        bool await_ready()
+        {
+            bool &flag = write ? waiters.writable : waiters.readable;
+            return std::exchange(flag, false);
+        }
+        void await_suspend(std::coroutine_handle<> handle) { (write ? waiters.writer : waiters.reader) = handle; }
+        void await_resume() {}
+    };
+
+    struct SleepAwaiter
+    {
+        ModbusExecutor &executor;
+        const uint32_t deadline;
+
+        bool await_ready() { return false; }
+        void await_suspend(std::coroutine_handle<> handle) { executor.timers.push({deadline, handle}); }
+        void await_resume() {}
+    };
+
+public:
+    ModbusExecutor() { epollFd = epoll_create1(EPOLL_CLOEXEC); };
+    ModbusExecutor(const ModbusExecutor &) = delete;
+    // Tasks still suspended are destroyed, freeing their sockets
+    ~ModbusExecutor()
+    {
+        while (!spawned.empty())
+        {
+            void *frame = *spawned.begin();
+            spawned.erase(spawned.begin());
+            std::coroutine_handle<>::from_address(frame).destroy();
+        }
+        close(epollFd);
+    };
+
+    // Runs task to completion alongside the others, the executor owns it. It starts on the next RunOnce()
+    void Spawn(Task<void> task)
+    {
+        SpawnedTask owner = runSpawned(std::move(task));
+        owner.handle.promise().executor = this;
+        spawned.insert(owner.handle.address());
+        ready.push_back(owner.handle);
+    }
+    void Finished(std::coroutine_handle<> handle) { spawned.erase(handle.address()); }
+    size_t Tasks() const { return spawned.size(); }
+    void Post(std::coroutine_handle<> handle) { ready.push_back(handle); }
+
+    // Edge triggered, registered once per socket
+    bool Watch(const int fd, SocketWaiters &waiters)
+    {
+        epoll_event event = {};
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.ptr = &waiters;
+        return epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) == 0;
+    }
+    void Unwatch(const int fd) { epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr); }
+
+    SocketAwaiter Readable(SocketWaiters &waiters) { return {waiters, false}; }
+    SocketAwaiter Writable(SocketWaiters &waiters) { return {waiters, true}; }
+    SleepAwaiter Sleep(const uint32_t millis) { return {*this, MonotonicMillis() + millis}; }
+
+    // Runs everything ready, then waits up to timeoutMillis (-1 forever) for sockets or timers. Returns false once no tasks remain
+    bool RunOnce(int timeoutMillis)
+    {
+        while (!ready.empty())
+        {
+            std::vector<std::coroutine_handle<>> batch;
+            batch.swap(ready);
+            for (auto handle : batch)
+            {
+                handle.resume();
+            }
+        }
+        if (spawned.empty())
+        {
+            return false;
+        }
+
+        const uint32_t now = MonotonicMillis();
+        if (!timers.empty())
+        {
+            const int32_t untilTimer = static_cast<int32_t>(timers.top().first - now);
+            const int wait = untilTimer > 0 ? untilTimer : 0;
+            timeoutMillis = timeoutMillis < 0 || wait < timeoutMillis ? wait : timeoutMillis;
+        }
+
+        std::array<epoll_event, 64> events;
+        const int count = epoll_wait(epollFd, events.data(), events.size(), timeoutMillis);
+        for (int i = 0; i < count; i++)
+        {
+            SocketWaiters &waiters = *static_cast<SocketWaiters *>(events[i].data.ptr);
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+            {
+                waiters.reader ? ready.push_back(std::exchange(waiters.reader, nullptr)) : void(waiters.readable = true);
+            }
+            if (events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+            {
+                waiters.writer ? ready.push_back(std::exchange(waiters.writer, nullptr)) : void(waiters.writable = true);
+            }
+        }
+
+        const uint32_t after = MonotonicMillis();
+        while (!timers.empty() && static_cast<int32_t>(after - timers.top().first) >= 0)
+        {
+            ready.push_back(timers.top().second);
+            timers.pop();
+        }
+        return true;
+    }
+
+    void Run()
+    {
+        while (RunOnce(-1))
+        {
+        }
+    }
+};
+
+inline void SpawnedTask::promise_type::FinalAwaiter::await_suspend(std::coroutine_handle<promise_type> handle) noexcept
+{
+    handle.promise().executor->Finished(handle);
+    handle.destroy();
+}
+
+// Counting semaphore for coroutines, waiters are resumed in order. The limit may change while in use
+class AsyncSemaphore
+{
+private:
+    ModbusExecutor &executor;
+    std::deque<std::coroutine_handle<>> waiters;
+    size_t limit;
+    size_t used = 0;
+
+    struct AcquireAwaiter
+    {
+        AsyncSemaphore &semaphore;
+        bool await_ready()
+        {
+            if (semaphore.used < semaphore.limit && semaphore.waiters.empty())
+            {
+                semaphore.used++;
+                return true;
+            }
+            return false;
+        }
+        void await_suspend(std::coroutine_handle<> handle) { semaphore.waiters.push_back(handle); }
+        void await_resume() {}
+    };
+
+    void wake()
+    {
+        while (used < limit && !waiters.empty())
+        {
+            used++;
+            executor.Post(waiters.front());
+            waiters.pop_front();
+        }
+    }
+
+public:
+    AsyncSemaphore(ModbusExecutor &executor, const size_t Limit) : executor{executor}, limit{Limit} {};
+    AsyncSemaphore(const AsyncSemaphore &) = delete;
+    ~AsyncSemaphore() {};
+
+    AcquireAwaiter Acquire() { return {*this}; }
+    void Release()
+    {
+        used--;
+        wake();
+    }
+    void SetLimit(const size_t Limit)
+    {
+        limit = Limit;
+        wake();
+    }
+    size_t Limit() const { return limit; }
+    size_t InUse() const { return used; }
+    size_t Waiting() const { return waiters.size(); }
+};
+
+// Non blocking socket owned by a coroutine, its address must stay fixed while watched
+class AsyncSocket
+{
+private:
+    ModbusExecutor &executor;
+    int fd = -1;
+    SocketWaiters waiters;
+
+public:
+    AsyncSocket(ModbusExecutor &executor, const int fd) : executor{executor} { Attach(fd); };
+    explicit AsyncSocket(ModbusExecutor &executor) : executor{executor} {};
+    AsyncSocket(const AsyncSocket &) = delete;
+    ~AsyncSocket() { Close(); };
+
+    bool Attach(const int socketFd)
+    {
+        Close();
+        fd = socketFd;
+        waiters.readable = false;
+        waiters.writable = false;
+        return fd >= 0 && executor.Watch(fd, waiters);
+    }
+    int Fd() const { return fd; }
+    bool IsOpen() const { return fd >= 0; }
+
+    // Returns the bytes read, 0 once the peer closed or on errors
+    Task<size_t> ReadSome(uint8_t *buffer, const size_t size)
+    {
+        for (;;)
+        {
+            const ssize_t received = recv(fd, buffer, size, 0);
+            if (received >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+            {
+                co_return received > 0 ? received : 0;
+            }
+            co_await executor.Readable(waiters);
+        }
+    }
+    Task<bool> WriteAll(const uint8_t *buffer, size_t size)
+    {
+        while (size > 0)
+        {
+            const ssize_t sent = send(fd, buffer, size, MSG_NOSIGNAL);
+            if (sent < 0)
+            {
+                if (errno != EAGAIN && errno != EWOULDBLOCK)
+                {
+                    co_return false;
+                }
+                co_await executor.Writable(waiters);
+                continue;
+            }
+            buffer += sent;
+            size -= sent;
+        }
+        co_return true;
+    }
+    // Returns the connected socket, -1 on errors
+    Task<int> Accept()
+    {
+        for (;;)
+        {
+            const int client = accept4(fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (client >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+            {
+                co_return client;
+            }
+            co_await executor.Readable(waiters);
+        }
+    }
+    Task<bool> Connect(const char *host, const uint16_t port)
+    {
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(port);
+        if (inet_pton(AF_INET, host, &address.sin_addr) != 1 || !Attach(socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)))
+        {
+            co_return false;
+        }
+        const int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        if (connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) == 0)
+        {
+            co_return true;
+        }
+        if (errno != EINPROGRESS)
+        {
+            co_return false;
+        }
+        co_await executor.Writable(waiters);
+        int error = 0;
+        socklen_t length = sizeof(error);
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length);
+        co_return error == 0;
+    }
+
+    // Wakes any waiting coroutine, which then sees the socket closed
+    void Shutdown()
+    {
+        if (fd >= 0)
+        {
+            shutdown(fd, SHUT_RDWR);
+        }
+    }
+    void Close()
+    {
+        if (fd >= 0)
+        {
+            executor.Unwatch(fd);
+            close(fd);
+            fd = -1;
+        }
+    }
+};
+
+// Server side of one client connection, eg. for (;;) { auto length = co_await connection.ReadFrame(); ... }
+class AsyncConnection
+{
+private:
+    AsyncSocket socket;
+    std::array<uint8_t, ModbusTCPMaxFrame * 4> rx;
+    size_t rxLength = 0;
+    size_t frameLength = 0; // Frame handed out by the last ReadFrame()
+
+public:
+    AsyncConnection(ModbusExecutor &executor, const int fd) : socket{executor, fd} {};
+
+    // Waits for the next complete MBAP frame, available at Frame() until the next call.
+    // Returns its length, 0 once the client closed or sent a frame that can't be valid
+    Task<size_t> ReadFrame()
+    {
+        rxLength -= frameLength;
+        memmove(rx.data(), rx.data() + frameLength, rxLength);
+        frameLength = 0;
+        for (;;)
+        {
+            const size_t length = TCPFrameLength(rx.data(), rxLength);
+            if (length > ModbusTCPMaxFrame || (length != 0 && length < 8))
+            {
+                co_return 0;
+            }
+            if (length != 0 && length <= rxLength)
+            {
+                frameLength = length;
+                co_return length;
+            }
+            const size_t received = co_await socket.ReadSome(rx.data() + rxLength, rx.size() - rxLength);
+            if (received == 0)
+            {
+                co_return 0;
+            }
+            rxLength += received;
+        }
+    }
+    // Followed by any pipelined requests, copy it out before building a response in place
+    uint8_t *Frame() { return rx.data(); }
+    Task<bool> Write(const uint8_t *frame, const size_t length) { return socket.WriteAll(frame, length); }
+};
+
+// Serves one client until it disconnects
+Task<void> ServeModbusClient(ModbusExecutor &executor, Registers &registers, const int fd)
+{
+    AsyncConnection connection(executor, fd);
+    std::array<uint8_t, ModbusTCPMaxFrame> frame;
+    FixedArena<ModbusArenaSize> arena;
+    for (;;)
+    {
+        const size_t length = co_await connection.ReadFrame();
+        if (length == 0)
+        {
+            co_return;
+        }
+        memcpy(frame.data(), connection.Frame(), length);
+        size_t responseLength;
+        {
+            ArenaScope scope(arena);
+            responseLength = ReceiveTCPFrame(registers, frame.data(), frame.size(), length);
+        }
+        if (responseLength > 0 && !co_await connection.Write(frame.data(), responseLength))
+        {
+            co_return;
+        }
+    }
+}
+
+// Accepts clients on ServerPort and spawns a ServeModbusClient() task for each, returns if the port can't be opened
+Task<void> ServeModbusTCP(ModbusExecutor &executor, Registers &registers, const uint16_t ServerPort)
+{
+    AsyncSocket listener(executor);
+    const int fd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    const int on = 1;
+    const int off = 0;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+    sockaddr_in6 address = {};
+    address.sin6_family = AF_INET6;
+    address.sin6_addr = in6addr_any;
+    address.sin6_port = htons(ServerPort);
+    if (bind(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 || listen(fd, 64) != 0 || !listener.Attach(fd))
+    {
+        close(fd);
+        co_return;
+    }
+    for (;;)
+    {
+        const int client = co_await listener.Accept();
+        if (client < 0)
+        {
+            co_return;
+        }
+        const int on = 1;
+        setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        executor.Spawn(ServeModbusClient(executor, registers, client));
+    }
+}
+
+// Modbus TCP master, any number of coroutines may have requests in flight on the connection at once
+class AsyncModbusClient
+{
+private:
+    struct PendingTransaction
+    {
+        std::coroutine_handle<> waiter;
+        ModbusResponsePDU response;
+        uint32_t deadline;
+        bool done = false;
+    };
+    struct ResponseAwaiter
+    {
+        PendingTransaction &pending;
+        bool await_ready() { return pending.done; }
+        void await_suspend(std::coroutine_handle<> handle) { pending.waiter = handle; }
+        void await_resume() {}
+    };
+
+    ModbusExecutor &executor;
+    AsyncSocket socket;
+    std::unordered_map<uint16_t, PendingTransaction *> pending;
+    std::vector<uint8_t> outgoing;
+    bool writing = false;
+    bool connected = false;
+    uint16_t nextTransaction = 0;
+    uint32_t connection = 0; // Ends the expiry task of a previous connection
+
+    void complete(PendingTransaction &transaction, ModbusResponsePDU response)
+    {
+        transaction.response = std::move(response);
+        transaction.done = true;
+        if (transaction.waiter)
+        {
+            executor.Post(transaction.waiter);
+        }
+    }
+
+    void failAll()
+    {
+        connected = false;
+        for (auto &entry : pending)
+        {
+            complete(*entry.second, CreateErroredResponse(SlaveDeviceFailure));
+        }
+        pending.clear();
+    }
+
+    Task<void> readResponses()
+    {
+        std::array<uint8_t, ModbusTCPMaxFrame * 4> rx;
+        size_t rxLength = 0;
+        for (;;)
+        {
+            const size_t length = TCPFrameLength(rx.data(), rxLength);
+            if (length > ModbusTCPMaxFrame || (length != 0 && length < 8))
+            {
+                break; // Out of sync
+            }
+            if (length != 0 && length <= rxLength)
+            {
+                const MBAPHead header = MBAPfromBytes(rx.data());
+                const auto transaction = pending.find(header.TransactionID);
+                if (transaction != pending.end())
+                {
+                    PendingTransaction &waiting = *transaction->second;
+                    pending.erase(transaction);
+                    complete(waiting, ParseResponsePDU(rx.data() + 7));
+                }
+                rxLength -= length;
+                memmove(rx.data(), rx.data() + length, rxLength);
+                continue;
+            }
+            const size_t received = co_await socket.ReadSome(rx.data() + rxLength, rx.size() - rxLength);
+            if (received == 0)
+            {
+                break;
+            }
+            rxLength += received;
+        }
+        failAll();
+    }
+
+    Task<void> expireTransactions(const uint32_t generation)
+    {
+        while (connected && generation == connection)
+        {
+            co_await executor.Sleep(TimeoutMillis > 40 ? TimeoutMillis / 4 : 10);
+            if (TimeoutMillis == 0)
+            {
+                continue;
+            }
+            const uint32_t now = MonotonicMillis();
+            for (auto entry = pending.begin(); entry != pending.end();)
+            {
+                if (static_cast<int32_t>(now - entry->second->deadline) >= 0)
+                {
+                    Timeouts++;
+                    complete(*entry->second, CreateErroredResponse(GatewayTargetFailedToRespond));
+                    entry = pending.erase(entry); // A late response is then discarded
+                }
+                else
+                {
+                    ++entry;
+                }
+            }
+        }
+    }
+
+    Task<void> flush()
+    {
+        std::vector<uint8_t> batch;
+        while (!outgoing.empty())
+        {
+            batch.swap(outgoing);
+            if (!co_await socket.WriteAll(batch.data(), batch.size()))
+            {
+                socket.Shutdown(); // The reader fails every pending transaction
+                break;
+            }
+            batch.clear();
+        }
+        writing = false;
+    }
+
+public:
+    uint8_t UnitID = 1;
+    uint32_t TimeoutMillis = 0; // Unanswered requests fail with GatewayTargetFailedToRespond, 0 waits forever
+    uint32_t Timeouts = 0;
+
+    explicit AsyncModbusClient(ModbusExecutor &executor) : executor{executor}, socket{executor} {};
+    AsyncModbusClient(const AsyncModbusClient &) = delete;
+    ~AsyncModbusClient() {};
+
+    // The client must outlive Close() and the executor run that follows it, its tasks refer to it.
+    // May be called again to reconnect once IsConnected() is false
+    Task<bool> Connect(const char *host, const uint16_t port)
+    {
+        connected = co_await socket.Connect(host, port);
+        if (connected)
+        {
+            executor.Spawn(readResponses());
+            executor.Spawn(expireTransactions(++connection));
+        }
+        co_return connected;
+    }
+    void Close() { socket.Shutdown(); }
+    bool IsConnected() const { return connected; }
+    size_t InFlight() const { return pending.size(); }
+
+    // Sends the request and waits for its response, SlaveDeviceFailure if the connection is lost.
+    // Taken by value as the task starts after the caller's temporaries are gone
+    Task<ModbusResponsePDU> Transact(const ModbusRequestPDU request) { return Transact(request, UnitID); }
+
+    // Addressed to Unit, for gateways serving several devices on one connection
+    Task<ModbusResponsePDU> Transact(const ModbusRequestPDU request, const uint8_t Unit)
+    {
+        if (!connected || pending.size() >= 0xFFFF)
+        {
+            co_return CreateErroredResponse(SlaveDeviceFailure);
+        }
+        PendingTransaction transaction;
+        transaction.deadline = MonotonicMillis() + TimeoutMillis;
+        uint16_t id = nextTransaction++;
+        while (pending.count(id) != 0)
+        {
+            id = nextTransaction++;
+        }
+        pending[id] = &transaction;
+
+        uint8_t frame[ModbusTCPMaxFrame];
+        const uint8_t length = getRequestByteLength(request);
+        getMBAPBytes({.TransactionID = id, .ProtocolID = 0, .Length = static_cast<uint16_t>(length + 1), .UnitID = Unit}, frame);
+        getRequestBytes(request, frame + 7);
+        outgoing.insert(outgoing.end(), frame, frame + 7 + length);
+        if (!writing)
+        {
+            writing = true;
+            executor.Spawn(flush());
+        }
+
+        co_await ResponseAwaiter{transaction};
+        co_return std::move(transaction.response);
+    }
+
+    Task<ModbusResponsePDU> ReadHolding(const uint16_t Address, const uint16_t Count)
+    {
+        return Transact({.FunctionCode = ReadHoldingRegisters, .Address = Address, .NumberOfRegisters = Count, .RegisterValue = 0, .DataByteCount = 0, .Values = {}});
+    }
+    Task<ModbusResponsePDU> ReadInputs(const uint16_t Address, const uint16_t Count)
+    {
+        return Transact({.FunctionCode = ReadInputRegisters, .Address = Address, .NumberOfRegisters = Count, .RegisterValue = 0, .DataByteCount = 0, .Values = {}});
+    }
+    Task<ModbusResponsePDU> ReadCoils(const uint16_t Address, const uint16_t Count)
+    {
+        return Transact({.FunctionCode = ModbusFunction::ReadCoils, .Address = Address, .NumberOfRegisters = Count, .RegisterValue = 0, .DataByteCount = 0, .Values = {}});
+    }
+    // FC24, the queued values are in RegisterValue
+    Task<ModbusResponsePDU> ReadFIFO(const uint16_t Address)
+    {
+        return Transact({.FunctionCode = ReadFIFOQueue, .Address = Address, .NumberOfRegisters = 0, .RegisterValue = 0, .DataByteCount = 0, .Values = {}});
+    }
+    Task<ModbusResponsePDU> WriteHolding(const uint16_t Address, const uint16_t Value)
+    {
+        return Transact({.FunctionCode = WriteSingleHoldingRegister, .Address = Address, .NumberOfRegisters = 0, .RegisterValue = Value, .DataByteCount = 0, .Values = {}});
+    }
+    // Values in host order, sent big endian
+    Task<ModbusResponsePDU> WriteHolding(const uint16_t Address, const uint16_t *Values, const uint8_t Count)
+    {
+        ModbusRequestPDU request = {.FunctionCode = WriteMultipleHoldingRegisters, .Address = Address, .NumberOfRegisters = Count, .RegisterValue = 0, .DataByteCount = static_cast<uint8_t>(2 * Count), .Values = {}};
+        request.Values.resize(request.DataByteCount);
+        for (uint8_t i = 0; i < Count; i++)
+        {
+            SplitBytes(Values[i], Big, request.Values.data() + 2 * i);
+        }
+        return Transact(request);
+    }
+};
+
+#endif
@@ -0,0 +1,343 @@
+#ifndef H_StdLinuxModbusPoller_IP
+#define H_StdLinuxModbusPoller_IP
+
+// Polling master for data collectors reading many devices over a fixed set of TCP links (direct or through
+// gateways, addressed by unit id). Tags are read at their own period. Start() plans the polls: tags of one device
+// with the same function and period are coalesced into as few requests as possible, bridging gaps of up to MaxGap
+// unused registers. Each planned request then runs as its own coroutine on the ModbusExecutor.
+//
+// In flight transactions are bounded per link and per device. The device window adapts AIMD style: it grows by one
+// after a window's worth of good responses and halves on a timeout or SlaveDeviceBusy, so a slow device stops
+// holding link slots that faster devices could use. After OfflineAfter consecutive timeouts a device is only
+// probed every backoff interval, doubling up to MaxBackoffMillis. Links reconnect by themselves.
+
+#include <algorithm>
+#include <deque>
+#include <StdLinuxModbusCoroutines.h>
+
+struct PollTag
+{
+    uint16_t Device;
+    ModbusFunction Function; // ReadCoils, ReadDiscreteInputs, ReadHoldingRegisters or ReadInputRegisters
+    uint16_t Address;
+    uint16_t Count;
+    uint32_t PeriodMillis;
+    uint16_t *Values;       // Count registers, or one 0/1 per bit
+    uint32_t UpdatedMillis; // MonotonicMillis() of the last good read
+    ModbusError Error;      // Of the last read
+};
+
+struct PollDeviceStatus
+{
+    uint8_t UnitID;
+    uint16_t Window;        // Current in flight limit
+    uint32_t LatencyMicros; // Smoothed round trip
+    uint16_t Failures;      // Consecutive timeouts
+    bool Online;
+};
+
+struct PollerStats
+{
+    uint64_t Requests;
+    uint64_t Responses;
+    uint64_t Exceptions; // Exception responses other than SlaveDeviceBusy
+    uint64_t Timeouts;
+    uint64_t Points;  // Registers or bits delivered to tags
+    uint64_t Skipped; // Polls not sent, the link was down, the device offline or the poll overran its period
+};
+
+class ModbusPoller
+{
+private:
+    struct PollLink
+    {
+        AsyncModbusClient Client;
+        AsyncSemaphore Window;
+        const char *Host;
+        uint16_t Port;
+
+        PollLink(ModbusExecutor &executor, const char *Host, const uint16_t Port, const uint16_t MaxInFlight, const uint32_t TimeoutMillis)
+            : Client{executor}, Window{executor, MaxInFlight}, Host{Host}, Port{Port}
+        {
+            Client.TimeoutMillis = TimeoutMillis;
+        };
+    };
+
+    struct PollDevice
+    {
+        uint16_t Link;
+        uint8_t UnitID;
+        uint16_t MaxInFlight;
+        AsyncSemaphore Window;
+        uint32_t LatencyMicros = 0;
+        uint16_t Failures = 0;
+        uint16_t Successes = 0; // Since the window last grew
+        uint32_t OfflineUntil = 0;
+        uint32_t Backoff = 0;
+        bool Offline = false;
+
+        PollDevice(ModbusExecutor &executor, const uint16_t Link, const uint8_t UnitID, const uint16_t MaxInFlight)
+            : Link{Link}, UnitID{UnitID}, MaxInFlight{MaxInFlight}, Window{executor, MaxInFlight} {};
+    };
+
+    struct PollRequest
+    {
+        uint16_t Device;
+        ModbusFunction Function;
+        uint16_t Address;
+        uint16_t Count;
+        uint32_t PeriodMillis;
+        uint32_t FirstTag; // Range of tagOrder served by this request
+        uint32_t TagCount;
+    };
+
+    ModbusExecutor &executor;
+    std::deque<PollLink> links;
+    std::deque<PollDevice> devices;
+    std::vector<PollTag> tags;
+    std::vector<uint32_t> tagOrder;
+    std::vector<PollRequest> requests;
+    bool running = false;
+
+    static bool isBits(const ModbusFunction Function) { return Function == ReadCoils || Function == ReadDiscreteInputs; }
+    static uint16_t maxCount(const ModbusFunction Function) { return isBits(Function) ? 2000 : 125; }
+    static uint32_t nowMicros()
+    {
+        timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return static_cast<uint32_t>(static_cast<uint64_t>(now.tv_sec) * 1000000 + now.tv_nsec / 1000);
+    }
+
+    void plan()
+    {
+        tagOrder.resize(tags.size());
+        for (uint32_t i = 0; i < tags.size(); i++)
+        {
+            tagOrder[i] = i;
+        }
+        std::sort(tagOrder.begin(), tagOrder.end(), [this](const uint32_t a, const uint32_t b)
+                  {
+                      const PollTag &x = tags[a];
+                      const PollTag &y = tags[b];
+                      return std::tie(x.Device, x.Function, x.PeriodMillis, x.Address) < std::tie(y.Device, y.Function, y.PeriodMillis, y.Address);
+                  });
+
+        requests.clear();
+        for (uint32_t i = 0; i < tagOrder.size(); i++)
+        {
+            const PollTag &tag = tags[tagOrder[i]];
+            if (!requests.empty())
+            {
+                PollRequest &last = requests.back();
+                const uint32_t end = static_cast<uint32_t>(last.Address) + last.Count;
+                const uint32_t tagEnd = static_cast<uint32_t>(tag.Address) + tag.Count;
+                if (last.Device == tag.Device && last.Function == tag.Function && last.PeriodMillis == tag.PeriodMillis &&
+                    tag.Address <= end + MaxGap && tagEnd - last.Address <= maxCount(tag.Function))
+                {
+                    last.Count = std::max(end, tagEnd) - last.Address;
+                    last.TagCount++;
+                    continue;
+                }
+            }
+            requests.push_back({tag.Device, tag.Function, tag.Address, tag.Count, tag.PeriodMillis, i, 1});
+        }
+    }
+
+    // Slows the device down after a timeout or busy response
+    void backOff(PollDevice &device, const bool timedOut)
+    {
+        device.Window.SetLimit(std::max<size_t>(1, device.Window.Limit() / 2));
+        device.Successes = 0;
+        if (timedOut && ++device.Failures >= OfflineAfter)
+        {
+            device.Backoff = device.Backoff == 0 ? BackoffMillis : std::min(device.Backoff * 2, MaxBackoffMillis);
+            device.OfflineUntil = MonotonicMillis() + device.Backoff;
+            device.Offline = true;
+        }
+    }
+
+    void answered(PollDevice &device, const uint32_t latency)
+    {
+        device.Failures = 0;
+        device.Backoff = 0;
+        device.Offline = false;
+        device.LatencyMicros = device.LatencyMicros == 0 ? latency : (7 * device.LatencyMicros + latency) / 8;
+        if (++device.Successes >= device.Window.Limit() && device.Window.Limit() < device.MaxInFlight)
+        {
+            device.Window.SetLimit(device.Window.Limit() + 1);
+            device.Successes = 0;
+        }
+    }
+
+    // Copies the points to the tags, or records the error on them
+    void deliver(const PollRequest &request, const ModbusResponsePDU &response, const uint32_t now)
+    {
+        const bool bits = isBits(request.Function);
+        const size_t needed = bits ? (request.Count + 7) / 8 : 2 * request.Count;
+        const ModbusError error = response.Error != NoError || response.RegisterValue.size() >= needed ? response.Error : IllegalDataValue;
+        const uint8_t *data = response.RegisterValue.data();
+        for (uint32_t i = request.FirstTag; i < request.FirstTag + request.TagCount; i++)
+        {
+            PollTag &tag = tags[tagOrder[i]];
+            tag.Error = error;
+            if (error != NoError)
+            {
+                continue;
+            }
+            const uint16_t offset = tag.Address - request.Address;
+            for (uint16_t j = 0; j < tag.Count; j++)
+            {
+                const uint16_t point = offset + j;
+                tag.Values[j] = bits ? (data[point / 8] >> (point % 8)) & 1 : CombineBytes(data[2 * point], data[2 * point + 1]);
+            }
+            tag.UpdatedMillis = now;
+            Stats.Points += tag.Count;
+        }
+    }
+
+    Task<void> pollRequest(const uint32_t index)
+    {
+        const PollRequest &request = requests[index];
+        PollDevice &device = devices[request.Device];
+        PollLink &link = links[device.Link];
+        const ModbusRequestPDU pdu = {.FunctionCode = request.Function, .Address = request.Address, .NumberOfRegisters = request.Count, .RegisterValue = 0, .DataByteCount = 0, .Values = {}};
+
+        // Spread the first polls over the period rather than sending them all at once
+        uint32_t due = MonotonicMillis() + (index * 7919u) % request.PeriodMillis;
+        while (running)
+        {
+            const int32_t wait = static_cast<int32_t>(due - MonotonicMillis());
+            if (wait > 0)
+            {
+                co_await executor.Sleep(wait);
+            }
+            const uint32_t now = MonotonicMillis();
+            due += request.PeriodMillis;
+            const bool overran = static_cast<int32_t>(now - due) >= 0;
+            if (overran)
+            {
+                due = now + request.PeriodMillis; // Missed a whole period, resynchronise instead of bursting
+            }
+            if (!running || !link.Client.IsConnected() || (device.Offline && static_cast<int32_t>(now - device.OfflineUntil) < 0))
+            {
+                Stats.Skipped++;
+                continue;
+            }
+            if (overran)
+            {
+                Stats.Skipped++; // The missed period, already counted above when this poll is skipped too
+            }
+
+            co_await device.Window.Acquire();
+            co_await link.Window.Acquire();
+            Stats.Requests++;
+            const uint32_t start = nowMicros();
+            const ModbusResponsePDU response = co_await link.Client.Transact(pdu, device.UnitID);
+            link.Window.Release();
+
+            if (response.Error == GatewayTargetFailedToRespond)
+            {
+                Stats.Timeouts++;
+                backOff(device, true);
+                deliver(request, response, 0);
+            }
+            else if (response.Error == SlaveDeviceBusy)
+            {
+                Stats.Exceptions++;
+                backOff(device, false);
+                deliver(request, response, 0);
+            }
+            else if (link.Client.IsConnected())
+            {
+                Stats.Responses++;
+                Stats.Exceptions += response.Error != NoError;
+                answered(device, nowMicros() - start);
+                deliver(request, response, MonotonicMillis());
+            }
+            device.Window.Release();
+        }
+    }
+
+    Task<void> maintainLink(PollLink &link)
+    {
+        while (running)
+        {
+            if (!link.Client.IsConnected())
+            {
+                co_await link.Client.Connect(link.Host, link.Port);
+            }
+            co_await executor.Sleep(ReconnectMillis);
+        }
+        link.Client.Close();
+    }
+
+public:
+    uint16_t MaxGap = 8;             // Unused registers (or bits) read to join two tags into one request
+    uint16_t OfflineAfter = 3;       // Consecutive timeouts before a device is only probed
+    uint32_t BackoffMillis = 1000;   // First probe interval of an offline device
+    uint32_t MaxBackoffMillis = 60000;
+    uint32_t ReconnectMillis = 1000; // Also how often links are checked
+    PollerStats Stats = {};
+
+    explicit ModbusPoller(ModbusExecutor &executor) : executor{executor} {};
+    ModbusPoller(const ModbusPoller &) = delete;
+    ~ModbusPoller() {};
+
+    // Host must stay valid while the poller runs. Returns the link number for AddDevice()
+    uint16_t AddLink(const char *Host, const uint16_t Port, const uint16_t MaxInFlight = 16, const uint32_t TimeoutMillis = 1000)
+    {
+        links.emplace_back(executor, Host, Port, MaxInFlight, TimeoutMillis);
+        return links.size() - 1;
+    }
+
+    // Returns the device number for AddTag()
+    uint16_t AddDevice(const uint16_t Link, const uint8_t UnitID, const uint16_t MaxInFlight = 4)
+    {
+        devices.emplace_back(executor, Link, UnitID, MaxInFlight);
+        return devices.size() - 1;
+    }
+
+    // Values must hold Count entries and stay valid while the poller runs. Returns false for an unknown device,
+    // a write function or more points than one request can read
+    bool AddTag(const uint16_t Device, const ModbusFunction Function, const uint16_t Address, const uint16_t Count, const uint32_t PeriodMillis, uint16_t *Values)
+    {
+        if (running || Device >= devices.size() || Function < ReadCoils || Function > ReadInputRegisters || Count == 0 || Count > maxCount(Function) || PeriodMillis == 0)
+        {
+            return false;
+        }
+        tags.push_back({Device, Function, Address, Count, PeriodMillis, Values, 0, NoError});
+        return true;
+    }
+
+    // Plans the requests and spawns the polling tasks, tags can't be added afterwards
+    void Start()
+    {
+        if (running)
+        {
+            return;
+        }
+        plan();
+        running = true;
+        for (PollLink &link : links)
+        {
+            executor.Spawn(maintainLink(link));
+        }
+        for (uint32_t i = 0; i < requests.size(); i++)
+        {
+            executor.Spawn(pollRequest(i));
+        }
+    }
+
+    // Polling tasks end at their next wake up, the poller must outlive them
+    void Stop() { running = false; }
+
+    size_t RequestCount() const { return requests.size(); }
+    const PollTag &Tag(const size_t index) const { return tags[index]; }
+    PollDeviceStatus DeviceStatus(const uint16_t Device) const
+    {
+        const PollDevice &device = devices[Device];
+        return {device.UnitID, static_cast<uint16_t>(device.Window.Limit()), device.LatencyMicros, device.Failures, !device.Offline};
+    }
+};
+
+#endif
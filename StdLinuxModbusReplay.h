@@ -0,0 +1,178 @@
+#ifndef H_StdLinuxModbusReplay_IP
+#define H_StdLinuxModbusReplay_IP
+
+// Replays a native capture file (see StdLinuxModbusCapture.h) through a register map. Each recorded request is
+// passed to ReceiveFrame() with its original framing, and the response is compared with the recorded one.
+// Timing is either the original inter-arrival gaps or as fast as possible, and the report gives the throughput
+// and per request latency, so register map changes can be benchmarked against real plant traffic.
+// Responses only match when the register values match those at capture time, eg. a map restored from a shared image.
+
+#include <algorithm>
+#include <stdio.h>
+#include <time.h>
+#include <vector>
+#include <registers.h>
+
+enum ReplayTiming : uint8_t
+{
+    OriginalTiming,
+    AsFastAsPossible,
+};
+
+struct ReplayReport
+{
+    uint32_t Requests;
+    uint32_t Matched;    // Response identical to the recorded one
+    uint32_t Mismatched; // Different response, or only one side answered
+    double ElapsedSeconds;
+    double RequestsPerSecond;
+    uint32_t LatencyP50Nanos;
+    uint32_t LatencyP99Nanos;
+    uint32_t LatencyMaxNanos;
+};
+
+class CaptureReplay
+{
+private:
+    struct Exchange
+    {
+        uint64_t Micros;
+        uint32_t Transaction;
+        uint8_t Framing;
+        uint32_t Request;  // Offsets into records
+        uint16_t RequestLength;
+        uint32_t Response;
+        uint16_t ResponseLength; // 0 if no response was recorded
+    };
+    std::vector<uint8_t> records;
+    std::vector<Exchange> exchanges;
+
+    static uint64_t nowNanos()
+    {
+        timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return static_cast<uint64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+    }
+
+public:
+    CaptureReplay() {};
+    ~CaptureReplay() {};
+
+    // Returns false if the file is missing or not a native capture
+    bool Load(const char *path)
+    {
+        records.clear();
+        exchanges.clear();
+        FILE *file = fopen(path, "rb");
+        if (file == nullptr)
+        {
+            return false;
+        }
+        CaptureFileHeader fileHeader;
+        if (fread(&fileHeader, sizeof(fileHeader), 1, file) != 1 || fileHeader.Magic != CaptureFileMagic || fileHeader.Version != CaptureFileVersion)
+        {
+            fclose(file);
+            return false;
+        }
+
+        uint8_t chunk[4096];
+        size_t count;
+        while ((count = fread(chunk, 1, sizeof(chunk), file)) > 0)
+        {
+            records.insert(records.end(), chunk, chunk + count);
+        }
+        fclose(file);
+
+        // A response directly follows the request of its transaction, invalid requests have none
+        size_t offset = 0;
+        while (offset + sizeof(CaptureRecordHeader) <= records.size())
+        {
+            CaptureRecordHeader header;
+            memcpy(&header, records.data() + offset, sizeof(header));
+            const size_t frame = offset + sizeof(header);
+            if (frame + header.Length > records.size())
+            {
+                break; // Truncated by a writer that didn't close
+            }
+            if (header.Length > ModbusCaptureMaxFrame)
+            {
+                break; // Corrupt, no frame is that long
+            }
+            if (header.Direction == CapturedRequest)
+            {
+                exchanges.push_back({header.Micros, header.Transaction, header.Framing, static_cast<uint32_t>(frame), header.Length, 0, 0});
+            }
+            else if (!exchanges.empty() && exchanges.back().Transaction == header.Transaction)
+            {
+                exchanges.back().Response = frame;
+                exchanges.back().ResponseLength = header.Length;
+            }
+            offset = frame + header.Length;
+        }
+        return true;
+    }
+
+    size_t Count() const { return exchanges.size(); }
+
+    ReplayReport Run(Registers &registers, const ReplayTiming Timing, const uint32_t Repetitions = 1)
+    {
+        ReplayReport report = {};
+        std::vector<uint32_t> latencies;
+        latencies.reserve(exchanges.size() * Repetitions);
+        uint8_t frame[ModbusCaptureMaxFrame];
+
+        const uint64_t start = nowNanos();
+        for (uint32_t pass = 0; pass < Repetitions; pass++)
+        {
+            const uint64_t passStart = nowNanos();
+            for (const Exchange &exchange : exchanges)
+            {
+                if (Timing == OriginalTiming)
+                {
+                    const uint64_t due = passStart + (exchange.Micros - exchanges.front().Micros) * 1000;
+                    const uint64_t now = nowNanos();
+                    if (due > now)
+                    {
+                        const timespec pause = {static_cast<time_t>((due - now) / 1000000000), static_cast<long>((due - now) % 1000000000)};
+                        nanosleep(&pause, nullptr);
+                    }
+                }
+
+                memcpy(frame, records.data() + exchange.Request, exchange.RequestLength);
+                const uint64_t before = nowNanos();
+                const size_t size = ReceiveFrame(static_cast<ModbusFraming>(exchange.Framing), registers, frame, sizeof(frame), exchange.RequestLength);
+                latencies.push_back(nowNanos() - before);
+
+                if (size == exchange.ResponseLength && memcmp(frame, records.data() + exchange.Response, size) == 0)
+                {
+                    report.Matched++;
+                }
+                else
+                {
+                    report.Mismatched++;
+                }
+            }
+        }
+        report.ElapsedSeconds = (nowNanos() - start) / 1e9;
+
+        report.Requests = latencies.size();
+        if (!latencies.empty())
+        {
+            std::sort(latencies.begin(), latencies.end());
+            report.RequestsPerSecond = report.Requests / report.ElapsedSeconds;
+            report.LatencyP50Nanos = latencies[latencies.size() / 2];
+            report.LatencyP99Nanos = latencies[latencies.size() * 99 / 100];
+            report.LatencyMaxNanos = latencies.back();
+        }
+        return report;
+    }
+};
+
+void PrintReplayReport(const ReplayReport &report, FILE *out = stdout)
+{
+    fprintf(out, "requests %u, matched %u, mismatched %u\n", report.Requests, report.Matched, report.Mismatched);
+    fprintf(out, "%.3f s, %.0f requests/s\n", report.ElapsedSeconds, report.RequestsPerSecond);
+    fprintf(out, "latency p50 %u ns, p99 %u ns, max %u ns\n", report.LatencyP50Nanos, report.LatencyP99Nanos, report.LatencyMaxNanos);
+}
+
+#endif
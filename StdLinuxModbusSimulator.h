@@ -0,0 +1,464 @@
+#ifndef H_StdLinuxModbusSimulator_IP
+#define H_StdLinuxModbusSimulator_IP
+
+// Simulated fleet of Modbus TCP devices for load testing masters, all served by one ModbusExecutor thread.
+// Devices are created in batches from a DeviceTemplate. Their holding registers read through to the template's
+// values until a master writes them, then only the written 64 register page is copied, so thousands of devices
+// cost little more than one. Input registers are private to each device and animated in bulk by waveforms.
+// Devices are reached by unit id on a shared port (like a gateway), by port, or both. Faults can add latency,
+// answer with an exception or drop requests. Requests on one connection are answered in order, as a serial
+// gateway would.
+
+#include <cmath>
+#include <deque>
+#include <memory>
+#include <StdLinuxModbusCoroutines.h>
+
+// Holding registers that read through to a shared template until written, then keep a private copy of the written page
+class CopyOnWriteHoldingRegister : public Register
+{
+private:
+    static const uint16_t PageSize = 64;
+    const uint16_t *shared;
+    std::vector<std::unique_ptr<uint16_t[]>> pages; // nullptr while the page is shared
+
+    const uint16_t *find(const uint16_t Address) const
+    {
+        const uint16_t offset = Address - FirstAddress;
+        const uint16_t *page = pages[offset / PageSize].get();
+        return page == nullptr ? shared + offset : page + offset % PageSize;
+    }
+    uint16_t *writable(const uint16_t Address)
+    {
+        const uint16_t offset = Address - FirstAddress;
+        std::unique_ptr<uint16_t[]> &page = pages[offset / PageSize];
+        if (page == nullptr)
+        {
+            const uint16_t first = offset - offset % PageSize;
+            const uint16_t count = std::min<uint32_t>(PageSize, LastAddress - FirstAddress + 1 - first);
+            page.reset(new uint16_t[PageSize]);
+            memcpy(page.get(), shared + first, 2 * count);
+        }
+        return page.get() + offset % PageSize;
+    }
+    // Number of consecutive registers from Address that lie in the same page
+    uint16_t runLength(const uint16_t Address, const uint16_t Count) const
+    {
+        const uint16_t left = PageSize - (Address - FirstAddress) % PageSize;
+        return Count < left ? Count : left;
+    }
+
+public:
+    // Template holds LastAddress - FirstAddress + 1 values and must outlive the register
+    CopyOnWriteHoldingRegister(uint16_t FirstAddress, uint16_t LastAddress, vector<ModbusFunction> FunctionList, const uint16_t *Template)
+        : Register(FirstAddress, LastAddress, FunctionList), shared{Template}, pages((LastAddress - FirstAddress) / PageSize + 1) {};
+    ~CopyOnWriteHoldingRegister() {};
+
+    size_t PrivatePages() const
+    {
+        return std::count_if(pages.begin(), pages.end(), [](const std::unique_ptr<uint16_t[]> &page)
+                             { return page != nullptr; });
+    }
+
+    uint8_t *getDataLocation(const uint16_t Address) const override
+    {
+        return reinterpret_cast<uint8_t *>(const_cast<uint16_t *>(find(Address)));
+    }
+    uint8_t getResponseByteCount(const uint8_t RegistersCount) const override
+    {
+        return RegistersCount * sizeof(uint16_t);
+    }
+    void Write(const uint16_t Address, const uint8_t RegistersCount, uint8_t *dataBuffer) override
+    {
+        for (uint16_t done = 0; done < RegistersCount;)
+        {
+            const uint16_t run = runLength(Address + done, RegistersCount - done);
+            uint16_t *destination = writable(Address + done);
+            for (uint16_t i = 0; i < run; i++)
+            {
+                destination[i] = CombineBytes(dataBuffer[2 * (done + i)], dataBuffer[2 * (done + i) + 1]);
+            }
+            done += run;
+        }
+    }
+    void WriteSingle(const uint16_t Address, const uint16_t value) override
+    {
+        *writable(Address) = value;
+    }
+    void Read(const uint16_t Address, const uint8_t RegistersCount, uint8_t *ResponseBuffer) const override
+    {
+        for (uint16_t done = 0; done < RegistersCount;)
+        {
+            const uint16_t run = runLength(Address + done, RegistersCount - done);
+            const uint16_t *source = find(Address + done);
+            for (uint16_t i = 0; i < run; i++)
+            {
+                SplitBytes(source[i], Big, ResponseBuffer + 2 * (done + i));
+            }
+            done += run;
+        }
+    }
+};
+
+// Both counts must be at least 1
+struct DeviceTemplate
+{
+    uint16_t HoldingCount;         // Holding registers 0 to HoldingCount - 1
+    const uint16_t *HoldingValues; // Initial values, shared by every device until written
+    uint16_t InputCount;           // Input registers 0 to InputCount - 1, set by waveforms
+};
+
+enum WaveShape : uint8_t
+{
+    SineWave,
+    RampWave,
+    SquareWave,
+    RandomWalk, // Steps of up to Amplitude / 16 per update, kept within Offset +- Amplitude
+};
+
+struct Waveform
+{
+    uint16_t Channel; // Input register address
+    WaveShape Shape;
+    float Offset;
+    float Amplitude;
+    uint32_t PeriodMillis;
+    float PhaseStep; // Added per device, in periods, so devices don't move in lockstep
+};
+
+struct FaultProfile
+{
+    uint32_t LatencyMillis;     // Before every response
+    uint32_t JitterMillis;      // Random extra latency up to this
+    uint16_t ExceptionPermille; // Share of requests answered with Exception
+    ModbusError Exception;
+    uint16_t DropPermille; // Share of requests never answered
+};
+
+struct SimulatorStats
+{
+    uint64_t Requests;
+    uint64_t Responses;
+    uint64_t Exceptions; // Injected by fault profiles
+    uint64_t Dropped;
+    uint64_t Unrouted; // No device for the port and unit id, answered with GatewayPathUnavailable
+};
+
+class ModbusSimulator
+{
+private:
+    struct SimulatedDevice
+    {
+        CopyOnWriteHoldingRegister Holding;
+        HoldingRegister Inputs;
+        Registers Map;
+        uint16_t *InputValues;
+        uint16_t InputCount;
+        FaultProfile Faults = {0, 0, 0, SlaveDeviceBusy, 0};
+
+        SimulatedDevice(const DeviceTemplate &Template, uint16_t *InputValues)
+            : Holding(0, Template.HoldingCount - 1, {ReadHoldingRegisters, WriteSingleHoldingRegister, WriteMultipleHoldingRegisters}, Template.HoldingValues),
+              Inputs(0, Template.InputCount - 1, {ReadInputRegisters}, InputValues),
+              Map(std::vector<Register *>{&Holding, &Inputs}),
+              InputValues{InputValues},
+              InputCount{Template.InputCount} {};
+    };
+
+    struct Animation
+    {
+        Waveform Wave;
+        uint32_t FirstDevice;
+        uint32_t Count;
+    };
+
+    static const uint32_t AnyUnit = 0x100;
+
+    ModbusExecutor &executor;
+    std::deque<SimulatedDevice> devices;
+    std::deque<std::unique_ptr<uint16_t[]>> inputBlocks; // One per AddDevices() batch
+    std::vector<Animation> animations;
+    std::unordered_map<uint32_t, uint32_t> routes; // Port << 16 | unit id (or AnyUnit) to device
+    std::vector<uint16_t> ports;
+    std::deque<AsyncSocket> listeners; // One per port while started
+    uint32_t random = 0x9E3779B9;
+    bool running = false;
+
+    uint32_t nextRandom()
+    {
+        random ^= random << 13;
+        random ^= random >> 17;
+        random ^= random << 5;
+        return random;
+    }
+
+    SimulatedDevice *route(const uint16_t port, const uint8_t unit)
+    {
+        auto found = routes.find(static_cast<uint32_t>(port) << 16 | unit);
+        if (found == routes.end())
+        {
+            found = routes.find(static_cast<uint32_t>(port) << 16 | AnyUnit);
+        }
+        return found == routes.end() ? nullptr : &devices[found->second];
+    }
+
+    // Turns the request in frame into an exception response, returns its length
+    static size_t exceptionResponse(uint8_t *frame, const ModbusError Error)
+    {
+        frame[4] = 0;
+        frame[5] = 3;
+        frame[7] |= 0x80;
+        frame[8] = Error;
+        return 9;
+    }
+
+    Task<void> serveConnection(const uint16_t port, const int fd)
+    {
+        AsyncConnection connection(executor, fd);
+        std::array<uint8_t, ModbusTCPMaxFrame> frame;
+        FixedArena<ModbusArenaSize> arena;
+        for (;;)
+        {
+            const size_t length = co_await connection.ReadFrame();
+            if (length == 0)
+            {
+                co_return;
+            }
+            memcpy(frame.data(), connection.Frame(), length);
+            Stats.Requests++;
+
+            size_t responseLength;
+            SimulatedDevice *device = route(port, frame[6]);
+            if (device == nullptr)
+            {
+                Stats.Unrouted++;
+                responseLength = exceptionResponse(frame.data(), GatewayPathUnavailable);
+            }
+            else
+            {
+                const FaultProfile &faults = device->Faults;
+                if (faults.DropPermille > 0 && nextRandom() % 1000 < faults.DropPermille)
+                {
+                    Stats.Dropped++;
+                    continue;
+                }
+                const uint32_t delay = faults.LatencyMillis + (faults.JitterMillis > 0 ? nextRandom() % (faults.JitterMillis + 1) : 0);
+                if (delay > 0)
+                {
+                    co_await executor.Sleep(delay);
+                }
+                if (faults.ExceptionPermille > 0 && nextRandom() % 1000 < faults.ExceptionPermille)
+                {
+                    Stats.Exceptions++;
+                    responseLength = exceptionResponse(frame.data(), faults.Exception);
+                }
+                else
+                {
+                    ArenaScope scope(arena);
+                    responseLength = ReceiveTCPFrame(device->Map, frame.data(), frame.size(), length);
+                }
+            }
+            if (responseLength > 0)
+            {
+                Stats.Responses++;
+                if (!co_await connection.Write(frame.data(), responseLength))
+                {
+                    co_return;
+                }
+            }
+        }
+    }
+
+    Task<void> acceptConnections(const uint16_t port, AsyncSocket &listener)
+    {
+        while (running)
+        {
+            const int client = co_await listener.Accept();
+            if (client < 0 || !running)
+            {
+                if (client >= 0)
+                {
+                    close(client);
+                }
+                break;
+            }
+            const int on = 1;
+            setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+            executor.Spawn(serveConnection(port, client));
+        }
+        listener.Close();
+    }
+
+    Task<void> animate()
+    {
+        while (running)
+        {
+            Animate(MonotonicMillis());
+            co_await executor.Sleep(AnimateMillis);
+        }
+    }
+
+    static int listenOn(const uint16_t port)
+    {
+        const int fd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        const int on = 1;
+        const int off = 0;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+        sockaddr_in6 address = {};
+        address.sin6_family = AF_INET6;
+        address.sin6_addr = in6addr_any;
+        address.sin6_port = htons(port);
+        if (bind(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 || listen(fd, 1024) != 0)
+        {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+public:
+    uint32_t AnimateMillis = 100;
+    SimulatorStats Stats = {};
+
+    explicit ModbusSimulator(ModbusExecutor &executor) : executor{executor} {};
+    ModbusSimulator(const ModbusSimulator &) = delete;
+    ~ModbusSimulator() {};
+
+    // Template must outlive the simulator. Returns the number of the first new device
+    uint32_t AddDevices(const DeviceTemplate &Template, const uint32_t Count)
+    {
+        const uint32_t first = devices.size();
+        inputBlocks.emplace_back(new uint16_t[static_cast<size_t>(Count) * Template.InputCount]());
+        for (uint32_t i = 0; i < Count; i++)
+        {
+            devices.emplace_back(Template, inputBlocks.back().get() + static_cast<size_t>(i) * Template.InputCount);
+        }
+        return first;
+    }
+    size_t DeviceCount() const { return devices.size(); }
+    Registers &DeviceRegisters(const uint32_t Device) { return devices[Device].Map; }
+    size_t PrivatePages(const uint32_t Device) const { return devices[Device].Holding.PrivatePages(); }
+
+    // Serves Device as UnitID on Port
+    void Route(const uint16_t Port, const uint8_t UnitID, const uint32_t Device)
+    {
+        if (std::find(ports.begin(), ports.end(), Port) == ports.end())
+        {
+            ports.push_back(Port);
+        }
+        routes[static_cast<uint32_t>(Port) << 16 | UnitID] = Device;
+    }
+    // Count devices behind one port as unit ids FirstUnit onwards, like a gateway
+    void RouteUnits(const uint16_t Port, const uint32_t FirstDevice, const uint16_t Count, const uint8_t FirstUnit = 1)
+    {
+        for (uint16_t i = 0; i < Count && FirstUnit + i <= 0xFF; i++)
+        {
+            Route(Port, FirstUnit + i, FirstDevice + i);
+        }
+    }
+    // One device per port from FirstPort onwards, answering any unit id
+    void RoutePorts(const uint16_t FirstPort, const uint32_t FirstDevice, const uint32_t Count)
+    {
+        for (uint32_t i = 0; i < Count && FirstPort + i <= 0xFFFF; i++)
+        {
+            if (std::find(ports.begin(), ports.end(), FirstPort + i) == ports.end())
+            {
+                ports.push_back(FirstPort + i);
+            }
+            routes[static_cast<uint32_t>(FirstPort + i) << 16 | AnyUnit] = FirstDevice + i;
+        }
+    }
+
+    void SetWaveform(const uint32_t FirstDevice, const uint32_t Count, const Waveform &Wave)
+    {
+        animations.push_back({Wave, FirstDevice, Count});
+    }
+    void SetFaults(const uint32_t FirstDevice, const uint32_t Count, const FaultProfile &Faults)
+    {
+        for (uint32_t i = FirstDevice; i < FirstDevice + Count && i < devices.size(); i++)
+        {
+            devices[i].Faults = Faults;
+        }
+    }
+
+    // Updates every animated input register for time nowMillis, called by the simulator every AnimateMillis
+    void Animate(const uint32_t nowMillis)
+    {
+        for (const Animation &animation : animations)
+        {
+            const Waveform &wave = animation.Wave;
+            const float base = static_cast<float>(nowMillis % wave.PeriodMillis) / wave.PeriodMillis;
+            const uint32_t last = std::min<size_t>(animation.FirstDevice + animation.Count, devices.size());
+            for (uint32_t i = animation.FirstDevice; i < last; i++)
+            {
+                SimulatedDevice &device = devices[i];
+                if (wave.Channel >= device.InputCount)
+                {
+                    continue;
+                }
+                float phase = base + (i - animation.FirstDevice) * wave.PhaseStep;
+                phase -= std::floor(phase);
+                float value;
+                switch (wave.Shape)
+                {
+                case SineWave:
+                    value = wave.Offset + wave.Amplitude * std::sin(2 * static_cast<float>(M_PI) * phase);
+                    break;
+                case RampWave:
+                    value = wave.Offset + wave.Amplitude * (2 * phase - 1);
+                    break;
+                case SquareWave:
+                    value = wave.Offset + (phase < 0.5f ? wave.Amplitude : -wave.Amplitude);
+                    break;
+                default:
+                {
+                    const float step = wave.Amplitude / 16 * (static_cast<float>(nextRandom() % 2001) / 1000 - 1);
+                    value = std::clamp(device.InputValues[wave.Channel] + step, wave.Offset - wave.Amplitude, wave.Offset + wave.Amplitude);
+                }
+                break;
+                }
+                device.InputValues[wave.Channel] = static_cast<uint16_t>(std::clamp(value, 0.0f, 65535.0f));
+            }
+        }
+    }
+
+    // Opens every routed port and starts serving and animating. Returns false if a port could not be opened
+    bool Start()
+    {
+        std::vector<int> fds;
+        for (const uint16_t port : ports)
+        {
+            const int fd = listenOn(port);
+            if (fd < 0)
+            {
+                for (const int opened : fds)
+                {
+                    close(opened);
+                }
+                return false;
+            }
+            fds.push_back(fd);
+        }
+        running = true;
+        for (size_t i = 0; i < ports.size(); i++)
+        {
+            listeners.emplace_back(executor, fds[i]);
+            executor.Spawn(acceptConnections(ports[i], listeners.back()));
+        }
+        Animate(MonotonicMillis());
+        executor.Spawn(animate());
+        return true;
+    }
+    // Stops animating and closes the ports once the executor next runs, open connections are served until the
+    // executor is destroyed
+    void Stop()
+    {
+        running = false;
+        for (AsyncSocket &listener : listeners)
+        {
+            listener.Shutdown(); // Wakes its acceptConnections(), which closes it
+        }
+    }
+};
+
+#endif
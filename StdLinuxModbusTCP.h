@@ -0,0 +1,350 @@
+#ifndef H_StdLinuxModbusTCP_IP
+#define H_StdLinuxModbusTCP_IP
+
+// Modbus TCP server for Linux built on non blocking sockets and epoll.
+// Requests are read once per connection per Poll() so busy clients can't starve the others, responses are
+// encoded straight into a per connection output buffer and sent with a single send() at the end of the cycle
+
+#include <array>
+#include <vector>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <registers.h>
+#include <ModbusHotReload.h>
+
+#ifndef ModbusTxBufferSize
+#define ModbusTxBufferSize 1024 // Per client response buffer, flushed once per Poll() call
+#endif
+
+static_assert(ModbusTxBufferSize >= ModbusASCIIMaxFrame, "The response buffer must hold at least one frame");
+
+uint32_t MonotonicMillis()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+struct LinuxTCPServerInit
+{
+    uint16_t ServerPort;
+    uint32_t ClientTimeout; // Milliseconds without a request before a client is closed, 0 to never time out
+    int Backlog = 16;
+    ModbusFraming Framing = MBAPFraming; // RTUFraming or ASCIIFraming for serial to Ethernet converters
+};
+
+struct LinuxConnection
+{
+    int fd = -1;
+    uint32_t lastRead = 0;
+    bool queued = false;  // Listed for the end of cycle flush
+    bool blocked = false; // Waiting for EPOLLOUT instead of EPOLLIN until tx drains
+
+    // Partial request frames and queued responses
+    std::array<uint8_t, ModbusASCIIMaxFrame> rx; // Large enough for any framing
+    size_t rxLength = 0;
+    std::array<uint8_t, ModbusTxBufferSize> tx;
+    size_t txLength = 0;
+
+    FixedArena<ModbusArenaSize> arena; // Request and response PDUs, reset after each transaction
+};
+
+class StdLinuxModbusTCPServer
+{
+private:
+    const LinuxTCPServerInit Settings;
+    int listenFd = -1;
+    int epollFd = -1;
+    SlabPool<LinuxConnection> pool; // Connection state is recycled rather than freed
+    std::vector<LinuxConnection *> connections;
+    std::vector<LinuxConnection *> pendingFlush;
+    uint32_t nextTimeoutSweep = 0;
+
+    ServedRegisters served;
+
+    void closeConnection(LinuxConnection &connection)
+    {
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, connection.fd, nullptr);
+        close(connection.fd);
+        connection.fd = -1;
+    }
+
+    // While a client isn't reading its responses it isn't read from either, so its requests wait in the socket
+    void setBlocked(LinuxConnection &connection, const bool blocked)
+    {
+        if (connection.blocked == blocked || connection.fd < 0)
+        {
+            return;
+        }
+        connection.blocked = blocked;
+        epoll_event event = {};
+        event.events = blocked ? EPOLLOUT : EPOLLIN | EPOLLRDHUP;
+        event.data.ptr = &connection;
+        epoll_ctl(epollFd, EPOLL_CTL_MOD, connection.fd, &event);
+    }
+
+    void acceptClients(const uint32_t now)
+    {
+        for (;;)
+        {
+            const int fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0)
+            {
+                return;
+            }
+            const int on = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)); // Responses are already batched per cycle
+
+            LinuxConnection *connection = pool.Create();
+            connection->fd = fd;
+            connection->lastRead = now;
+            epoll_event event = {};
+            event.events = EPOLLIN | EPOLLRDHUP;
+            event.data.ptr = connection;
+            epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event);
+            connections.push_back(connection);
+        }
+    }
+
+    // Returns the number of requests processed
+    uint16_t readClient(LinuxConnection &connection, const uint32_t now)
+    {
+        if (connection.rxLength < connection.rx.size())
+        {
+            const ssize_t received = recv(connection.fd, connection.rx.data() + connection.rxLength, connection.rx.size() - connection.rxLength, 0);
+            if (received == 0 || (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+            {
+                closeConnection(connection);
+                return 0;
+            }
+            if (received > 0)
+            {
+                connection.lastRead = now;
+                connection.rxLength += received;
+            }
+        }
+
+        uint16_t frames = 0;
+        for (;;)
+        {
+            const size_t frameLength = FrameLength(Settings.Framing, connection.rx.data(), connection.rxLength);
+            if (frameLength > MaxFrameLength(Settings.Framing)) // Larger than any valid request, the stream is out of sync
+            {
+                flushClient(connection); // Best effort for the responses already built
+                if (connection.fd >= 0)
+                {
+                    closeConnection(connection);
+                }
+                break;
+            }
+            if (frameLength == 0 || frameLength > connection.rxLength)
+            {
+                break;
+            }
+
+            // Room for the request, and the response built over it, which is at most MaxFrameLength()
+            if (connection.tx.size() - connection.txLength < MaxFrameLength(Settings.Framing) && !flushClient(connection))
+            {
+                break; // Client isn't keeping up with its responses, leave the rest in the socket
+            }
+
+            // The response is built in place in the output buffer
+            uint8_t *response = connection.tx.data() + connection.txLength;
+            memcpy(response, connection.rx.data(), frameLength);
+            ArenaScope scope(connection.arena);
+            connection.txLength += served.Receive(Settings.Framing, response, frameLength);
+            connection.rxLength -= frameLength;
+            memmove(connection.rx.data(), connection.rx.data() + frameLength, connection.rxLength);
+            frames++;
+        }
+
+        if (connection.txLength > 0 && !connection.queued)
+        {
+            connection.queued = true;
+            pendingFlush.push_back(&connection);
+        }
+        return frames;
+    }
+
+    // Sends everything queued for the client in one call, false if some of it couldn't be sent yet
+    bool flushClient(LinuxConnection &connection)
+    {
+        if (connection.fd < 0 || connection.txLength == 0)
+        {
+            return true;
+        }
+        const ssize_t sent = send(connection.fd, connection.tx.data(), connection.txLength, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                closeConnection(connection);
+            }
+            return false;
+        }
+        connection.txLength -= sent;
+        memmove(connection.tx.data(), connection.tx.data() + sent, connection.txLength);
+        return connection.txLength == 0;
+    }
+
+    void sweepTimeouts(const uint32_t now)
+    {
+        if (Settings.ClientTimeout == 0 || static_cast<int32_t>(now - nextTimeoutSweep) < 0)
+        {
+            return;
+        }
+
+        uint32_t earliest = now + Settings.ClientTimeout;
+        for (auto &connection : connections)
+        {
+            const uint32_t deadline = connection->lastRead + Settings.ClientTimeout;
+            if (connection->fd >= 0 && static_cast<int32_t>(now - deadline) >= 0)
+            {
+                closeConnection(*connection);
+            }
+            else if (static_cast<int32_t>(deadline - earliest) < 0)
+            {
+                earliest = deadline;
+            }
+        }
+        nextTimeoutSweep = earliest;
+    }
+
+    void removeClosedConnections()
+    {
+        size_t kept = 0;
+        for (size_t i = 0; i < connections.size(); i++)
+        {
+            if (connections[i]->fd >= 0)
+            {
+                connections[kept++] = connections[i];
+            }
+            else
+            {
+                pool.Destroy(connections[i]);
+            }
+        }
+        connections.resize(kept);
+    }
+
+public:
+    StdLinuxModbusTCPServer(LinuxTCPServerInit ServerSettings, Registers &registers)
+        : Settings{ServerSettings}, served{registers} {};
+    // Serves the current map of Maps, which may be swapped by another thread while clients stay connected
+    StdLinuxModbusTCPServer(LinuxTCPServerInit ServerSettings, RegisterMapSwitch &Maps)
+        : Settings{ServerSettings}, served{Maps} {};
+    ~StdLinuxModbusTCPServer() { Close(); };
+
+    // Returns false if the port could not be opened
+    bool Initialize()
+    {
+        listenFd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (listenFd < 0)
+        {
+            return false;
+        }
+        const int on = 1;
+        const int off = 0;
+        setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        setsockopt(listenFd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off)); // Accept IPv4 clients as well
+
+        sockaddr_in6 address = {};
+        address.sin6_family = AF_INET6;
+        address.sin6_addr = in6addr_any;
+        address.sin6_port = htons(Settings.ServerPort);
+        if (bind(listenFd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 || listen(listenFd, Settings.Backlog) != 0)
+        {
+            Close();
+            return false;
+        }
+
+        epollFd = epoll_create1(EPOLL_CLOEXEC);
+        epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.ptr = nullptr; // nullptr marks the listening socket
+        if (epollFd < 0 || epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &event) != 0)
+        {
+            Close();
+            return false;
+        }
+        return true;
+    }
+
+    // Waits up to timeoutMillis for activity (0 to just check), services every ready client once and then
+    // flushes all queued responses. Returns the number of requests processed
+    uint16_t Poll(const int timeoutMillis)
+    {
+        std::array<epoll_event, 64> events;
+        const int ready = epoll_wait(epollFd, events.data(), events.size(), timeoutMillis);
+        const uint32_t now = MonotonicMillis();
+
+        uint16_t frames = 0;
+        for (int i = 0; i < ready; i++)
+        {
+            LinuxConnection *connection = static_cast<LinuxConnection *>(events[i].data.ptr);
+            if (connection == nullptr)
+            {
+                acceptClients(now);
+            }
+            else if (connection->blocked)
+            {
+                if (flushClient(*connection))
+                {
+                    setBlocked(*connection, false);
+                    frames += readClient(*connection, now); // Requests left in rx won't raise EPOLLIN again
+                }
+            }
+            else if (connection->fd >= 0)
+            {
+                frames += readClient(*connection, now);
+            }
+        }
+
+        sweepTimeouts(now);
+        for (LinuxConnection *connection : pendingFlush)
+        {
+            connection->queued = false;
+            if (!flushClient(*connection))
+            {
+                setBlocked(*connection, true);
+            }
+        }
+        pendingFlush.clear();
+
+        removeClosedConnections();
+        return frames;
+    }
+
+    size_t ClientCount() const { return connections.size(); }
+
+    void Close()
+    {
+        for (LinuxConnection *connection : connections)
+        {
+            if (connection->fd >= 0)
+            {
+                closeConnection(*connection);
+            }
+            pool.Destroy(connection);
+        }
+        connections.clear();
+        pendingFlush.clear();
+        if (epollFd >= 0)
+        {
+            close(epollFd);
+            epollFd = -1;
+        }
+        if (listenFd >= 0)
+        {
+            close(listenFd);
+            listenFd = -1;
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,212 @@
+#ifndef H_StdLinuxModbusUDP_IP
+#define H_StdLinuxModbusUDP_IP
+
+// Modbus UDP server for Linux. Each datagram carries one MBAP framed request, as with TCP.
+// Datagrams are received and answered in batches with recvmmsg()/sendmmsg(), so a batch costs two system calls
+// however many requests it holds. Several sockets can share the port through SO_REUSEPORT, the kernel then spreads
+// clients across them by source address so each socket can be served from its own thread (see ServeSocket())
+
+#include <array>
+#include <memory>
+#include <vector>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <registers.h>
+
+#ifndef ModbusUDPBatch
+#define ModbusUDPBatch 32 // Datagrams received and answered per system call
+#endif
+
+struct LinuxUDPServerInit
+{
+    uint16_t ServerPort;
+    uint8_t SocketCount = 1; // Sockets bound to the port with SO_REUSEPORT
+};
+
+// One socket and the buffers for a batch on it
+struct UDPSocketBatch
+{
+    int fd = -1;
+    std::array<std::array<uint8_t, ModbusTCPMaxFrame>, ModbusUDPBatch> frames;
+    std::array<sockaddr_storage, ModbusUDPBatch> sources;
+    std::array<iovec, ModbusUDPBatch> vectors;
+    std::array<mmsghdr, ModbusUDPBatch> messages;
+    FixedArena<ModbusArenaSize> arena; // PDUs of the transaction being processed
+};
+
+class StdLinuxModbusUDPServer
+{
+private:
+    const LinuxUDPServerInit Settings;
+    std::vector<std::unique_ptr<UDPSocketBatch>> sockets;
+    std::vector<pollfd> pollFds; // One per socket, for Poll()
+
+    Registers &registers;
+
+    // Answers every request waiting on the socket, up to one batch. Returns the number of requests processed
+    uint16_t serveBatch(UDPSocketBatch &batch)
+    {
+        for (size_t i = 0; i < ModbusUDPBatch; i++)
+        {
+            batch.vectors[i] = {batch.frames[i].data(), batch.frames[i].size()};
+            batch.messages[i].msg_hdr = {};
+            batch.messages[i].msg_hdr.msg_name = &batch.sources[i];
+            batch.messages[i].msg_hdr.msg_namelen = sizeof(sockaddr_storage);
+            batch.messages[i].msg_hdr.msg_iov = &batch.vectors[i];
+            batch.messages[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        const int received = recvmmsg(batch.fd, batch.messages.data(), ModbusUDPBatch, MSG_DONTWAIT, nullptr);
+        if (received <= 0)
+        {
+            return 0;
+        }
+
+        // Drop malformed datagrams, pack the valid ones to the front of the batch
+        std::array<uint8_t *, ModbusUDPBatch> requests;
+        std::array<uint8_t, ModbusUDPBatch> lengths;
+        int valid = 0;
+        for (int i = 0; i < received; i++)
+        {
+            const uint8_t *frame = batch.frames[i].data();
+            const size_t byteCount = batch.messages[i].msg_len;
+            const MBAPHead header = MBAPfromBytes(frame);
+            if (byteCount <= 7 || header.ProtocolID != 0 || static_cast<size_t>(header.Length) + 6 > byteCount)
+            {
+                continue;
+            }
+            if (valid != i)
+            {
+                std::swap(batch.frames[valid], batch.frames[i]);
+                std::swap(batch.sources[valid], batch.sources[i]);
+                batch.messages[valid].msg_hdr.msg_namelen = batch.messages[i].msg_hdr.msg_namelen;
+            }
+            requests[valid] = batch.frames[valid].data() + 7;
+            valid++;
+        }
+
+        {
+            ArenaScope scope(batch.arena);
+            if (ActiveCapture == nullptr)
+            {
+                registers.ProcessStreams(requests.data(), lengths.data(), valid);
+            }
+            else
+            {
+                // One at a time while capturing, so each response is recorded right after its request
+                for (int i = 0; i < valid; i++)
+                {
+                    const size_t byteCount = static_cast<size_t>(MBAPfromBytes(batch.frames[i].data()).Length) + 6;
+                    lengths[i] = ReceiveTCPFrame(registers, batch.frames[i].data(), batch.frames[i].size(), byteCount) - 7;
+                }
+            }
+        }
+
+        for (int i = 0; i < valid; i++)
+        {
+            batch.frames[i][4] = 0;
+            batch.frames[i][5] = lengths[i] + 1;
+            batch.vectors[i].iov_len = 7 + lengths[i];
+        }
+
+        int sent = 0;
+        while (sent < valid)
+        {
+            const int result = sendmmsg(batch.fd, batch.messages.data() + sent, valid - sent, 0);
+            if (result <= 0)
+            {
+                break; // Datagrams are best effort, the client will retry
+            }
+            sent += result;
+        }
+        return valid;
+    }
+
+public:
+    StdLinuxModbusUDPServer(LinuxUDPServerInit ServerSettings, Registers &registers)
+        : Settings{ServerSettings}, registers{registers} {};
+    ~StdLinuxModbusUDPServer() { Close(); };
+
+    // Returns false if the port could not be opened
+    bool Initialize()
+    {
+        for (uint8_t i = 0; i < (Settings.SocketCount > 0 ? Settings.SocketCount : 1); i++)
+        {
+            std::unique_ptr<UDPSocketBatch> batch(new UDPSocketBatch());
+            batch->fd = socket(AF_INET6, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (batch->fd < 0)
+            {
+                Close();
+                return false;
+            }
+            const int on = 1;
+            const int off = 0;
+            setsockopt(batch->fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+            setsockopt(batch->fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off)); // Accept IPv4 clients as well
+
+            sockaddr_in6 address = {};
+            address.sin6_family = AF_INET6;
+            address.sin6_addr = in6addr_any;
+            address.sin6_port = htons(Settings.ServerPort);
+            const bool bound = bind(batch->fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) == 0;
+            pollFds.push_back({.fd = batch->fd, .events = POLLIN, .revents = 0});
+            sockets.push_back(std::move(batch));
+            if (!bound)
+            {
+                Close();
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Single threaded service of every socket, waits up to timeoutMillis for requests. Returns the number of requests processed
+    uint16_t Poll(const int timeoutMillis)
+    {
+        if (poll(pollFds.data(), pollFds.size(), timeoutMillis) <= 0)
+        {
+            return 0;
+        }
+
+        uint16_t frames = 0;
+        for (size_t i = 0; i < pollFds.size(); i++)
+        {
+            if (pollFds[i].revents & POLLIN)
+            {
+                frames += serveBatch(*sockets[i]);
+            }
+        }
+        return frames;
+    }
+
+    // Serves one socket, for layouts with a thread per socket. Registers does no locking of its own,
+    // so the register map must be safe to access from every serving thread
+    uint16_t ServeSocket(const size_t index, const int timeoutMillis)
+    {
+        pollfd fd = {.fd = sockets[index]->fd, .events = POLLIN, .revents = 0};
+        if (poll(&fd, 1, timeoutMillis) <= 0)
+        {
+            return 0;
+        }
+        return serveBatch(*sockets[index]);
+    }
+
+    size_t SocketCount() const { return sockets.size(); }
+
+    void Close()
+    {
+        for (auto &batch : sockets)
+        {
+            if (batch->fd >= 0)
+            {
+                close(batch->fd);
+            }
+        }
+        sockets.clear();
+        pollFds.clear();
+    }
+};
+
+#endif
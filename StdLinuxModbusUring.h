@@ -0,0 +1,631 @@
+#ifndef H_StdLinuxModbusUring_IP
+#define H_StdLinuxModbusUring_IP
+
+// Modbus TCP server for Linux built on io_uring, using the raw system calls so no liburing is needed.
+// A multishot accept and one multishot receive per connection stay armed in the kernel, received data lands in a
+// ring of provided buffers, and each Poll() submits the cycle's sends in the same io_uring_enter() call that waits
+// for more completions. Under load a whole batch of request/response pairs costs that one call, and none at all
+// while completions are already waiting. Needs Linux 6.3 or later, otherwise Initialize() fails; LinuxModbusTCPServer
+// then falls back to the epoll based StdLinuxModbusTCPServer.
+// Multishot receives can't leave data in the socket, so a client that pipelines more than the receive buffer
+// holds while its responses are blocked is closed.
+
+#include <linux/io_uring.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <StdLinuxModbusTCP.h>
+
+#ifndef IORING_FEAT_REG_REG_RING
+#define IORING_FEAT_REG_REG_RING (1U << 13) // Linux 6.3, implies multishot receive and provided buffer rings
+#endif
+
+#ifndef ModbusUringEntries
+#define ModbusUringEntries 256 // Submission queue entries, the completion queue gets four times as many
+#endif
+
+#ifndef ModbusUringBuffers
+#define ModbusUringBuffers 256 // Receive buffers shared by all connections, must be a power of 2
+#endif
+
+#ifndef ModbusUringBufferSize
+#define ModbusUringBufferSize 1024
+#endif
+
+struct UringConnection
+{
+    int fd = -1;
+    uint32_t lastRead = 0;
+    uint8_t pending = 0;  // Operations in flight, the slot is released once closing and this reaches 0
+    bool closing = false; // The receive has been cancelled
+    bool sending = false; // Only one send is in flight, it covers tx[0, sendLength)
+    bool queued = false;  // Listed for the end of cycle sends
+    size_t sendLength = 0;
+
+    // Partial request frames and queued responses
+    std::array<uint8_t, ModbusUringBufferSize + ModbusASCIIMaxFrame> rx;
+    size_t rxLength = 0;
+    std::array<uint8_t, ModbusTxBufferSize> tx;
+    size_t txLength = 0;
+
+    FixedArena<ModbusArenaSize> arena; // Request and response PDUs, reset after each transaction
+};
+
+class StdLinuxModbusUringServer
+{
+private:
+    // Stored in the low bits of user_data, the rest is the UringConnection pointer
+    enum Operation : uint64_t
+    {
+        AcceptOperation,
+        ReceiveOperation,
+        SendOperation,
+        CancelOperation,
+    };
+
+    const LinuxTCPServerInit Settings;
+    int ringFd = -1;
+    int listenFd = -1;
+
+    // Rings shared with the kernel
+    uint8_t *rings = nullptr;
+    size_t ringBytes = 0;
+    unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned sqEntries = 0;
+    unsigned queued = 0; // Submissions not yet passed to the kernel
+    io_uring_sqe *sqes = nullptr;
+    size_t sqeBytes = 0;
+    unsigned *cqHead, *cqTail, *cqMask;
+    io_uring_cqe *cqes;
+
+    // Provided receive buffers, group 0
+    io_uring_buf_ring *bufferRing = nullptr;
+    uint8_t *buffers = nullptr;
+    uint16_t bufferTail = 0;
+
+    SlabPool<UringConnection> pool;
+    std::vector<UringConnection *> connections;
+    std::vector<UringConnection *> pendingSend;
+    uint32_t nextTimeoutSweep = 0;
+
+    ServedRegisters served;
+
+    int enter(const unsigned toSubmit, const unsigned minComplete, const unsigned flags, const void *arg, const size_t argSize)
+    {
+        return syscall(__NR_io_uring_enter, ringFd, toSubmit, minComplete, flags, arg, argSize);
+    }
+
+    // nullptr if the submission queue is full even after handing it to the kernel
+    io_uring_sqe *nextSqe()
+    {
+        if (*sqTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries)
+        {
+            enter(queued, 0, 0, nullptr, 0);
+            queued = 0;
+            if (*sqTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries)
+            {
+                return nullptr;
+            }
+        }
+        io_uring_sqe *sqe = &sqes[*sqTail & *sqMask];
+        memset(sqe, 0, sizeof(*sqe));
+        return sqe;
+    }
+    void publish()
+    {
+        const unsigned tail = *sqTail;
+        sqArray[tail & *sqMask] = tail & *sqMask;
+        __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+        queued++;
+    }
+
+    void recycleBuffer(const uint16_t id)
+    {
+        // Indexed by hand, compiled as C++ the header's flexible bufs member is placed 8 bytes into the ring
+        io_uring_buf &buffer = reinterpret_cast<io_uring_buf *>(bufferRing)[bufferTail & (ModbusUringBuffers - 1)];
+        buffer.addr = reinterpret_cast<uint64_t>(buffers + static_cast<size_t>(id) * ModbusUringBufferSize);
+        buffer.len = ModbusUringBufferSize;
+        buffer.bid = id; // resv is left alone, in bufs[0] it is the ring tail
+        bufferTail++;
+        __atomic_store_n(&bufferRing->tail, bufferTail, __ATOMIC_RELEASE);
+    }
+
+    bool armAccept()
+    {
+        io_uring_sqe *sqe = nextSqe();
+        if (sqe == nullptr)
+        {
+            return false;
+        }
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = listenFd;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+        sqe->user_data = AcceptOperation;
+        publish();
+        return true;
+    }
+    bool armReceive(UringConnection &connection)
+    {
+        io_uring_sqe *sqe = nextSqe();
+        if (sqe == nullptr)
+        {
+            return false;
+        }
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = connection.fd;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = 0;
+        sqe->user_data = reinterpret_cast<uint64_t>(&connection) | ReceiveOperation;
+        publish();
+        connection.pending++;
+        return true;
+    }
+    void send(UringConnection &connection)
+    {
+        io_uring_sqe *sqe = nextSqe();
+        if (sqe == nullptr)
+        {
+            return; // Stays queued for the next cycle
+        }
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = connection.fd;
+        sqe->addr = reinterpret_cast<uint64_t>(connection.tx.data());
+        sqe->len = connection.txLength;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = reinterpret_cast<uint64_t>(&connection) | SendOperation;
+        publish();
+        connection.pending++;
+        connection.sending = true;
+        connection.sendLength = connection.txLength;
+    }
+
+    void closeConnection(UringConnection &connection)
+    {
+        if (connection.closing)
+        {
+            return;
+        }
+        connection.closing = true;
+        io_uring_sqe *sqe = nextSqe();
+        if (sqe != nullptr)
+        {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = reinterpret_cast<uint64_t>(&connection) | ReceiveOperation;
+            sqe->user_data = CancelOperation;
+            publish();
+        }
+        else
+        {
+            shutdown(connection.fd, SHUT_RDWR); // Ends the receive as well
+        }
+    }
+
+    void queueSend(UringConnection &connection)
+    {
+        if (connection.txLength > 0 && !connection.queued)
+        {
+            connection.queued = true;
+            pendingSend.push_back(&connection);
+        }
+    }
+
+    void acceptClient(const int fd, const uint32_t now)
+    {
+        const int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)); // Responses are already batched per cycle
+        UringConnection *connection = pool.Create();
+        connection->fd = fd;
+        connection->lastRead = now;
+        connections.push_back(connection);
+        if (!armReceive(*connection))
+        {
+            connection->closing = true;
+        }
+    }
+
+    // Returns the number of requests processed
+    uint16_t processFrames(UringConnection &connection)
+    {
+        uint16_t frames = 0;
+        size_t consumed = 0;
+        for (;;)
+        {
+            const uint8_t *frame = connection.rx.data() + consumed;
+            const size_t available = connection.rxLength - consumed;
+            const size_t frameLength = FrameLength(Settings.Framing, frame, available);
+            if (frameLength > MaxFrameLength(Settings.Framing)) // Larger than any valid request, the stream is out of sync
+            {
+                if (connection.txLength > 0 && !connection.sending)
+                {
+                    send(connection); // Best effort for the responses already built, the connection lives until it completes
+                }
+                closeConnection(connection);
+                break;
+            }
+            if (frameLength == 0 || frameLength > available)
+            {
+                break;
+            }
+            // Room for the request, and the response built over it, which is at most MaxFrameLength()
+            if (connection.tx.size() - connection.txLength < MaxFrameLength(Settings.Framing))
+            {
+                break; // Waiting for the send in flight to complete
+            }
+
+            // The response is built in place in the output buffer
+            uint8_t *response = connection.tx.data() + connection.txLength;
+            memcpy(response, frame, frameLength);
+            ArenaScope scope(connection.arena);
+            connection.txLength += served.Receive(Settings.Framing, response, frameLength);
+            consumed += frameLength;
+            frames++;
+        }
+        connection.rxLength -= consumed;
+        memmove(connection.rx.data(), connection.rx.data() + consumed, connection.rxLength);
+        queueSend(connection);
+        return frames;
+    }
+
+    uint16_t receive(UringConnection &connection, const io_uring_cqe &cqe, const uint32_t now)
+    {
+        uint16_t frames = 0;
+        if (cqe.flags & IORING_CQE_F_BUFFER)
+        {
+            const uint16_t id = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+            if (cqe.res > 0 && !connection.closing)
+            {
+                if (connection.rx.size() - connection.rxLength < static_cast<size_t>(cqe.res))
+                {
+                    closeConnection(connection);
+                }
+                else
+                {
+                    memcpy(connection.rx.data() + connection.rxLength, buffers + static_cast<size_t>(id) * ModbusUringBufferSize, cqe.res);
+                    connection.rxLength += cqe.res;
+                    connection.lastRead = now;
+                    frames = processFrames(connection);
+                }
+            }
+            recycleBuffer(id);
+        }
+
+        if (!(cqe.flags & IORING_CQE_F_MORE))
+        {
+            connection.pending--;
+            // Rearm when the kernel ended the multishot for its own reasons, eg. it ran out of buffers
+            if (connection.closing || cqe.res == 0 || (cqe.res < 0 && cqe.res != -ENOBUFS) || !armReceive(connection))
+            {
+                closeConnection(connection);
+            }
+        }
+        return frames;
+    }
+
+    uint16_t sent(UringConnection &connection, const io_uring_cqe &cqe)
+    {
+        connection.pending--;
+        connection.sending = false;
+        if (cqe.res < 0)
+        {
+            closeConnection(connection);
+            return 0;
+        }
+        connection.txLength -= cqe.res;
+        memmove(connection.tx.data(), connection.tx.data() + cqe.res, connection.txLength);
+        return connection.closing ? 0 : processFrames(connection); // Frames held back while the buffer was full
+    }
+
+    uint16_t reapCompletions(const uint32_t now)
+    {
+        uint16_t frames = 0;
+        unsigned head = *cqHead;
+        while (head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE))
+        {
+            const io_uring_cqe cqe = cqes[head & *cqMask];
+            head++;
+            __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+
+            UringConnection *connection = reinterpret_cast<UringConnection *>(cqe.user_data & ~static_cast<uint64_t>(3));
+            switch (cqe.user_data & 3)
+            {
+            case AcceptOperation:
+                if (cqe.res >= 0)
+                {
+                    acceptClient(cqe.res, now);
+                }
+                if (!(cqe.flags & IORING_CQE_F_MORE) && listenFd >= 0)
+                {
+                    armAccept();
+                }
+                break;
+            case ReceiveOperation:
+                frames += receive(*connection, cqe, now);
+                break;
+            case SendOperation:
+                frames += sent(*connection, cqe);
+                break;
+            default: // Cancellation results need no handling
+                break;
+            }
+        }
+        return frames;
+    }
+
+    void sweepTimeouts(const uint32_t now)
+    {
+        if (Settings.ClientTimeout == 0 || static_cast<int32_t>(now - nextTimeoutSweep) < 0)
+        {
+            return;
+        }
+
+        uint32_t earliest = now + Settings.ClientTimeout;
+        for (UringConnection *connection : connections)
+        {
+            const uint32_t deadline = connection->lastRead + Settings.ClientTimeout;
+            if (!connection->closing && static_cast<int32_t>(now - deadline) >= 0)
+            {
+                closeConnection(*connection);
+            }
+            else if (static_cast<int32_t>(deadline - earliest) < 0)
+            {
+                earliest = deadline;
+            }
+        }
+        nextTimeoutSweep = earliest;
+    }
+
+    void sendQueued()
+    {
+        size_t kept = 0;
+        for (UringConnection *connection : pendingSend)
+        {
+            if (connection->closing || connection->txLength == 0)
+            {
+                connection->queued = false;
+            }
+            else if (!connection->sending)
+            {
+                send(*connection);
+                connection->queued = !connection->sending;
+            }
+            if (connection->queued)
+            {
+                pendingSend[kept++] = connection;
+            }
+        }
+        pendingSend.resize(kept);
+    }
+
+    void removeClosedConnections()
+    {
+        size_t kept = 0;
+        for (size_t i = 0; i < connections.size(); i++)
+        {
+            UringConnection *connection = connections[i];
+            if (connection->closing && connection->pending == 0 && !connection->queued)
+            {
+                close(connection->fd);
+                pool.Destroy(connection);
+            }
+            else
+            {
+                connections[kept++] = connection;
+            }
+        }
+        connections.resize(kept);
+    }
+
+    bool setupRings()
+    {
+        io_uring_params params = {};
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = ModbusUringEntries * 4;
+        ringFd = syscall(__NR_io_uring_setup, ModbusUringEntries, &params);
+        const unsigned required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG | IORING_FEAT_REG_REG_RING;
+        if (ringFd < 0 || (params.features & required) != required)
+        {
+            return false;
+        }
+
+        const size_t sqBytes = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        const size_t cqBytes = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        ringBytes = sqBytes > cqBytes ? sqBytes : cqBytes;
+        void *mapping = mmap(nullptr, ringBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+        if (mapping == MAP_FAILED)
+        {
+            return false;
+        }
+        rings = static_cast<uint8_t *>(mapping);
+        sqeBytes = params.sq_entries * sizeof(io_uring_sqe);
+        mapping = mmap(nullptr, sqeBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+        if (mapping == MAP_FAILED)
+        {
+            return false;
+        }
+        sqes = static_cast<io_uring_sqe *>(mapping);
+
+        sqHead = reinterpret_cast<unsigned *>(rings + params.sq_off.head);
+        sqTail = reinterpret_cast<unsigned *>(rings + params.sq_off.tail);
+        sqMask = reinterpret_cast<unsigned *>(rings + params.sq_off.ring_mask);
+        sqArray = reinterpret_cast<unsigned *>(rings + params.sq_off.array);
+        sqEntries = params.sq_entries;
+        cqHead = reinterpret_cast<unsigned *>(rings + params.cq_off.head);
+        cqTail = reinterpret_cast<unsigned *>(rings + params.cq_off.tail);
+        cqMask = reinterpret_cast<unsigned *>(rings + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe *>(rings + params.cq_off.cqes);
+
+        // Buffer ring memory must be page aligned, mmap provides that
+        mapping = mmap(nullptr, ModbusUringBuffers * sizeof(io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapping == MAP_FAILED)
+        {
+            return false;
+        }
+        bufferRing = static_cast<io_uring_buf_ring *>(mapping);
+        io_uring_buf_reg registration = {};
+        registration.ring_addr = reinterpret_cast<uint64_t>(bufferRing);
+        registration.ring_entries = ModbusUringBuffers;
+        registration.bgid = 0;
+        if (syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_PBUF_RING, &registration, 1) != 0)
+        {
+            return false;
+        }
+        mapping = mmap(nullptr, ModbusUringBuffers * ModbusUringBufferSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapping == MAP_FAILED)
+        {
+            return false;
+        }
+        buffers = static_cast<uint8_t *>(mapping);
+        for (uint16_t id = 0; id < ModbusUringBuffers; id++)
+        {
+            recycleBuffer(id);
+        }
+        return true;
+    }
+
+public:
+    StdLinuxModbusUringServer(LinuxTCPServerInit ServerSettings, Registers &registers)
+        : Settings{ServerSettings}, served{registers} {};
+    // Serves the current map of Maps, which may be swapped by another thread while clients stay connected
+    StdLinuxModbusUringServer(LinuxTCPServerInit ServerSettings, RegisterMapSwitch &Maps)
+        : Settings{ServerSettings}, served{Maps} {};
+    ~StdLinuxModbusUringServer() { Close(); };
+
+    // Returns false if io_uring or one of the features used is unavailable, or the port could not be opened
+    bool Initialize()
+    {
+        static_assert((ModbusUringBuffers & (ModbusUringBuffers - 1)) == 0, "ModbusUringBuffers must be a power of 2");
+        if (!setupRings())
+        {
+            Close();
+            return false;
+        }
+
+        listenFd = socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listenFd < 0)
+        {
+            Close();
+            return false;
+        }
+        const int on = 1;
+        const int off = 0;
+        setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        setsockopt(listenFd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off)); // Accept IPv4 clients as well
+
+        sockaddr_in6 address = {};
+        address.sin6_family = AF_INET6;
+        address.sin6_addr = in6addr_any;
+        address.sin6_port = htons(Settings.ServerPort);
+        if (bind(listenFd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 || listen(listenFd, Settings.Backlog) != 0 || !armAccept())
+        {
+            Close();
+            return false;
+        }
+        return true;
+    }
+
+    // Submits the previous cycle's sends and waits up to timeoutMillis for completions (0 to just check), then
+    // services them and queues the responses. Returns the number of requests processed
+    uint16_t Poll(const int timeoutMillis)
+    {
+        if (*cqHead == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE))
+        {
+            __kernel_timespec timeout = {timeoutMillis / 1000, (timeoutMillis % 1000) * 1000000LL};
+            io_uring_getevents_arg arg = {};
+            arg.sigmask_sz = _NSIG / 8;
+            arg.ts = reinterpret_cast<uint64_t>(&timeout);
+            enter(queued, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+            queued = 0;
+        }
+        else if (queued > 0)
+        {
+            enter(queued, 0, 0, nullptr, 0);
+            queued = 0;
+        }
+
+        const uint32_t now = MonotonicMillis();
+        const uint16_t frames = reapCompletions(now);
+        sweepTimeouts(now);
+        sendQueued();
+        removeClosedConnections();
+        return frames;
+    }
+
+    size_t ClientCount() const { return connections.size(); }
+
+    void Close()
+    {
+        if (ringFd >= 0)
+        {
+            close(ringFd); // Cancels everything in flight
+            ringFd = -1;
+        }
+        for (UringConnection *connection : connections)
+        {
+            close(connection->fd);
+            pool.Destroy(connection);
+        }
+        connections.clear();
+        pendingSend.clear();
+        if (listenFd >= 0)
+        {
+            close(listenFd);
+            listenFd = -1;
+        }
+        if (buffers != nullptr)
+        {
+            munmap(buffers, ModbusUringBuffers * ModbusUringBufferSize);
+            buffers = nullptr;
+        }
+        if (bufferRing != nullptr)
+        {
+            munmap(bufferRing, ModbusUringBuffers * sizeof(io_uring_buf));
+            bufferRing = nullptr;
+        }
+        if (sqes != nullptr)
+        {
+            munmap(sqes, sqeBytes);
+            sqes = nullptr;
+        }
+        if (rings != nullptr)
+        {
+            munmap(rings, ringBytes);
+            rings = nullptr;
+        }
+        queued = 0;
+        bufferTail = 0;
+    }
+};
+
+// Uses the io_uring server where the kernel supports it and the epoll server otherwise
+class LinuxModbusTCPServer
+{
+private:
+    StdLinuxModbusUringServer uring;
+    StdLinuxModbusTCPServer epoll;
+    bool usingUring = false;
+
+public:
+    LinuxModbusTCPServer(LinuxTCPServerInit ServerSettings, Registers &registers)
+        : uring{ServerSettings, registers}, epoll{ServerSettings, registers} {};
+    LinuxModbusTCPServer(LinuxTCPServerInit ServerSettings, RegisterMapSwitch &Maps)
+        : uring{ServerSettings, Maps}, epoll{ServerSettings, Maps} {};
+    ~LinuxModbusTCPServer() {};
+
+    bool Initialize()
+    {
+        usingUring = uring.Initialize();
+        return usingUring || epoll.Initialize();
+    }
+    uint16_t Poll(const int timeoutMillis) { return usingUring ? uring.Poll(timeoutMillis) : epoll.Poll(timeoutMillis); }
+    size_t ClientCount() const { return usingUring ? uring.ClientCount() : epoll.ClientCount(); }
+    bool UsingUring() const { return usingUring; }
+    void Close()
+    {
+        uring.Close();
+        epoll.Close();
+    }
+};
+
+#endif
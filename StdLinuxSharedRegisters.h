@@ -0,0 +1,307 @@
+#ifndef H_StdLinuxSharedRegisters_IP
+#define H_StdLinuxSharedRegisters_IP
+
+// Register blocks backed by a POSIX shared memory (or mmap'ed file) image, so a separate control process can
+// write values in place and the Modbus server reads them directly. The image outlives both processes, which
+// also gives a warm restart: a restarted server maps the existing image and carries on with the same values.
+//
+// Image layout, all values in host byte order:
+//   offset 0   SharedImageHeader (64 bytes)
+//   offset 64  data region, block placement within it is chosen by the user as byte offsets
+//
+// Consistency is provided by the seqlock in the header: writers make Sequence odd while changing data and even
+// again afterwards, readers copy the data and retry if Sequence was odd or changed during the copy.
+// Writers exclude each other by storing their pid in Writer. A lock left by a writer that has exited is released by
+// whichever process next waits on it, a live writer is always left to finish, so both processes must share a pid namespace.
+// Both processes must use the same block offsets, typically from a shared header of constants.
+
+#include <atomic>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <registers.h>
+
+const uint32_t SharedImageMagic = 0x4D425349; // "MBSI"
+const uint16_t SharedImageVersion = 2; // 2 added Writer
+
+struct SharedImageHeader
+{
+    uint32_t Magic;
+    uint16_t Version;
+    uint16_t Reserved;
+    uint32_t DataBytes; // Size of the data region following the header
+    std::atomic<uint32_t> Sequence;
+    std::atomic<int32_t> Writer; // pid holding the write lock, 0 when free
+    uint8_t Padding[44];
+};
+static_assert(sizeof(SharedImageHeader) == 64, "Shared image header layout must stay fixed");
+
+class SharedRegisterImage
+{
+private:
+    SharedImageHeader *header = nullptr;
+    size_t mappedBytes = 0;
+
+    static uint64_t nowMicros()
+    {
+        timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return static_cast<uint64_t>(now.tv_sec) * 1000000 + now.tv_nsec / 1000;
+    }
+
+    static bool alive(const int32_t pid)
+    {
+        return kill(pid, 0) == 0 || errno == EPERM;
+    }
+
+    // Takes the lock from Owner if it has exited, true if the lock is now held by this process.
+    // Sequence is left odd, the dead writer's update may be partial and is published by the next EndWrite()
+    bool takeFromDead(int32_t Owner) const
+    {
+        if (Owner == 0 || alive(Owner) || !header->Writer.compare_exchange_strong(Owner, getpid(), std::memory_order_acquire))
+        {
+            return false;
+        }
+        if ((header->Sequence.load(std::memory_order_relaxed) & 1) == 0)
+        {
+            header->Sequence.fetch_add(1, std::memory_order_relaxed);
+        }
+        std::atomic_thread_fence(std::memory_order_release);
+        return true;
+    }
+
+    // Backs off while waiting on a writer, false once Deadline has passed
+    static bool wait(uint32_t &spins, const uint64_t Deadline)
+    {
+        if (++spins < 64)
+        {
+            return true;
+        }
+        sched_yield();
+        return nowMicros() < Deadline;
+    }
+
+public:
+    // How long BeginWrite() and ReadBegin() wait on a live writer before giving up
+    uint32_t TimeoutMicros = 100000;
+
+    SharedRegisterImage() {};
+    SharedRegisterImage(const SharedRegisterImage &) = delete;
+    ~SharedRegisterImage() { Close(); };
+
+    // name is a shm_open() name ("/plant_image") or, when it contains a second '/', a file path to mmap.
+    // An existing image of the same size and version is reused with its values intact, otherwise it is zeroed.
+    // Returns false if the image could not be opened or mapped
+    bool Open(const char *name, const uint32_t DataBytes)
+    {
+        Close();
+        const bool isFile = strchr(name + 1, '/') != nullptr;
+        const int fd = isFile ? open(name, O_RDWR | O_CREAT, 0660) : shm_open(name, O_RDWR | O_CREAT, 0660);
+        if (fd < 0)
+        {
+            return false;
+        }
+
+        const size_t bytes = sizeof(SharedImageHeader) + DataBytes;
+        struct stat info;
+        if (fstat(fd, &info) != 0 || (static_cast<size_t>(info.st_size) != bytes && ftruncate(fd, bytes) != 0))
+        {
+            close(fd);
+            return false;
+        }
+
+        void *mapping = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mapping == MAP_FAILED)
+        {
+            return false;
+        }
+
+        header = static_cast<SharedImageHeader *>(mapping);
+        mappedBytes = bytes;
+        if (header->Magic != SharedImageMagic || header->Version != SharedImageVersion || header->DataBytes != DataBytes)
+        {
+            memset(mapping, 0, bytes);
+            header->Version = SharedImageVersion;
+            header->DataBytes = DataBytes;
+            header->Sequence.store(0);
+            header->Writer.store(0);
+            std::atomic_thread_fence(std::memory_order_release);
+            header->Magic = SharedImageMagic;
+        }
+        else if (takeFromDead(header->Writer.load()))
+        {
+            EndWrite(); // A writer died mid update, a live one is left to finish
+        }
+        return true;
+    }
+
+    void Close()
+    {
+        if (header != nullptr)
+        {
+            munmap(header, mappedBytes);
+            header = nullptr;
+            mappedBytes = 0;
+        }
+    }
+
+    bool IsOpen() const { return header != nullptr; }
+    uint32_t DataBytes() const { return header->DataBytes; }
+    uint8_t *Data(const uint32_t Offset = 0) const { return reinterpret_cast<uint8_t *>(header + 1) + Offset; }
+    // pid of the process holding the write lock, 0 if free
+    int32_t Writer() const { return header->Writer.load(std::memory_order_relaxed); }
+
+    // Writers from either process (or threads of one) exclude each other through Writer and make Sequence odd.
+    // False if another live writer held the lock for longer than TimeoutMicros
+    bool BeginWrite()
+    {
+        const int32_t self = getpid();
+        const uint64_t deadline = nowMicros() + TimeoutMicros;
+        uint32_t spins = 0;
+        for (;;)
+        {
+            int32_t owner = 0;
+            if (header->Writer.compare_exchange_weak(owner, self, std::memory_order_acquire))
+            {
+                header->Sequence.fetch_add(1, std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_release);
+                return true;
+            }
+            if (takeFromDead(owner))
+            {
+                return true;
+            }
+            if (!wait(spins, deadline))
+            {
+                return false;
+            }
+        }
+    }
+    void EndWrite()
+    {
+        header->Sequence.fetch_add(1, std::memory_order_release);
+        header->Writer.store(0, std::memory_order_release);
+    }
+
+    // Waits for a consistent point to start copying from, false if a live writer held the lock for longer than TimeoutMicros
+    bool ReadBegin(uint32_t &sequence) const
+    {
+        const uint64_t deadline = nowMicros() + TimeoutMicros;
+        uint32_t spins = 0;
+        for (;;)
+        {
+            sequence = header->Sequence.load(std::memory_order_acquire);
+            if ((sequence & 1) == 0)
+            {
+                return true;
+            }
+            if (takeFromDead(header->Writer.load(std::memory_order_relaxed)))
+            {
+                const_cast<SharedRegisterImage *>(this)->EndWrite();
+            }
+            else if (!wait(spins, deadline))
+            {
+                return false;
+            }
+        }
+    }
+    bool ReadRetry(const uint32_t sequence) const
+    {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return header->Sequence.load(std::memory_order_relaxed) != sequence;
+    }
+};
+
+// Scoped seqlock write section for the control process, eg. { SharedImageWrite write(image); values[3] = 5; }
+// Waits for as long as another live writer holds the lock, use BeginWrite() directly to give up after TimeoutMicros
+class SharedImageWrite
+{
+private:
+    SharedRegisterImage &image;
+
+public:
+    explicit SharedImageWrite(SharedRegisterImage &image) : image{image}
+    {
+        while (!image.BeginWrite())
+        {
+        }
+    };
+    ~SharedImageWrite() { image.EndWrite(); };
+};
+
+// The data pointer is placed DataOffset bytes into the image data region, so the image must be opened before the register is constructed
+class SharedHoldingRegister : public HoldingRegister
+{
+private:
+    SharedRegisterImage &image;
+
+public:
+    SharedHoldingRegister(uint16_t FirstAddress, uint16_t LastAddress, vector<ModbusFunction> FunctionList, SharedRegisterImage &image, uint32_t DataOffset, bool ReceiveBigEndian, bool SendBigEndian)
+        : HoldingRegister(FirstAddress, LastAddress, FunctionList, reinterpret_cast<uint16_t *>(image.Data(DataOffset)), ReceiveBigEndian, SendBigEndian), image{image} {};
+    SharedHoldingRegister(uint16_t FirstAddress, uint16_t LastAddress, vector<ModbusFunction> FunctionList, SharedRegisterImage &image, uint32_t DataOffset)
+        : SharedHoldingRegister(FirstAddress, LastAddress, FunctionList, image, DataOffset, true, true) {};
+    ~SharedHoldingRegister() {};
+
+    void Write(const uint16_t Address, const uint8_t RegistersCount, uint8_t *dataBuffer) override
+    {
+        SharedImageWrite write(image);
+        HoldingRegister::Write(Address, RegistersCount, dataBuffer);
+    }
+    void WriteSingle(const uint16_t Address, const uint16_t value) override
+    {
+        SharedImageWrite write(image);
+        HoldingRegister::WriteSingle(Address, value);
+    }
+    void Read(const uint16_t Address, const uint8_t RegistersCount, uint8_t *ResponseBuffer) const override
+    {
+        uint32_t sequence;
+        do
+        {
+            while (!image.ReadBegin(sequence)) // Only a live writer can hold it this long
+            {
+            }
+            HoldingRegister::Read(Address, RegistersCount, ResponseBuffer);
+        } while (image.ReadRetry(sequence));
+    }
+};
+
+class SharedCoilRegister : public CoilRegister
+{
+private:
+    SharedRegisterImage &image;
+
+public:
+    SharedCoilRegister(uint16_t FirstAddress, uint16_t LastAddress, vector<ModbusFunction> FunctionList, SharedRegisterImage &image, uint32_t DataOffset)
+        : CoilRegister(FirstAddress, LastAddress, FunctionList, image.Data(DataOffset)), image{image} {};
+    ~SharedCoilRegister() {};
+
+    void Write(const uint16_t Address, const uint8_t RegistersCount, uint8_t *dataBuffer) override
+    {
+        SharedImageWrite write(image);
+        CoilRegister::Write(Address, RegistersCount, dataBuffer);
+    }
+    void WriteSingle(const uint16_t Address, const uint16_t value) override
+    {
+        SharedImageWrite write(image);
+        CoilRegister::WriteSingle(Address, value);
+    }
+    void Read(const uint16_t Address, const uint8_t RegistersCount, uint8_t *ResponseBuffer) const override
+    {
+        uint32_t sequence;
+        do
+        {
+            while (!image.ReadBegin(sequence)) // Only a live writer can hold it this long
+            {
+            }
+            CoilRegister::Read(Address, RegistersCount, ResponseBuffer);
+        } while (image.ReadRetry(sequence));
+    }
+};
+
+#endif
@@ -31,6 +31,13 @@ public:
     size_t write(uint8_t b) override { return Client.write(b); };
 };
 
+struct AdmissionSettings
+{
+    uint16_t BurstCredits = 0;  // Requests a client may send back to back, 0 disables per client limits
+    uint32_t RefillMicros = 0;  // Time for a client to earn back one credit
+    uint16_t MaxInFlight = 0;   // Requests answered per ProcessClients()/Poll() call across all clients, 0 for no limit
+};
+
 struct TCPServerInit
 {
     uint16_t ServerPort;
@@ -40,10 +47,27 @@ struct TCPServerInit
     IPAddress staticIP{192, 168, 0, 10};
     IPAddress subnetMask{255, 255, 0, 0};
     IPAddress gateway{192, 168, 0, 1};
+    AdmissionSettings Admission{};
+    ModbusFraming Framing = MBAPFraming; // RTUFraming or ASCIIFraming for serial to Ethernet converters
 };
 
+#ifndef ModbusMaxClients
+#define ModbusMaxClients 8 // Connection pool size, further connections are refused
+#endif
+
+#ifndef ModbusTxBufferSize
+#define ModbusTxBufferSize 1024 // Per client response buffer, flushed once per ProcessClients()/Poll() call
+#endif
+
+static_assert(ModbusTxBufferSize >= ModbusASCIIMaxFrame, "The response buffer must hold at least one frame");
+
+#ifndef ModbusLogEntries
+#define ModbusLogEntries 16
+#endif
+
 struct ClientState
 {
+    ClientState() {}
     explicit ClientState(EthernetClient client)
         : client(std::move(client)) {}
 
@@ -51,7 +75,7 @@ struct ClientState
     bool closed = false;
 
     // For timeouts.
-    uint32_t lastRead = millis(); // Mark creation time
+    uint32_t lastRead = 0; // Set to the accept time when the slot is taken
 
     // For half closed connections, after "Connection: close" was sent
     // and closeOutput() was called
@@ -60,6 +84,86 @@ struct ClientState
 
     // Parsing state
     bool emptyLine = false;
+
+    // Admission control token bucket
+    uint16_t credits = 0;
+    uint32_t lastRefill = 0;
+
+    // Partial request frames and queued responses
+    std::array<uint8_t, ModbusASCIIMaxFrame> rx; // Large enough for any framing
+    size_t rxLength = 0;
+    std::array<uint8_t, ModbusTxBufferSize> tx;
+    size_t txLength = 0;
+
+    FixedArena<ModbusArenaSize> arena; // Request and response PDUs, reset after each transaction
+};
+
+struct PollResult
+{
+    uint16_t FramesProcessed;
+    uint16_t ClientsDeferred; // Clients with data still waiting when the budget ran out
+    uint32_t ElapsedMicros;
+};
+
+enum ServerLogEvent : uint8_t
+{
+    ClientConnected,
+    ClientTimedOut,
+    ClientShutdownTimedOut,
+    ClientRefused, // Connection pool was full
+};
+
+struct ServerLogEntry
+{
+    uint32_t Time;
+    ServerLogEvent Event;
+    uint8_t IP[4];
+    uint8_t ClientCount;
+};
+
+// Server events are queued here instead of printed inline, call FlushLog() from a non time critical part of the loop.
+// Entries beyond MaxPerSecond, or while the ring is full, are counted as dropped rather than stored
+class ServerLog
+{
+private:
+    std::array<ServerLogEntry, ModbusLogEntries> entries;
+    size_t head = 0;
+    size_t count = 0;
+    uint32_t windowStart = 0;
+    uint16_t windowCount = 0;
+
+public:
+    uint16_t MaxPerSecond = 10;
+    uint32_t Dropped = 0;
+
+    void Push(const uint32_t now, const ServerLogEvent Event, const IPAddress ip, const uint8_t ClientCount)
+    {
+        if (now - windowStart >= 1000)
+        {
+            windowStart = now;
+            windowCount = 0;
+        }
+        if (count == entries.size() || windowCount >= MaxPerSecond)
+        {
+            Dropped++;
+            return;
+        }
+        windowCount++;
+        entries[(head + count) % entries.size()] = {.Time = now, .Event = Event, .IP = {ip[0], ip[1], ip[2], ip[3]}, .ClientCount = ClientCount};
+        count++;
+    }
+
+    bool Pop(ServerLogEntry &entry)
+    {
+        if (count == 0)
+        {
+            return false;
+        }
+        entry = entries[head];
+        head = (head + 1) % entries.size();
+        count--;
+        return true;
+    }
 };
 
 class StdTeenyModbusTCPServer
@@ -67,16 +171,33 @@ class StdTeenyModbusTCPServer
 private:
     uint32_t ClientTimeout;
     uint32_t ShutdownTimeout;
+    AdmissionSettings Admission;
+    ModbusFraming Framing;
+    uint16_t inFlight = 0; // Requests answered in the current cycle
+
+    // Fixed pool of connections, active holds the in use slot indexes so only live clients are visited
+    std::array<ClientState, ModbusMaxClients> clients;
+    std::array<uint8_t, ModbusMaxClients> active;
+    size_t activeCount = 0;
+    size_t nextClient = 0; // Round robin position for Poll()
+
+    // Activity only ever pushes a deadline later, so the earliest deadline found by the last sweep
+    // is a safe lower bound and clients only need to be swept for timeouts once it has passed
+    uint32_t nextTimeoutSweep = 0;
 
-    std::vector<ClientState> clients;
     EthernetServer server;
 
     Registers &registers;
 
 public:
+    ServerLog Log;
+    uint32_t BusyResponses = 0; // Requests rejected with SlaveDeviceBusy by admission control
+
     StdTeenyModbusTCPServer(TCPServerInit ServerSettings, Registers &registers)
         : ClientTimeout{ServerSettings.ClientTimeout},
           ShutdownTimeout{ServerSettings.ShutdownTimeout},
+          Admission{ServerSettings.Admission},
+          Framing{ServerSettings.Framing},
           server(ServerSettings.ServerPort),
           registers{registers} {};
     ~StdTeenyModbusTCPServer() {};
@@ -110,30 +231,137 @@ public:
         server.begin();
     }
 
-    void processModbusClient(ClientState &state)
+    // Prints up to maxEntries queued server events
+    void FlushLog(Print &out, size_t maxEntries = ModbusLogEntries)
     {
-        std::array<uint8_t, 256> ModbusFrame;
-        uint16_t bufferIndex = 0;
-        while (state.client.available())
+        ServerLogEntry entry;
+        for (size_t i = 0; i < maxEntries && Log.Pop(entry); i++)
         {
-            state.lastRead = millis();
-            if (bufferIndex <= ModbusFrame.size())
+            switch (entry.Event)
             {
-                ModbusFrame[bufferIndex] = state.client.read();
-                bufferIndex++;
+            case ClientConnected:
+                out.printf("Client connected: %u.%u.%u.%u, Client count: %u\r\n", entry.IP[0], entry.IP[1], entry.IP[2], entry.IP[3], entry.ClientCount);
+                break;
+            case ClientTimedOut:
+                out.printf("Client timeout: %u.%u.%u.%u\r\n", entry.IP[0], entry.IP[1], entry.IP[2], entry.IP[3]);
+                break;
+            case ClientShutdownTimedOut:
+                out.printf("Client shutdown timeout: %u.%u.%u.%u\r\n", entry.IP[0], entry.IP[1], entry.IP[2], entry.IP[3]);
+                break;
+            case ClientRefused:
+                out.printf("Client refused, pool full: %u.%u.%u.%u\r\n", entry.IP[0], entry.IP[1], entry.IP[2], entry.IP[3]);
+                break;
             }
-            else
+        }
+        if (Log.Dropped > 0)
+        {
+            out.printf("%u log entries dropped\r\n", Log.Dropped);
+            Log.Dropped = 0;
+        }
+    }
+
+    // Processes up to maxFrames complete requests from the client, partial frames are kept for the next call.
+    // Responses are queued in the client's output buffer and sent by FlushClients(). Returns the number of requests processed
+    uint16_t processModbusClient(ClientState &state, const uint32_t now, const uint16_t maxFrames = UINT16_MAX)
+    {
+        int available = state.client.available();
+        if (available > 0 && state.rxLength < state.rx.size())
+        {
+            state.lastRead = now;
+            const size_t toRead = std::min<size_t>(available, state.rx.size() - state.rxLength);
+            state.rxLength += state.client.read(state.rx.data() + state.rxLength, toRead);
+        }
+
+        uint16_t frames = 0;
+        while (frames < maxFrames)
+        {
+            const size_t frameLength = FrameLength(Framing, state.rx.data(), state.rxLength);
+            if (frameLength > MaxFrameLength(Framing)) // Larger than any valid request, the stream is out of sync
             {
-                state.client.read();
+                FlushClient(state);
+                state.client.close();
+                state.closed = true;
+                break;
             }
+            if (frameLength == 0 || frameLength > state.rxLength)
+            {
+                break;
+            }
+
+            // Room for the request, and the response built over it, which is at most MaxFrameLength()
+            if (state.tx.size() - state.txLength < MaxFrameLength(Framing))
+            {
+                FlushClient(state);
+            }
+
+            // The response is built in place in the output buffer
+            uint8_t *response = state.tx.data() + state.txLength;
+            memcpy(response, state.rx.data(), frameLength);
+            ArenaScope scope(state.arena);
+            state.txLength += Admit(state) ? ReceiveFrame(Framing, registers, response, MaxFrameLength(Framing), frameLength)
+                                           : RejectFrame(Framing, response, MaxFrameLength(Framing), frameLength, SlaveDeviceBusy);
+
+            state.rxLength -= frameLength;
+            memmove(state.rx.data(), state.rx.data() + frameLength, state.rxLength);
+            frames++;
         }
+        return frames;
+    }
 
-        const auto responseSize = ReceiveTCPStream(registers, ModbusFrame, bufferIndex);
-        if (responseSize > 0)
+    // Sends everything queued for the client as one write
+    void FlushClient(ClientState &state)
+    {
+        if (state.txLength > 0)
         {
-            state.client.writeFully(ModbusFrame.data(), responseSize);
+            state.client.writeFully(state.tx.data(), state.txLength);
             state.client.flush();
+            state.txLength = 0;
+        }
+    }
+
+    void FlushClients()
+    {
+        for (size_t i = 0; i < activeCount; i++)
+        {
+            ClientState &state = clients[active[i]];
+            if (!state.closed)
+            {
+                FlushClient(state);
+            }
+        }
+    }
+
+    // Takes a credit from the client's token bucket and a slot from the global limit, false if either is exhausted
+    bool Admit(ClientState &state)
+    {
+        if (Admission.MaxInFlight > 0 && inFlight >= Admission.MaxInFlight)
+        {
+            BusyResponses++;
+            return false;
+        }
+
+        if (Admission.BurstCredits > 0)
+        {
+            const uint32_t now = micros();
+            if (Admission.RefillMicros > 0)
+            {
+                const uint32_t earned = (now - state.lastRefill) / Admission.RefillMicros;
+                if (earned > 0)
+                {
+                    state.credits = std::min<uint32_t>(Admission.BurstCredits, state.credits + earned);
+                    state.lastRefill += earned * Admission.RefillMicros;
+                }
+            }
+            if (state.credits == 0)
+            {
+                BusyResponses++;
+                return false;
+            }
+            state.credits--;
         }
+
+        inFlight++;
+        return true;
     }
 
     void ConnectNewClients()
@@ -141,107 +369,183 @@ public:
         EthernetClient client = server.accept();
         if (client)
         {
-            IPAddress ip = client.remoteIP();
-            Serial.printf("Client connected: %u.%u.%u.%u\r\n", ip[0], ip[1], ip[2], ip[3]);
-            clients.emplace_back(std::move(client));
-            Serial.printf("Client count: %u\r\n", clients.size());
+            const uint32_t now = millis();
+            if (activeCount == clients.size())
+            {
+                Log.Push(now, ClientRefused, client.remoteIP(), activeCount);
+                client.close();
+                return;
+            }
+
+            // Free slots are the ones not listed in active
+            size_t slot = 0;
+            while (slot < clients.size() && std::find(active.begin(), active.begin() + activeCount, slot) != active.begin() + activeCount)
+            {
+                slot++;
+            }
+
+            ClientState &state = clients[slot];
+            state = ClientState(std::move(client));
+            state.lastRead = now;
+            state.credits = Admission.BurstCredits;
+            state.lastRefill = micros();
+            active[activeCount++] = slot;
+            if (activeCount == 1 || static_cast<int32_t>(now + ClientTimeout - nextTimeoutSweep) < 0)
+            {
+                nextTimeoutSweep = now + ClientTimeout;
+            }
+            Log.Push(now, ClientConnected, state.client.remoteIP(), activeCount);
         }
     }
 
-    void ProcessClients()
+    // Returns false if the client is closed
+    bool CheckClient(ClientState &state)
     {
-        // Process data from each client
-        for (ClientState &state : clients)
-        { // Use a reference so we don't copy
-            if (!state.client.connected())
+        if (!state.client.connected())
+        {
+            state.closed = true;
+        }
+        return !state.closed;
+    }
+
+    // Closes timed out clients, only does work once the earliest known deadline has passed
+    void SweepTimeouts(const uint32_t now)
+    {
+        if (activeCount == 0 || static_cast<int32_t>(now - nextTimeoutSweep) < 0)
+        {
+            return;
+        }
+
+        uint32_t earliest = now + (ClientTimeout > ShutdownTimeout ? ClientTimeout : ShutdownTimeout);
+        for (size_t i = 0; i < activeCount; i++)
+        {
+            ClientState &state = clients[active[i]];
+            if (state.closed)
             {
-                state.closed = true;
                 continue;
             }
 
             // Check if we need to force close the client
-            if (state.outputClosed)
+            const uint32_t deadline = state.outputClosed ? state.closedTime + ShutdownTimeout : state.lastRead + ClientTimeout;
+            if (static_cast<int32_t>(now - deadline) >= 0)
             {
-                if (millis() - state.closedTime >= ShutdownTimeout)
-                {
-                    IPAddress ip = state.client.remoteIP();
-                    Serial.printf("Client shutdown timeout: %u.%u.%u.%u\r\n",
-                                  ip[0], ip[1], ip[2], ip[3]);
-                    state.client.close();
-                    state.closed = true;
-                    continue;
-                }
+                Log.Push(now, state.outputClosed ? ClientShutdownTimedOut : ClientTimedOut, state.client.remoteIP(), activeCount);
+                state.client.close();
+                state.closed = true;
+            }
+            else if (static_cast<int32_t>(deadline - earliest) < 0)
+            {
+                earliest = deadline;
+            }
+        }
+        nextTimeoutSweep = earliest;
+    }
+
+    void RemoveClosedClients()
+    {
+        size_t kept = 0;
+        for (size_t i = 0; i < activeCount; i++)
+        {
+            ClientState &state = clients[active[i]];
+            if (state.closed)
+            {
+                state.client = EthernetClient(); // Release the connection, the slot is free again
             }
             else
             {
-                if (millis() - state.lastRead >= ClientTimeout)
-                {
-                    IPAddress ip = state.client.remoteIP();
-                    Serial.printf("Client timeout: %u.%u.%u.%u\r\n", ip[0], ip[1], ip[2], ip[3]);
-                    state.client.close();
-                    state.closed = true;
-                    continue;
-                }
+                active[kept++] = active[i];
             }
+        }
+        activeCount = kept;
+    }
+
+    void ProcessClients()
+    {
+        const uint32_t now = millis();
+        inFlight = 0;
+        SweepTimeouts(now);
 
-            processModbusClient(state);
+        // Process data from each client, starting one further along each call so no client is always last in line for MaxInFlight
+        bool anyClosed = false;
+        for (size_t i = 0; i < activeCount; i++)
+        {
+            ClientState &state = clients[active[(nextClient + i) % activeCount]]; // Use a reference so we don't copy
+            if (CheckClient(state))
+            {
+                processModbusClient(state, now);
+            }
+            anyClosed |= state.closed;
         }
 
-        // This looks stupid, but it's required as remove_if() doesn't shrink the vector
-        clients.erase(std::remove_if(clients.begin(), clients.end(),
-                                     [](const auto &state)
-                                     { return state.closed; }),
-                      clients.end());
+        FlushClients();
+        nextClient = activeCount == 0 ? 0 : (nextClient + 1) % activeCount;
+        if (anyClosed)
+        {
+            RemoveClosedClients();
+            nextClient = 0;
+        }
     }
 
-    PotentialClient GetUpdateClient()
+    // Bounded alternative to ProcessClients(), stops once either budget is used and resumes from the next client on the following call
+    PollResult Poll(const uint32_t maxMicros, const uint16_t maxFrames = UINT16_MAX)
     {
-        // Process data from each client
-        for (ClientState &state : clients)
-        { // Use a reference so we don't copy
-            if (!state.client.connected())
+        const uint32_t start = micros();
+        const uint32_t now = millis();
+        PollResult result = {.FramesProcessed = 0, .ClientsDeferred = 0, .ElapsedMicros = 0};
+        inFlight = 0;
+        SweepTimeouts(now);
+
+        size_t visited = 0;
+        for (; visited < activeCount; visited++)
+        {
+            if (result.FramesProcessed >= maxFrames || micros() - start >= maxMicros)
             {
-                state.closed = true;
-                continue;
+                break;
             }
 
-            // Check if we need to force close the client
-            if (state.outputClosed)
+            ClientState &state = clients[active[(nextClient + visited) % activeCount]];
+            if (CheckClient(state))
             {
-                if (millis() - state.closedTime >= ShutdownTimeout)
-                {
-                    IPAddress ip = state.client.remoteIP();
-                    Serial.printf("Client shutdown timeout: %u.%u.%u.%u\r\n",
-                                  ip[0], ip[1], ip[2], ip[3]);
-                    state.client.close();
-                    state.closed = true;
-                    continue;
-                }
+                result.FramesProcessed += processModbusClient(state, now, maxFrames - result.FramesProcessed);
             }
-            else
+        }
+
+        for (size_t i = 0; i < activeCount; i++)
+        {
+            ClientState &state = clients[active[i]];
+            if (!state.closed && (state.client.available() || FrameLength(Framing, state.rx.data(), state.rxLength) > 0))
             {
-                if (millis() - state.lastRead >= ClientTimeout)
-                {
-                    IPAddress ip = state.client.remoteIP();
-                    Serial.printf("Client timeout: %u.%u.%u.%u\r\n", ip[0], ip[1], ip[2], ip[3]);
-                    state.client.close();
-                    state.closed = true;
-                    continue;
-                }
+                result.ClientsDeferred++;
             }
         }
 
-        // This looks stupid, but it's required as remove_if() doesn't shrink the vector
-        clients.erase(std::remove_if(clients.begin(), clients.end(),
-                                     [](const auto &state)
-                                     { return state.closed; }),
-                      clients.end());
+        FlushClients();
+        nextClient = activeCount == 0 ? 0 : (nextClient + visited) % activeCount;
+        RemoveClosedClients();
+        if (nextClient >= activeCount)
+        {
+            nextClient = 0;
+        }
+
+        result.ElapsedMicros = micros() - start;
+        return result;
+    }
+
+    PotentialClient GetUpdateClient()
+    {
+        const uint32_t now = millis();
+        SweepTimeouts(now);
+        for (size_t i = 0; i < activeCount; i++)
+        {
+            CheckClient(clients[active[i]]);
+        }
+        RemoveClosedClients();
 
-        if (clients.empty())
+        if (activeCount == 0)
         {
             return {.exists = false};
         }
-        return {.exists = true, .client = clients.back().client};
+        return {.exists = true, .client = clients[active[activeCount - 1]].client};
     }
 };
 
@@ -84,4 +84,52 @@ uint8_t *SplitBytes(uint16_t integer, Endianness EndianDesired, uint8_t *Bytes)
     memcpy(Bytes, &integer, 2);
     return Bytes;
 }
+
+// Lookup tables for Modbus ASCII hex encoding, -1 marks characters that aren't hex digits
+const int8_t HexValues[256] = {
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+     0,  1,  2,  3,  4,  5,  6,  7,  8,  9, -1, -1, -1, -1, -1, -1,
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+};
+const char HexDigits[17] = "0123456789ABCDEF";
+
+// Decodes pairs of hex characters into bytes, ascii and bytes may be the same buffer. Returns false on a non hex character
+bool DecodeHex(const uint8_t *ascii, uint8_t *bytes, size_t byteCount)
+{
+    for (size_t i = 0; i < byteCount; i++)
+    {
+        const int8_t high = HexValues[ascii[2 * i]];
+        const int8_t low = HexValues[ascii[2 * i + 1]];
+        if ((high | low) < 0)
+        {
+            return false;
+        }
+        bytes[i] = (high << 4) | low;
+    }
+    return true;
+}
+
+// Encodes bytes as pairs of upper case hex characters, works backwards so bytes and ascii may be the same buffer
+void EncodeHex(const uint8_t *bytes, uint8_t *ascii, size_t byteCount)
+{
+    for (size_t i = byteCount; i > 0; i--)
+    {
+        const uint8_t b = bytes[i - 1];
+        ascii[2 * i - 1] = HexDigits[b & 0x0F];
+        ascii[2 * i - 2] = HexDigits[b >> 4];
+    }
+}
 #endif
\ No newline at end of file
@@ -9,11 +9,14 @@
 #else
 #include <vector>
 #include <array>
+#include <atomic>
 using std::array;
 using std::vector;
 #endif
 
 #include <ModbusDataStructures.h>
+#include <ModbusCapture.h>
+#include <ModbusFileRecords.h>
 
 // Convert Modbus 984 address to array index, assumes you are using the correct array
 constexpr uint16_t M984(const long Address)
@@ -55,10 +58,28 @@ public:
     virtual void WriteSingle(const uint16_t Address, const uint16_t value) = 0;
     virtual void Read(const uint16_t Address, const uint8_t RegistersCount, uint8_t *ResponseBuffer) const = 0;
 
-    bool AddressInRange(const uint16_t address) const
+    uint16_t getLastAddress() const { return LastAddress; }
+
+    // Checked for the whole request before anything is written, false rejects it with IllegalDataValue.
+    // dataBuffer is in the request's wire format and may be adjusted in place (eg. clamping)
+    virtual bool ValidateWrite(const uint16_t /* Address */, const uint16_t /* RegistersCount */, uint8_t * /* dataBuffer */) { return true; }
+    virtual bool ValidateSingle(const uint16_t /* Address */, uint16_t & /* value */) { return true; }
+
+    // Called by Registers::ScanComplete() once the application has updated its values
+    virtual void OnScanComplete() {}
+
+    // FC24, moves up to ModbusFIFOMaxCount queued values to ResponseBuffer big endian and returns how many. Only queues serve it
+    virtual uint8_t ReadQueue(const uint16_t /* Address */, uint8_t * /* ResponseBuffer */) { return 0; }
+
+    virtual bool AddressInRange(const uint16_t address) const
     {
         return (FirstAddress <= address) && (address <= LastAddress);
     }
+    // Whether every address from Address to Address + RegistersCount - 1 is served, blocks with holes override this
+    virtual bool AllAddressesInRange(const uint16_t Address, const uint16_t RegistersCount) const
+    {
+        return RegistersCount > 0 && AddressInRange(Address) && AddressInRange(Address + RegistersCount - 1);
+    }
     bool ValidFunctionCode(const ModbusFunction FunctionCode) const
     {
         for (auto func : FunctionList)
@@ -108,21 +129,120 @@ public:
     {
         const auto AddressOffset = (Address - FirstAddress);
         const auto ResponseByteCount = getResponseByteCount(RegistersCount);
-        const auto PastLastAddress = AddressOffset + (8 * (ResponseByteCount - 1)) > Register::LastAddress;
         for (int i = 0; i < ResponseByteCount; i++)
         {
-            ResponseBuffer[i] = CompressBooleans(data + AddressOffset + (8 * i),
-                                                 PastLastAddress && i == ResponseByteCount - 1 ? static_cast<int8_t>((Address + (8 * i)) - Register::LastAddress) : static_cast<int8_t>(8));
+            const int remaining = RegistersCount - 8 * i; // The last byte is padded with zeros
+            ResponseBuffer[i] = CompressBooleans(data + AddressOffset + (8 * i), static_cast<int8_t>(remaining < 8 ? remaining : 8));
         }
     }
 };
 
+enum ConstraintAction : uint8_t
+{
+    RejectInvalid,
+    ClampToLimits, // Values outside Min/Max are written as the nearest limit
+};
+
+// Declarative limits on Modbus writes to FirstAddress..LastAddress of a HoldingRegister, see HoldingRegister::SetConstraints()
+struct WriteConstraint
+{
+    uint16_t FirstAddress;
+    uint16_t LastAddress;
+    int32_t Min = INT32_MIN;
+    int32_t Max = INT32_MAX;
+    bool Signed = false;               // Values are compared as int16_t
+    const uint16_t *Allowed = nullptr; // Enumeration of the only values accepted
+    uint8_t AllowedCount = 0;
+    bool ReadOnly = false;
+    bool WriteOnce = false; // Becomes read only after the first accepted write
+    ConstraintAction Action = RejectInvalid;
+    bool Written = false;
+};
+
 class HoldingRegister : public Register
 {
 private:
     uint16_t *data;
     const bool ReceiveBigEndian;
     const bool SendBigEndian;
+    WriteConstraint *constraints = nullptr;
+    uint8_t constraintCount = 0;
+
+    // Wire bytes to the value as it will be stored, and back
+    uint16_t decode(const uint8_t *bytes) const
+    {
+        uint16_t value;
+        memcpy(&value, bytes, 2);
+        return ReceiveBigEndian && EndiannessTest() == Little ? byteSwap(value) : value;
+    }
+    void encode(const uint16_t value, uint8_t *bytes) const
+    {
+        const uint16_t wire = ReceiveBigEndian && EndiannessTest() == Little ? byteSwap(value) : value;
+        memcpy(bytes, &wire, 2);
+    }
+    int32_t asNumber(const uint16_t value, const bool Signed) const
+    {
+        return Signed ? static_cast<int32_t>(static_cast<int16_t>(value)) : static_cast<int32_t>(value);
+    }
+
+    // A flag reduction over the block so the check compiles to a branch free loop
+    bool checkLimits(const WriteConstraint &constraint, uint8_t *values, const size_t count) const
+    {
+        if (constraint.Min == INT32_MIN && constraint.Max == INT32_MAX)
+        {
+            return true;
+        }
+        bool outside = false;
+        for (size_t i = 0; i < count; i++)
+        {
+            const int32_t value = asNumber(decode(values + 2 * i), constraint.Signed);
+            outside |= (value < constraint.Min) | (value > constraint.Max);
+        }
+        if (!outside)
+        {
+            return true;
+        }
+        if (constraint.Action != ClampToLimits)
+        {
+            return false;
+        }
+        for (size_t i = 0; i < count; i++)
+        {
+            const int32_t value = asNumber(decode(values + 2 * i), constraint.Signed);
+            const int32_t clamped = value < constraint.Min ? constraint.Min : value > constraint.Max ? constraint.Max
+                                                                                                    : value;
+            encode(static_cast<uint16_t>(clamped), values + 2 * i);
+        }
+        return true;
+    }
+    bool checkAllowed(const WriteConstraint &constraint, const uint8_t *values, const size_t count) const
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            const uint16_t value = decode(values + 2 * i);
+            bool found = false;
+            for (uint8_t j = 0; j < constraint.AllowedCount; j++)
+            {
+                found |= constraint.Allowed[j] == value;
+            }
+            if (!found)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+    void markWritten(const uint16_t Address, const uint16_t RegistersCount)
+    {
+        for (uint8_t i = 0; i < constraintCount; i++)
+        {
+            WriteConstraint &constraint = constraints[i];
+            if (constraint.WriteOnce && Address <= constraint.LastAddress && Address + RegistersCount - 1 >= constraint.FirstAddress)
+            {
+                constraint.Written = true;
+            }
+        }
+    }
 
 public:
     HoldingRegister(uint16_t FirstAddress, uint16_t LastAddress, vector<ModbusFunction> FunctionList, uint16_t *data, bool ReceiveBigEndian, bool SendBigEndian)
@@ -131,6 +251,49 @@ public:
         : HoldingRegister(FirstAddress, LastAddress, FunctionList, data, true, true) {};
     ~HoldingRegister() {};
 
+    // Constraints is user owned storage, kept mutable for the write once state. Only Modbus writes are checked
+    void SetConstraints(WriteConstraint *Constraints, const uint8_t Count)
+    {
+        constraints = Constraints;
+        constraintCount = Count;
+    }
+
+    bool ValidateWrite(const uint16_t Address, const uint16_t RegistersCount, uint8_t *dataBuffer) override
+    {
+        for (uint8_t i = 0; i < constraintCount; i++)
+        {
+            const WriteConstraint &constraint = constraints[i];
+            const uint16_t first = Address > constraint.FirstAddress ? Address : constraint.FirstAddress;
+            const uint16_t last = Address + RegistersCount - 1 < constraint.LastAddress ? Address + RegistersCount - 1 : constraint.LastAddress;
+            if (first > last)
+            {
+                continue;
+            }
+            if (constraint.ReadOnly || (constraint.WriteOnce && constraint.Written))
+            {
+                return false;
+            }
+            uint8_t *values = dataBuffer + 2 * (first - Address);
+            const size_t count = last - first + 1;
+            if (!checkLimits(constraint, values, count) || (constraint.Allowed != nullptr && !checkAllowed(constraint, values, count)))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+    bool ValidateSingle(const uint16_t Address, uint16_t &value) override
+    {
+        uint8_t bytes[2];
+        SplitBytes(value, Big, bytes); // As it arrived on the wire
+        if (!ValidateWrite(Address, 1, bytes))
+        {
+            return false;
+        }
+        value = CombineBytes(bytes[0], bytes[1]);
+        return true;
+    }
+
     uint8_t *getDataLocation(const uint16_t Address) const override
     {
         return reinterpret_cast<uint8_t *>(data + (Address - FirstAddress));
@@ -141,6 +304,7 @@ public:
     }
     void Write(const uint16_t Address, const uint8_t RegistersCount, uint8_t *dataBuffer) override
     {
+        markWritten(Address, RegistersCount);
         if (ReceiveBigEndian && EndiannessTest() == Little)
         {
             uint16_t *dataBuffer16 = reinterpret_cast<uint16_t *>(dataBuffer);
@@ -155,6 +319,7 @@ public:
     }
     void WriteSingle(const uint16_t Address, const uint16_t value) override
     {
+        markWritten(Address, 1);
         data[Address - FirstAddress] = !ReceiveBigEndian && EndiannessTest() == Little ? byteSwap(value) : value; // endianness is assumed Big in ParseRequestPDU and converted to little, this reverses that if needed
     }
 
@@ -172,183 +337,1503 @@ public:
     }
 };
 
-class Registers
+// Two level page table for sparse address spaces, pages of 256 values are taken from a user supplied pool when first used
+template <typename T>
+class SparsePageTable
 {
 private:
-#if defined(__AVR__) || defined(noStdArray)
-    uint8_t responseBuffer[64] = {0};
-#endif
-    const vector<Register *> RegisterList;
+    T *pages[256] = {nullptr};
+    T (*pool)[256];
+    const size_t poolPages;
+    size_t usedPages = 0;
+
+public:
+    SparsePageTable(T (*pool)[256], size_t poolPages) : pool{pool}, poolPages{poolPages} {};
 
-    Register *getRegister(const ModbusRequestPDU PDU) const
+    // nullptr if the address isn't mapped
+    T *Find(const uint16_t Address) const
     {
-        for (Register *reg : RegisterList)
+        T *page = pages[Address >> 8];
+        return page == nullptr ? nullptr : page + (Address & 0xFF);
+    }
+
+    // Maps the page holding Address if needed, nullptr once the pool is exhausted
+    T *Locate(const uint16_t Address)
+    {
+        T *&page = pages[Address >> 8];
+        if (page == nullptr)
         {
-            if (reg->ValidFunctionCode(PDU.FunctionCode) && reg->AddressInRange(PDU.Address))
+            if (usedPages == poolPages)
             {
-                return reg;
+                return nullptr;
             }
+            page = pool[usedPages++];
+            memset(page, 0, sizeof(pool[0]));
         }
-
-        return nullptr;
+        return page + (Address & 0xFF);
     }
-    bool ValidFunctionCode(const ModbusFunction FunctionCode) const
+
+    bool Mapped(const uint16_t Address, const uint16_t Count) const
     {
-        for (const Register *reg : RegisterList)
+        for (uint32_t page = Address >> 8; page <= static_cast<uint32_t>(Address + Count - 1) >> 8; page++)
         {
-            if (reg->ValidFunctionCode(FunctionCode))
+            if (page > 0xFF || pages[page] == nullptr)
             {
-                return true;
+                return false;
             }
         }
-        return false;
+        return true;
     }
 
-    bool ValidAddress(const ModbusFunction FunctionCode, const uint16_t address) const
+    // Number of consecutive values from Address that lie in the same page
+    static uint16_t RunLength(const uint16_t Address, const uint16_t Count)
     {
-        for (const Register *reg : RegisterList)
+        const uint16_t left = 256 - (Address & 0xFF);
+        return Count < left ? Count : left;
+    }
+
+    size_t UsedPages() const { return usedPages; }
+};
+
+// Holding registers spread anywhere in 0-65535 with memory only for the 256 register pages actually used.
+// The application maps addresses with Map() or Locate() before they are served, unmapped addresses answer IllegalDataAddress
+class SparseHoldingRegister : public Register
+{
+private:
+    SparsePageTable<uint16_t> table;
+    const bool ReceiveBigEndian;
+    const bool SendBigEndian;
+
+public:
+    SparseHoldingRegister(vector<ModbusFunction> FunctionList, uint16_t (*pool)[256], size_t poolPages, bool ReceiveBigEndian, bool SendBigEndian)
+        : Register(0, 0xFFFF, FunctionList), table(pool, poolPages), ReceiveBigEndian{ReceiveBigEndian}, SendBigEndian{SendBigEndian} {};
+    SparseHoldingRegister(vector<ModbusFunction> FunctionList, uint16_t (*pool)[256], size_t poolPages)
+        : SparseHoldingRegister(FunctionList, pool, poolPages, true, true) {};
+    ~SparseHoldingRegister() {};
+
+    // Returns false if the pool ran out of pages
+    bool Map(const uint16_t First, const uint16_t Last)
+    {
+        for (uint32_t address = First; address <= Last; address += 256 - (address & 0xFF))
         {
-            if (reg->ValidFunctionCode(FunctionCode) && reg->AddressInRange(address))
+            if (table.Locate(address) == nullptr)
             {
-                return true;
+                return false;
             }
         }
-        return false;
+        return true;
     }
+    // Application access to a value, mapping it if needed. nullptr once the pool is exhausted
+    uint16_t *Locate(const uint16_t Address) { return table.Locate(Address); }
 
-    ModbusResponsePDU getErrorCode(const ModbusRequestPDU PDU) const
+    bool AddressInRange(const uint16_t address) const override
     {
-        ModbusResponsePDU response;
-        response.FunctionCode = PDU.FunctionCode;
+        return table.Find(address) != nullptr;
+    }
+    bool AllAddressesInRange(const uint16_t Address, const uint16_t RegistersCount) const override
+    {
+        return RegistersCount > 0 && table.Mapped(Address, RegistersCount);
+    }
 
-        if (!ValidFunctionCode(PDU.FunctionCode))
+    uint8_t *getDataLocation(const uint16_t Address) const override
+    {
+        return reinterpret_cast<uint8_t *>(table.Find(Address));
+    }
+    uint8_t getResponseByteCount(const uint8_t RegistersCount) const override
+    {
+        return RegistersCount * sizeof(uint16_t);
+    }
+    void Write(const uint16_t Address, const uint8_t RegistersCount, uint8_t *dataBuffer) override
+    {
+        const bool swap = ReceiveBigEndian && EndiannessTest() == Little;
+        for (uint16_t done = 0; done < RegistersCount;)
         {
-            // printf("IllegalFunction error on address: %u, and func code: %u\n", PDU.Address, (uint8_t)PDU.FunctionCode);
-            response.Error = ModbusError::IllegalFunction;
+            const uint16_t run = table.RunLength(Address + done, RegistersCount - done);
+            uint16_t *destination = table.Find(Address + done);
+            memcpy(destination, dataBuffer + 2 * done, 2 * run);
+            if (swap)
+            {
+                for (uint16_t i = 0; i < run; i++)
+                {
+                    destination[i] = byteSwap(destination[i]);
+                }
+            }
+            done += run;
         }
-        else if (!ValidAddress(PDU.FunctionCode, PDU.Address))
+    }
+    void WriteSingle(const uint16_t Address, const uint16_t value) override
+    {
+        *table.Find(Address) = !ReceiveBigEndian && EndiannessTest() == Little ? byteSwap(value) : value; // endianness is assumed Big in ParseRequestPDU and converted to little, this reverses that if needed
+    }
+    void Read(const uint16_t Address, const uint8_t RegistersCount, uint8_t *ResponseBuffer) const override
+    {
+        for (uint16_t done = 0; done < RegistersCount;)
         {
-            // printf("IllegalDataAddress error on address: %u, and func code: %u\n", PDU.Address, (uint8_t)PDU.FunctionCode);
-            response.Error = ModbusError::IllegalDataAddress;
+            const uint16_t run = table.RunLength(Address + done, RegistersCount - done);
+            memcpy(ResponseBuffer + 2 * done, table.Find(Address + done), 2 * run);
+            done += run;
         }
-        else
+        if ((SendBigEndian && EndiannessTest() == Little) || (!SendBigEndian && EndiannessTest() == Big))
         {
-            // printf("SlaveDeviceFailure error on address: %u, and func code: %u\n", PDU.Address, (uint8_t)PDU.FunctionCode);
-            response.Error = ModbusError::SlaveDeviceFailure;
+            uint16_t *ResponseBuffer16 = (uint16_t *)ResponseBuffer;
+            for (size_t i = 0; i < RegistersCount; i++)
+            {
+                ResponseBuffer16[i] = byteSwap(ResponseBuffer16[i]);
+            }
         }
-        return response;
     }
+};
+
+// Coils spread anywhere in 0-65535, one byte per coil as with CoilRegister
+class SparseCoilRegister : public Register
+{
+private:
+    SparsePageTable<uint8_t> table;
 
 public:
-    explicit Registers(vector<Register *> RegisterList) : RegisterList{RegisterList} {};
-    ~Registers() {};
-    ModbusResponsePDU ProcessRequest(ModbusRequestPDU PDU)
-    {
-        Register *reg = getRegister(PDU);
-        if (reg == nullptr)
-        {
-            // printf("No valid register found for address: %u, and func code: %u\n", PDU.Address, (uint8_t)PDU.FunctionCode);
-            return getErrorCode(PDU);
-        }
+    SparseCoilRegister(vector<ModbusFunction> FunctionList, uint8_t (*pool)[256], size_t poolPages)
+        : Register(0, 0xFFFF, FunctionList), table(pool, poolPages) {};
+    ~SparseCoilRegister() {};
 
-        ModbusResponsePDU response;
-        response.FunctionCode = PDU.FunctionCode;
-        switch (PDU.FunctionCode)
+    // Returns false if the pool ran out of pages
+    bool Map(const uint16_t First, const uint16_t Last)
+    {
+        for (uint32_t address = First; address <= Last; address += 256 - (address & 0xFF))
         {
-        case ModbusFunction::ReadCoils:
-        case ModbusFunction::ReadDiscreteInputs:
-            if (!reg->AddressInRange(PDU.Address + PDU.NumberOfRegisters - 1))
+            if (table.Locate(address) == nullptr)
             {
-                response.Error = ModbusError::IllegalDataAddress;
-                break;
+                return false;
             }
-            response.DataByteCount = reg->getResponseByteCount(PDU.NumberOfRegisters); // first
+        }
+        return true;
+    }
+    // Application access to a coil, mapping it if needed. nullptr once the pool is exhausted
+    uint8_t *Locate(const uint16_t Address) { return table.Locate(Address); }
 
-#if defined(__AVR__) || defined(noStdArray)
-            response.RegisterValue.setStorage(responseBuffer, response.DataByteCount);
-#else
-            response.RegisterValue.resize(response.DataByteCount);
-#endif
-            // memcpy(response.RegisterValue.data(), reg->getDataLocation(PDU.Address), response.DataByteCount);
-            reg->Read(PDU.Address, PDU.NumberOfRegisters, response.RegisterValue.data());
-            break;
-        case ModbusFunction::ReadHoldingRegisters:
-        case ModbusFunction::ReadInputRegisters:
-            if (!reg->AddressInRange(PDU.Address + PDU.NumberOfRegisters - 1))
-            {
-                response.Error = ModbusError::IllegalDataAddress;
-                break;
-            }
-            response.DataByteCount = reg->getResponseByteCount(PDU.NumberOfRegisters);
-#if defined(__AVR__) || defined(noStdArray)
-            response.RegisterValue.setStorage(responseBuffer, response.DataByteCount);
-#else
-            response.RegisterValue.resize(response.DataByteCount);
-#endif
-            // memcpy(response.RegisterValue.data(), reg->getDataLocation(PDU.Address), response.DataByteCount);
-            reg->Read(PDU.Address, PDU.NumberOfRegisters, response.RegisterValue.data());
-            break;
-        case ModbusFunction::WriteSingleCoil:
-        case ModbusFunction::WriteSingleHoldingRegister:
-            reg->WriteSingle(PDU.Address, PDU.RegisterValue);
-            break;
-        case ModbusFunction::WriteMultipleCoils:
-        case ModbusFunction::WriteMultipleHoldingRegisters:
-            if (PDU.NumberOfRegisters == 0)
-            {
-                response.Error = ModbusError::IllegalDataValue;
-                break;
-            }
-            reg->Write(PDU.Address, PDU.NumberOfRegisters, PDU.Values.data());
-            break;
-        default:
-            // printf("IllegalFunction address: %u, and func code: %u", PDU.Address, (uint8_t)PDU.FunctionCode);
-            response.Error = ModbusError::IllegalFunction;
+    bool AddressInRange(const uint16_t address) const override
+    {
+        return table.Find(address) != nullptr;
+    }
+    bool AllAddressesInRange(const uint16_t Address, const uint16_t RegistersCount) const override
+    {
+        return RegistersCount > 0 && table.Mapped(Address, RegistersCount);
+    }
+
+    uint8_t *getDataLocation(const uint16_t Address) const override
+    {
+        return table.Find(Address);
+    }
+    uint8_t getResponseByteCount(const uint8_t RegistersCount) const override
+    {
+        return RegistersCount / 8 + ((RegistersCount % 8) ? 1 : 0);
+    }
+    void Write(const uint16_t Address, const uint8_t RegistersCount, uint8_t *dataBuffer) override
+    {
+        for (uint16_t i = 0; i < RegistersCount; i++)
+        {
+            *table.Find(Address + i) = (dataBuffer[i / 8] >> (i % 8)) & 1;
         }
-        return response;
     }
-    uint8_t ProcessStream(uint8_t *ModbusFrame)
+    void WriteSingle(const uint16_t Address, const uint16_t value) override
     {
-        const auto Request = ParseRequestPDU(ModbusFrame);
-        const auto Response = this->ProcessRequest(Request);
-        const auto stream = ModbusResponsePDUtoStream(Response, ModbusFrame);
-        return stream;
+        *table.Find(Address) = value > 0;
+    }
+    void Read(const uint16_t Address, const uint8_t RegistersCount, uint8_t *ResponseBuffer) const override
+    {
+        memset(ResponseBuffer, 0, getResponseByteCount(RegistersCount));
+        for (uint16_t i = 0; i < RegistersCount; i++)
+        {
+            ResponseBuffer[i / 8] |= (*table.Find(Address + i) != 0) << (i % 8);
+        }
     }
 };
 
-template <size_t BufferSize>
-size_t ReceiveTCPStream(Registers &registers, array<uint8_t, BufferSize> &ModbusFrame, const uint16_t byteCount)
+#ifndef __AVR__
+// FC24 queue at a single FIFO pointer address, for events the application must not lose between polls. The control
+// loop Push()es values into a lock free single producer, single consumer ring and each FC24 request drains up to
+// ModbusFIFOMaxCount of them. Reading the address with FC03, if listed, returns the queued count without draining
+class FIFORegister : public Register
 {
-    if (byteCount <= 7 || byteCount > BufferSize)
+private:
+    uint16_t *buffer;
+    const size_t mask;
+    std::atomic<size_t> head{0}; // Written by the producer only
+    std::atomic<size_t> tail{0}; // Written by the consumer only
+
+public:
+    std::atomic<uint32_t> Overflows{0}; // Values pushed while the queue was full
+
+    // Size must be a power of two
+    FIFORegister(uint16_t Address, vector<ModbusFunction> FunctionList, uint16_t *buffer, size_t Size)
+        : Register(Address, Address, FunctionList), buffer{buffer}, mask{Size - 1} {};
+    ~FIFORegister() {};
+
+    // Producer side, returns false (and drops the value) if the queue is full
+    bool Push(const uint16_t value)
     {
-        return 0;
+        const size_t position = head.load(std::memory_order_relaxed);
+        if (position - tail.load(std::memory_order_acquire) > mask)
+        {
+            Overflows.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        buffer[position & mask] = value;
+        head.store(position + 1, std::memory_order_release);
+        return true;
     }
+    size_t Count() const { return head.load(std::memory_order_acquire) - tail.load(std::memory_order_relaxed); }
 
-    const MBAPHead header = MBAPfromBytes(ModbusFrame.data());
-    if (header.ProtocolID != 0 || header.Length + 6 > byteCount)
+    uint8_t ReadQueue(const uint16_t /* Address */, uint8_t *ResponseBuffer) override
     {
-        return 0;
+        const size_t position = tail.load(std::memory_order_relaxed);
+        const size_t available = head.load(std::memory_order_acquire) - position;
+        const uint8_t count = available < ModbusFIFOMaxCount ? available : ModbusFIFOMaxCount;
+        for (uint8_t i = 0; i < count; i++)
+        {
+            SplitBytes(buffer[(position + i) & mask], Big, ResponseBuffer + 2 * i);
+        }
+        tail.store(position + count, std::memory_order_release);
+        return count;
     }
 
-    const auto size = registers.ProcessStream(ModbusFrame.data() + 7);
-    ModbusFrame[5] = size + 1;
-    return 7 + size;
-}
+    uint8_t *getDataLocation(const uint16_t /* Address */) const override { return nullptr; }
+    uint8_t getResponseByteCount(const uint8_t RegistersCount) const override { return RegistersCount * sizeof(uint16_t); }
+    void Write(const uint16_t /* Address */, const uint8_t /* RegistersCount */, uint8_t * /* dataBuffer */) override {}
+    void WriteSingle(const uint16_t /* Address */, const uint16_t /* value */) override {}
+    void Read(const uint16_t /* Address */, const uint8_t /* RegistersCount */, uint8_t *ResponseBuffer) const override
+    {
+        const size_t count = Count();
+        SplitBytes(count > 0xFFFF ? 0xFFFF : count, Big, ResponseBuffer);
+    }
+};
+#endif
 
-template <size_t BufferSize>
-size_t ReceiveRTUStream(Registers &registers, array<uint8_t, BufferSize> &ModbusFrame, const uint8_t byteCount)
+// Time series of selected addresses of another block, sampled every SampleEvery scans into a ring held as structure of
+// arrays (one row of Depth samples per channel, plus a timestamp row), so historians can fetch many samples per request.
+// Registers from FirstAddress:
+//   +0, +1  number of samples taken, high word first
+//   +2      Depth
+//   +3      Channels
+//   +4      Depth samples per channel, channel 0 first, newest sample first
+//   then    Depth timestamps of 2 registers, high word first, newest first
+// Samples not taken yet read as 0. A request covering the header and part of a row is consistent as sampling happens in ScanComplete()
+class HistoryRegister : public Register
 {
-    if (byteCount <= 7 || byteCount > BufferSize || !CRC16Check(ModbusFrame.data(), byteCount))
+private:
+    Register &source;
+    const uint16_t *sourceAddresses;
+    const uint16_t channels;
+    uint16_t *samples;    // channels rows of depth
+    uint32_t *timestamps; // depth
+    const uint16_t depth;
+    uint32_t (*clock)();
+    uint16_t head = 0; // Slot of the next sample
+    uint32_t taken = 0;
+    uint16_t scans = 0;
+
+    uint16_t slotOf(const uint16_t age) const
     {
-        return 0;
+        return (head + depth - 1 - age) % depth;
+    }
+    // Depth reduced so the register ends by address 0xFFFF, 0 if not even one sample fits
+    static uint16_t fittingDepth(const uint16_t FirstAddress, const uint16_t Channels, const uint16_t Depth)
+    {
+        const uint32_t room = 0xFFFFu - FirstAddress;
+        if (room < 3)
+        {
+            return 0;
+        }
+        const uint32_t fits = (room - 3) / (static_cast<uint32_t>(Channels) + 2);
+        return Depth < fits ? Depth : fits;
+    }
+    static uint16_t lastAddress(const uint16_t FirstAddress, const uint16_t Channels, const uint16_t Depth)
+    {
+        const uint32_t last = FirstAddress + 3 + (static_cast<uint32_t>(Channels) + 2) * fittingDepth(FirstAddress, Channels, Depth);
+        return last > 0xFFFF ? 0xFFFF : last;
+    }
+    uint16_t valueAt(uint32_t offset) const
+    {
+        switch (offset)
+        {
+        case 0:
+            return taken >> 16;
+        case 1:
+            return taken & 0xFFFF;
+        case 2:
+            return depth;
+        case 3:
+            return channels;
+        }
+        offset -= 4;
+        const uint32_t rows = static_cast<uint32_t>(channels) * depth;
+        const uint16_t age = offset < rows ? offset % depth : (offset - rows) / 2;
+        if (age >= taken)
+        {
+            return 0;
+        }
+        if (offset < rows)
+        {
+            return samples[(offset / depth) * depth + slotOf(age)];
+        }
+        const uint32_t time = timestamps[slotOf(age)];
+        return (offset - rows) % 2 == 0 ? time >> 16 : time & 0xFFFF;
+    }
+
+public:
+    uint16_t SampleEvery = 1; // Scans per sample
+
+    // Samples Channels addresses of Source (which must serve them with a single register read) into samples, user
+    // storage of Channels * Depth values, and timestamps of Depth values from MillisClock. Only as many samples are
+    // kept as fit below address 0xFFFF, see the depth in the header
+    HistoryRegister(uint16_t FirstAddress, vector<ModbusFunction> FunctionList, Register &Source, const uint16_t *SourceAddresses, const uint16_t Channels,
+                    uint16_t *samples, uint32_t *timestamps, const uint16_t Depth, uint32_t (*MillisClock)())
+        : Register(FirstAddress, lastAddress(FirstAddress, Channels, Depth), FunctionList), source{Source}, sourceAddresses{SourceAddresses},
+          channels{Channels}, samples{samples}, timestamps{timestamps}, depth{fittingDepth(FirstAddress, Channels, Depth)}, clock{MillisClock} {};
+    ~HistoryRegister() {};
+
+    void Sample()
+    {
+        if (depth == 0)
+        {
+            return;
+        }
+        for (uint16_t channel = 0; channel < channels; channel++)
+        {
+            uint8_t bytes[2];
+            source.Read(sourceAddresses[channel], 1, bytes);
+            samples[channel * depth + head] = CombineBytes(bytes[0], bytes[1]); // Read gives big endian bytes, kept as a host value
+        }
+        timestamps[head] = clock();
+        head = (head + 1) % depth;
+        taken++;
+    }
+    void OnScanComplete() override
+    {
+        if (++scans >= SampleEvery)
+        {
+            scans = 0;
+            Sample();
+        }
+    }
+    uint32_t Taken() const { return taken; }
+
+    uint8_t *getDataLocation(const uint16_t /* Address */) const override { return nullptr; }
+    uint8_t getResponseByteCount(const uint8_t RegistersCount) const override { return RegistersCount * sizeof(uint16_t); }
+    void Write(const uint16_t /* Address */, const uint8_t /* RegistersCount */, uint8_t * /* dataBuffer */) override {}
+    void WriteSingle(const uint16_t /* Address */, const uint16_t /* value */) override {}
+    void Read(const uint16_t Address, const uint8_t RegistersCount, uint8_t *ResponseBuffer) const override
+    {
+        for (uint16_t i = 0; i < RegistersCount; i++)
+        {
+            SplitBytes(valueAt(static_cast<uint32_t>(Address - FirstAddress) + i), Big, ResponseBuffer + 2 * i);
+        }
+    }
+};
+
+struct ComputedValue
+{
+    uint16_t Value;
+    uint16_t Scan; // Generation the value was computed in, 0 never
+};
+
+// Derived values (scaled units, status words packed from coils, ...) produced by Compute only when a request reads them.
+// Each value is computed at most once per scan and reused by every request until the next Registers::ScanComplete(),
+// or Invalidate() if its inputs change mid scan. values is user storage, one per address
+class ComputedRegister : public Register
+{
+private:
+    uint16_t (*compute)(const uint16_t Address, void *Context);
+    void *context;
+    ComputedValue *values;
+    uint16_t generation = 1;
+
+public:
+    ComputedRegister(uint16_t FirstAddress, uint16_t LastAddress, vector<ModbusFunction> FunctionList, uint16_t (*Compute)(const uint16_t Address, void *Context), void *Context, ComputedValue *values)
+        : Register(FirstAddress, LastAddress, FunctionList), compute{Compute}, context{Context}, values{values}
+    {
+        Reset();
+    };
+    ~ComputedRegister() {};
+
+    // Forgets every value, also used when the generation wraps
+    void Reset()
+    {
+        for (uint32_t i = 0; i <= static_cast<uint32_t>(LastAddress - FirstAddress); i++)
+        {
+            values[i].Scan = 0;
+        }
+        generation = 1;
+    }
+    void Invalidate()
+    {
+        if (++generation == 0)
+        {
+            Reset();
+        }
+    }
+    void OnScanComplete() override { Invalidate(); }
+
+    uint8_t *getDataLocation(const uint16_t /* Address */) const override { return nullptr; }
+    uint8_t getResponseByteCount(const uint8_t RegistersCount) const override { return RegistersCount * sizeof(uint16_t); }
+    void Write(const uint16_t /* Address */, const uint8_t /* RegistersCount */, uint8_t * /* dataBuffer */) override {}
+    void WriteSingle(const uint16_t /* Address */, const uint16_t /* value */) override {}
+    void Read(const uint16_t Address, const uint8_t RegistersCount, uint8_t *ResponseBuffer) const override
+    {
+        for (uint16_t i = 0; i < RegistersCount; i++)
+        {
+            ComputedValue &value = values[Address - FirstAddress + i];
+            if (value.Scan != generation)
+            {
+                value.Value = compute(Address + i, context);
+                value.Scan = generation;
+            }
+            SplitBytes(value.Value, Big, ResponseBuffer + 2 * i);
+        }
+    }
+};
+
+// Per point scaling of a ScaledRegister, as parallel arrays so the conversions vectorize
+struct ScaleTable
+{
+    const float *Gain;   // Engineering units per count
+    const float *Offset; // Engineering value at 0 counts
+    const float *Min;    // Limits in counts, nullptr for the whole int16 or uint16 range
+    const float *Max;
+};
+
+// Integer view of a float array for clients that expect scaled counts, counts = (value - Offset) / Gain rounded and
+// clamped, NaN counts as 0. Writes store count * Gain + Offset, clamped the same way. The floats stay the only copy, a HoldingRegister
+// over them can serve the same data as floats at other addresses
+class ScaledRegister : public Register
+{
+private:
+    static const uint8_t Chunk = 32; // Points converted per pass, bounds the stack used
+    float *values;
+    const ScaleTable scale;
+    const bool Signed;
+
+    float low() const { return Signed ? -32768.0f : 0.0f; }
+    float high() const { return Signed ? 32767.0f : 65535.0f; }
+
+    // Clamps count points from index to the block's range and any per point limits
+    void clamp(float *counts, const uint16_t index, const uint8_t count) const
+    {
+        const float lowest = low();
+        const float highest = high();
+        for (uint8_t i = 0; i < count; i++)
+        {
+            counts[i] = counts[i] < lowest ? lowest : counts[i];
+            counts[i] = counts[i] > highest ? highest : counts[i];
+        }
+        if (scale.Min != nullptr)
+        {
+            for (uint8_t i = 0; i < count; i++)
+            {
+                counts[i] = counts[i] < scale.Min[index + i] ? scale.Min[index + i] : counts[i];
+            }
+        }
+        if (scale.Max != nullptr)
+        {
+            for (uint8_t i = 0; i < count; i++)
+            {
+                counts[i] = counts[i] > scale.Max[index + i] ? scale.Max[index + i] : counts[i];
+            }
+        }
+    }
+
+public:
+    ScaledRegister(uint16_t FirstAddress, uint16_t LastAddress, vector<ModbusFunction> FunctionList, float *values, const ScaleTable &Scale, bool Signed)
+        : Register(FirstAddress, LastAddress, FunctionList), values{values}, scale(Scale), Signed{Signed} {};
+    ~ScaledRegister() {};
+
+    uint8_t *getDataLocation(const uint16_t /* Address */) const override { return nullptr; }
+    uint8_t getResponseByteCount(const uint8_t RegistersCount) const override { return RegistersCount * sizeof(uint16_t); }
+
+    void Read(const uint16_t Address, const uint8_t RegistersCount, uint8_t *ResponseBuffer) const override
+    {
+        float counts[Chunk];
+        for (uint16_t done = 0; done < RegistersCount; done += Chunk)
+        {
+            const uint8_t count = RegistersCount - done < Chunk ? RegistersCount - done : Chunk;
+            const uint16_t index = Address - FirstAddress + done;
+            for (uint8_t i = 0; i < count; i++)
+            {
+                counts[i] = (values[index + i] - scale.Offset[index + i]) / scale.Gain[index + i];
+                counts[i] = counts[i] != counts[i] ? 0.0f : counts[i]; // NaN passes every clamp and can't be cast, reads as 0
+            }
+            clamp(counts, index, count);
+            uint8_t *out = ResponseBuffer + 2 * done;
+            for (uint8_t i = 0; i < count; i++)
+            {
+                const float rounded = counts[i] + (counts[i] < 0 ? -0.5f : 0.5f);
+                const uint16_t word = static_cast<uint16_t>(static_cast<int32_t>(rounded));
+                out[2 * i] = word >> 8;
+                out[2 * i + 1] = word & 0xFF;
+            }
+        }
+    }
+    void Write(const uint16_t Address, const uint8_t RegistersCount, uint8_t *dataBuffer) override
+    {
+        float counts[Chunk];
+        for (uint16_t done = 0; done < RegistersCount; done += Chunk)
+        {
+            const uint8_t count = RegistersCount - done < Chunk ? RegistersCount - done : Chunk;
+            const uint16_t index = Address - FirstAddress + done;
+            const uint8_t *in = dataBuffer + 2 * done;
+            for (uint8_t i = 0; i < count; i++)
+            {
+                const uint16_t word = (in[2 * i] << 8) | in[2 * i + 1];
+                counts[i] = Signed ? static_cast<float>(static_cast<int16_t>(word)) : static_cast<float>(word);
+            }
+            clamp(counts, index, count);
+            for (uint8_t i = 0; i < count; i++)
+            {
+                values[index + i] = counts[i] * scale.Gain[index + i] + scale.Offset[index + i];
+            }
+        }
+    }
+    void WriteSingle(const uint16_t Address, const uint16_t value) override
+    {
+        uint8_t bytes[2];
+        SplitBytes(value, Big, bytes);
+        Write(Address, 1, bytes);
+    }
+};
+
+struct CachedResponse
+{
+    uint32_t Generation = 0;
+    ModbusFunction FunctionCode = ModbusFunction::ReadCoils;
+    uint16_t Address = 0;
+    uint16_t NumberOfRegisters = 0;
+    uint8_t Length = 0;
+    uint8_t PDU[253]; // Encoded response PDU, 253 is the Modbus maximum
+};
+
+// Opt-in cache of encoded read responses, the storage is supplied by the user so nothing is allocated at runtime.
+// Entries are only valid for the current generation, which is bumped by Modbus writes and Registers::ScanComplete()
+class ResponseCache
+{
+private:
+    CachedResponse *entries;
+    const size_t entryCount;
+    uint32_t generation = 1;
+
+    CachedResponse &getEntry(const ModbusFunction FunctionCode, const uint16_t Address, const uint16_t NumberOfRegisters) const
+    {
+        const uint16_t hash = Address ^ (NumberOfRegisters << 5) ^ (static_cast<uint16_t>(FunctionCode) << 11);
+        return entries[hash % entryCount];
+    }
+
+public:
+    ResponseCache(CachedResponse *entries, size_t entryCount) : entries{entries}, entryCount{entryCount} {};
+    ~ResponseCache() {};
+
+    static bool Cacheable(const ModbusFunction FunctionCode)
+    {
+        return FunctionCode >= ModbusFunction::ReadCoils && FunctionCode <= ModbusFunction::ReadInputRegisters;
+    }
+
+    // ModbusFrame must be the beginning of the request PDU, on a hit it is overwritten with the cached response PDU
+    uint8_t Fetch(uint8_t *ModbusFrame) const
+    {
+        const auto FunctionCode = static_cast<ModbusFunction>(ModbusFrame[0]);
+        const auto Address = CombineBytes(ModbusFrame[1], ModbusFrame[2]);
+        const auto NumberOfRegisters = CombineBytes(ModbusFrame[3], ModbusFrame[4]);
+        const CachedResponse &entry = getEntry(FunctionCode, Address, NumberOfRegisters);
+        if (entry.Generation != generation || entry.FunctionCode != FunctionCode || entry.Address != Address || entry.NumberOfRegisters != NumberOfRegisters)
+        {
+            return 0;
+        }
+        memcpy(ModbusFrame, entry.PDU, entry.Length);
+        return entry.Length;
+    }
+
+    void Store(const ModbusRequestPDU &Request, const uint8_t *ResponsePDU, const uint8_t Length)
+    {
+        CachedResponse &entry = getEntry(Request.FunctionCode, Request.Address, Request.NumberOfRegisters);
+        entry.Generation = generation;
+        entry.FunctionCode = Request.FunctionCode;
+        entry.Address = Request.Address;
+        entry.NumberOfRegisters = Request.NumberOfRegisters;
+        entry.Length = Length;
+        memcpy(entry.PDU, ResponsePDU, Length);
+    }
+
+    void Invalidate()
+    {
+        generation++;
+        if (generation == 0) // Wrapped, 0 would match never used entries
+        {
+            generation = 1;
+        }
+    }
+};
+
+class Registers
+{
+private:
+#if defined(__AVR__) || defined(noStdArray)
+    uint8_t responseBuffer[64] = {0};
+#endif
+    const vector<Register *> RegisterList;
+    ResponseCache *cache = nullptr;
+    FileRecordStore *files = nullptr;
+    bool spanning = false;
+
+    Register *getRegister(const ModbusFunction FunctionCode, const uint16_t Address) const
+    {
+        for (Register *reg : RegisterList)
+        {
+            if (reg->ValidFunctionCode(FunctionCode) && reg->AddressInRange(Address))
+            {
+                return reg;
+            }
+        }
+
+        return nullptr;
+    }
+    Register *getRegister(const ModbusRequestPDU &PDU) const
+    {
+        return getRegister(PDU.FunctionCode, PDU.Address);
+    }
+
+    static bool BitFunction(const ModbusFunction FunctionCode)
+    {
+        return FunctionCode == ModbusFunction::ReadCoils || FunctionCode == ModbusFunction::ReadDiscreteInputs ||
+               FunctionCode == ModbusFunction::WriteSingleCoil || FunctionCode == ModbusFunction::WriteMultipleCoils;
+    }
+
+    // Quantity limits of the Modbus specification, which also keep every response within a frame. Other functions always pass
+    static bool validQuantity(const ModbusFunction FunctionCode, const uint16_t Count)
+    {
+        switch (FunctionCode)
+        {
+        case ModbusFunction::ReadCoils:
+        case ModbusFunction::ReadDiscreteInputs:
+            return Count >= 1 && Count <= 2000;
+        case ModbusFunction::ReadHoldingRegisters:
+        case ModbusFunction::ReadInputRegisters:
+            return Count >= 1 && Count <= 125;
+        case ModbusFunction::WriteMultipleCoils:
+            return Count >= 1 && Count <= 1968;
+        case ModbusFunction::WriteMultipleHoldingRegisters:
+            return Count >= 1 && Count <= 123;
+        default:
+            return true;
+        }
+    }
+
+    // Bytes of data Count values take in a request or response
+    static uint8_t dataByteCount(const ModbusFunction FunctionCode, const uint16_t Count)
+    {
+        return BitFunction(FunctionCode) ? (Count + 7) / 8 : 2 * Count;
+    }
+
+    // Register::Read() and Write() take up to 255 values, bits are moved in byte aligned pieces
+    static const uint16_t BitPiece = 248;
+
+    // Number of the Count addresses from Address that reg covers
+    static uint16_t spanRun(const Register *reg, const uint16_t Address, const uint16_t Count)
+    {
+        const uint32_t left = static_cast<uint32_t>(reg->getLastAddress()) - Address + 1;
+        return Count < left ? Count : left;
+    }
+
+    // Whether Address to Address + Count - 1 is covered by reg and, if spanning is enabled, the blocks following it
+    bool validRange(Register *reg, const ModbusFunction FunctionCode, const uint16_t Address, const uint16_t Count) const
+    {
+        if (reg->AllAddressesInRange(Address, Count))
+        {
+            return true;
+        }
+        if (!spanning)
+        {
+            return false;
+        }
+
+        for (uint16_t done = 0; done < Count;)
+        {
+            if (reg == nullptr)
+            {
+                return false;
+            }
+            const uint16_t run = spanRun(reg, Address + done, Count - done);
+            if (!reg->AllAddressesInRange(Address + done, run))
+            {
+                return false;
+            }
+            done += run;
+            reg = done < Count ? getRegister(FunctionCode, Address + done) : nullptr;
+        }
+        return true;
+    }
+
+    // Reads into ResponseBuffer, assembling the response from consecutive blocks when spanning is enabled. False (with nothing written) if any address isn't served
+    bool readRange(Register *reg, const ModbusFunction FunctionCode, const uint16_t Address, const uint16_t Count, uint8_t *ResponseBuffer) const
+    {
+        if (Count <= UINT8_MAX && reg->AllAddressesInRange(Address, Count))
+        {
+            reg->Read(Address, Count, ResponseBuffer);
+            return true;
+        }
+        if (!validRange(reg, FunctionCode, Address, Count))
+        {
+            return false;
+        }
+
+        const bool bits = BitFunction(FunctionCode);
+        if (bits)
+        {
+            memset(ResponseBuffer, 0, dataByteCount(FunctionCode, Count));
+        }
+        for (uint16_t done = 0; done < Count;)
+        {
+            const uint16_t span = spanRun(reg, Address + done, Count - done);
+            const uint16_t run = span > BitPiece ? BitPiece : span;
+            if (bits)
+            {
+                uint8_t part[32];
+                reg->Read(Address + done, run, part);
+                CopyBits(part, 0, ResponseBuffer, done, run);
+            }
+            else
+            {
+                reg->Read(Address + done, run, ResponseBuffer + 2 * done);
+            }
+            done += run;
+            if (done < Count)
+            {
+                reg = getRegister(FunctionCode, Address + done);
+            }
+        }
+        return true;
+    }
+
+    // Write counterpart of readRange(), nothing is written unless every address is served
+    ModbusError writeRange(Register *reg, const ModbusFunction FunctionCode, const uint16_t Address, const uint16_t Count, uint8_t *dataBuffer)
+    {
+        if (Count <= UINT8_MAX && reg->AllAddressesInRange(Address, Count))
+        {
+            if (!reg->ValidateWrite(Address, Count, dataBuffer))
+            {
+                return ModbusError::IllegalDataValue;
+            }
+            reg->Write(Address, Count, dataBuffer);
+            return ModbusError::NoError;
+        }
+        if (!validRange(reg, FunctionCode, Address, Count))
+        {
+            return ModbusError::IllegalDataAddress;
+        }
+
+        const bool bits = BitFunction(FunctionCode);
+        Register *const first = reg;
+        if (!bits) // Coil blocks have no constraints
+        {
+            for (uint16_t done = 0; done < Count;)
+            {
+                const uint16_t run = spanRun(reg, Address + done, Count - done);
+                if (!reg->ValidateWrite(Address + done, run, dataBuffer + 2 * done))
+                {
+                    return ModbusError::IllegalDataValue;
+                }
+                done += run;
+                if (done < Count)
+                {
+                    reg = getRegister(FunctionCode, Address + done);
+                }
+            }
+            reg = first;
+        }
+
+        for (uint16_t done = 0; done < Count;)
+        {
+            const uint16_t span = spanRun(reg, Address + done, Count - done);
+            const uint16_t run = span > BitPiece ? BitPiece : span;
+            if (bits)
+            {
+                uint8_t part[32] = {0};
+                CopyBits(dataBuffer, done, part, 0, run);
+                reg->Write(Address + done, run, part);
+            }
+            else
+            {
+                reg->Write(Address + done, run, dataBuffer + 2 * done);
+            }
+            done += run;
+            if (done < Count)
+            {
+                reg = getRegister(FunctionCode, Address + done);
+            }
+        }
+        return ModbusError::NoError;
+    }
+
+    // Serves a read request straight into the frame without building a response PDU.
+    // Returns 0, with the frame untouched, for anything that needs the general path (errors, oversized requests)
+    uint8_t readInPlace(Register *reg, uint8_t *ModbusFrame) const
+    {
+        const auto FunctionCode = static_cast<ModbusFunction>(ModbusFrame[0]);
+        const auto Address = CombineBytes(ModbusFrame[1], ModbusFrame[2]);
+        const auto NumberOfRegisters = CombineBytes(ModbusFrame[3], ModbusFrame[4]);
+        if (reg == nullptr || !validQuantity(FunctionCode, NumberOfRegisters))
+        {
+            return 0;
+        }
+
+        const uint8_t ByteCount = dataByteCount(FunctionCode, NumberOfRegisters);
+        if (!readRange(reg, FunctionCode, Address, NumberOfRegisters, ModbusFrame + 2))
+        {
+            return 0;
+        }
+        ModbusFrame[1] = ByteCount;
+        return ByteCount + 2;
+    }
+
+    // FC01-FC04, reg must come from getRegister()
+    uint8_t processRead(Register *reg, uint8_t *ModbusFrame)
+    {
+        if (cache != nullptr)
+        {
+            const auto cached = cache->Fetch(ModbusFrame);
+            if (cached > 0)
+            {
+                return cached;
+            }
+        }
+
+        const ModbusRequestPDU Request = {.FunctionCode = static_cast<ModbusFunction>(ModbusFrame[0]),
+                                          .Address = CombineBytes(ModbusFrame[1], ModbusFrame[2]),
+                                          .NumberOfRegisters = CombineBytes(ModbusFrame[3], ModbusFrame[4]),
+                                          .RegisterValue = 0,
+                                          .DataByteCount = 0,
+                                          .Values = {}};
+        const auto size = readInPlace(reg, ModbusFrame);
+        if (size == 0)
+        {
+            return processGeneral(ModbusFrame);
+        }
+        if (cache != nullptr)
+        {
+            cache->Store(Request, ModbusFrame, size);
+        }
+        return size;
+    }
+
+    uint8_t processGeneral(uint8_t *ModbusFrame)
+    {
+#ifndef __AVR__
+        if (CurrentArena != nullptr)
+        {
+            ArenaScope scope(*CurrentArena); // The PDUs are gone when it ends, their arena space is reused
+            return processTransaction(ModbusFrame);
+        }
+#endif
+        return processTransaction(ModbusFrame);
+    }
+
+    uint8_t processTransaction(uint8_t *ModbusFrame)
+    {
+        const auto Request = ParseRequestPDU(ModbusFrame);
+        const auto Response = this->ProcessRequest(Request);
+        const auto stream = ModbusResponsePDUtoStream(Response, ModbusFrame);
+        if (cache != nullptr && ResponseCache::Cacheable(Request.FunctionCode) && Response.Error == NoError)
+        {
+            cache->Store(Request, ModbusFrame, stream);
+        }
+        return stream;
+    }
+
+    void invalidateCache()
+    {
+        if (cache != nullptr)
+        {
+            cache->Invalidate();
+        }
+    }
+
+    // FC20 and FC21 served in place. Every sub-request is checked before anything is copied, so a bad one leaves the files unchanged
+    uint8_t processFileRecords(uint8_t *ModbusFrame)
+    {
+        const bool write = ModbusFrame[0] == ModbusFunction::WriteFileRecord;
+        const uint8_t byteCount = ModbusFrame[1];
+        if (files == nullptr)
+        {
+            return ModbusResponsePDUtoStream(CreateErroredResponse(ModbusError::IllegalFunction), ModbusFrame);
+        }
+        if (byteCount < 7 || byteCount > 0xF5)
+        {
+            return ModbusResponsePDUtoStream(CreateErroredResponse(ModbusError::IllegalDataValue), ModbusFrame);
+        }
+
+        struct
+        {
+            uint8_t *records;
+            uint8_t *values; // In the request, writes only
+            uint16_t length;
+        } parts[35]; // Most sub-requests that fit a request
+        uint8_t count = 0;
+        size_t responseLength = 2;
+        for (size_t offset = 2; offset < 2 + static_cast<size_t>(byteCount);)
+        {
+            const uint8_t *part = ModbusFrame + offset;
+            const uint16_t length = CombineBytes(part[5], part[6]);
+            const size_t next = offset + 7 + (write ? 2 * static_cast<size_t>(length) : 0);
+            responseLength += write ? 0 : 2 + 2 * static_cast<size_t>(length);
+            if (offset + 7 > 2 + static_cast<size_t>(byteCount) || part[0] != 6 || length == 0 || next > 2 + static_cast<size_t>(byteCount) || responseLength > 253)
+            {
+                return ModbusResponsePDUtoStream(CreateErroredResponse(ModbusError::IllegalDataValue), ModbusFrame);
+            }
+            const uint16_t file = CombineBytes(part[1], part[2]);
+            const uint16_t record = CombineBytes(part[3], part[4]);
+            uint8_t *records = write ? files->WriteRecords(file, record, length) : const_cast<uint8_t *>(files->ReadRecords(file, record, length));
+            if (records == nullptr)
+            {
+                return ModbusResponsePDUtoStream(CreateErroredResponse(ModbusError::IllegalDataAddress), ModbusFrame);
+            }
+            parts[count++] = {records, ModbusFrame + offset + 7, length};
+            offset = next;
+        }
+
+        if (write)
+        {
+            for (uint8_t i = 0; i < count; i++)
+            {
+                memcpy(parts[i].records, parts[i].values, 2 * parts[i].length);
+            }
+            invalidateCache();
+            return 2 + byteCount; // The response echoes the request
+        }
+
+        // The sub-requests have been read, the response can overwrite them
+        ModbusFrame[1] = responseLength - 2;
+        uint8_t *out = ModbusFrame + 2;
+        for (uint8_t i = 0; i < count; i++)
+        {
+            out[0] = 1 + 2 * parts[i].length;
+            out[1] = 6;
+            memcpy(out + 2, parts[i].records, 2 * parts[i].length);
+            out += 2 + 2 * parts[i].length;
+        }
+        return responseLength;
+    }
+
+    bool ValidFunctionCode(const ModbusFunction FunctionCode) const
+    {
+        for (const Register *reg : RegisterList)
+        {
+            if (reg->ValidFunctionCode(FunctionCode))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool ValidAddress(const ModbusFunction FunctionCode, const uint16_t address) const
+    {
+        for (const Register *reg : RegisterList)
+        {
+            if (reg->ValidFunctionCode(FunctionCode) && reg->AddressInRange(address))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    ModbusResponsePDU getErrorCode(const ModbusRequestPDU PDU) const
+    {
+        ModbusResponsePDU response;
+        response.FunctionCode = PDU.FunctionCode;
+
+        if (!ValidFunctionCode(PDU.FunctionCode))
+        {
+            // printf("IllegalFunction error on address: %u, and func code: %u\n", PDU.Address, (uint8_t)PDU.FunctionCode);
+            response.Error = ModbusError::IllegalFunction;
+        }
+        else if (!ValidAddress(PDU.FunctionCode, PDU.Address))
+        {
+            // printf("IllegalDataAddress error on address: %u, and func code: %u\n", PDU.Address, (uint8_t)PDU.FunctionCode);
+            response.Error = ModbusError::IllegalDataAddress;
+        }
+        else
+        {
+            // printf("SlaveDeviceFailure error on address: %u, and func code: %u\n", PDU.Address, (uint8_t)PDU.FunctionCode);
+            response.Error = ModbusError::SlaveDeviceFailure;
+        }
+        return response;
+    }
+
+public:
+    explicit Registers(vector<Register *> RegisterList) : RegisterList{RegisterList} {};
+    ~Registers() {};
+
+    // Lets reads and writes continue into the next block when a request runs past the end of the one holding its start address,
+    // so back to back blocks can be polled with fewer requests
+    void AllowSpanningRequests(const bool allow)
+    {
+        spanning = allow;
+    }
+
+    // Pass nullptr to disable
+    void EnableResponseCache(ResponseCache *responseCache)
+    {
+        cache = responseCache;
+        invalidateCache();
+    }
+
+    // Serves FC20 and FC21 from store, pass nullptr to disable. These are only handled on the stream path (ProcessStream and the Receive*Frame functions)
+    void SetFileStore(FileRecordStore *store)
+    {
+        files = store;
+    }
+
+    // Call once the application has finished updating its values for this scan, so cached responses are rebuilt
+    // and blocks that work per scan (eg. HistoryRegister) run
+    void ScanComplete()
+    {
+        invalidateCache();
+        for (Register *reg : RegisterList)
+        {
+            reg->OnScanComplete();
+        }
+    }
+
+    ModbusResponsePDU ProcessRequest(ModbusRequestPDU PDU)
+    {
+        const bool multiple = PDU.FunctionCode == ModbusFunction::WriteMultipleCoils || PDU.FunctionCode == ModbusFunction::WriteMultipleHoldingRegisters;
+        bool invalid = !validQuantity(PDU.FunctionCode, PDU.NumberOfRegisters) || (multiple && PDU.DataByteCount != dataByteCount(PDU.FunctionCode, PDU.NumberOfRegisters));
+#if defined(__AVR__) || defined(noStdArray)
+        invalid = invalid || (ResponseCache::Cacheable(PDU.FunctionCode) && dataByteCount(PDU.FunctionCode, PDU.NumberOfRegisters) > sizeof(responseBuffer));
+#endif
+        if (invalid && ValidFunctionCode(PDU.FunctionCode))
+        {
+            ModbusResponsePDU response;
+            response.FunctionCode = PDU.FunctionCode;
+            response.Error = ModbusError::IllegalDataValue;
+            return response;
+        }
+
+        Register *reg = getRegister(PDU);
+        if (reg == nullptr)
+        {
+            // printf("No valid register found for address: %u, and func code: %u\n", PDU.Address, (uint8_t)PDU.FunctionCode);
+            return getErrorCode(PDU);
+        }
+
+        ModbusResponsePDU response;
+        response.FunctionCode = PDU.FunctionCode;
+        switch (PDU.FunctionCode)
+        {
+        case ModbusFunction::ReadCoils:
+        case ModbusFunction::ReadDiscreteInputs:
+            if (!validRange(reg, PDU.FunctionCode, PDU.Address, PDU.NumberOfRegisters))
+            {
+                response.Error = ModbusError::IllegalDataAddress;
+                break;
+            }
+            response.DataByteCount = dataByteCount(PDU.FunctionCode, PDU.NumberOfRegisters); // first
+
+#if defined(__AVR__) || defined(noStdArray)
+            response.RegisterValue.setStorage(responseBuffer, response.DataByteCount);
+#else
+            response.RegisterValue.resize(response.DataByteCount);
+#endif
+            // memcpy(response.RegisterValue.data(), reg->getDataLocation(PDU.Address), response.DataByteCount);
+            readRange(reg, PDU.FunctionCode, PDU.Address, PDU.NumberOfRegisters, response.RegisterValue.data());
+            break;
+        case ModbusFunction::ReadHoldingRegisters:
+        case ModbusFunction::ReadInputRegisters:
+            if (!validRange(reg, PDU.FunctionCode, PDU.Address, PDU.NumberOfRegisters))
+            {
+                response.Error = ModbusError::IllegalDataAddress;
+                break;
+            }
+            response.DataByteCount = dataByteCount(PDU.FunctionCode, PDU.NumberOfRegisters);
+#if defined(__AVR__) || defined(noStdArray)
+            response.RegisterValue.setStorage(responseBuffer, response.DataByteCount);
+#else
+            response.RegisterValue.resize(response.DataByteCount);
+#endif
+            // memcpy(response.RegisterValue.data(), reg->getDataLocation(PDU.Address), response.DataByteCount);
+            readRange(reg, PDU.FunctionCode, PDU.Address, PDU.NumberOfRegisters, response.RegisterValue.data());
+            break;
+        case ModbusFunction::WriteSingleCoil:
+        case ModbusFunction::WriteSingleHoldingRegister:
+        {
+            uint16_t value = PDU.RegisterValue;
+            if (!reg->ValidateSingle(PDU.Address, value))
+            {
+                response.Error = ModbusError::IllegalDataValue;
+                break;
+            }
+            reg->WriteSingle(PDU.Address, value);
+            invalidateCache();
+            break;
+        }
+        case ModbusFunction::WriteMultipleCoils:
+        case ModbusFunction::WriteMultipleHoldingRegisters:
+            if (PDU.NumberOfRegisters == 0)
+            {
+                response.Error = ModbusError::IllegalDataValue;
+                break;
+            }
+            response.Error = writeRange(reg, PDU.FunctionCode, PDU.Address, PDU.NumberOfRegisters, PDU.Values.data());
+            if (response.Error != ModbusError::NoError)
+            {
+                break;
+            }
+            invalidateCache();
+            break;
+        case ModbusFunction::ReadFIFOQueue:
+#if defined(__AVR__) || defined(noStdArray)
+            response.RegisterValue.setStorage(responseBuffer, 2 * ModbusFIFOMaxCount);
+#else
+            response.RegisterValue.resize(2 * ModbusFIFOMaxCount);
+#endif
+            response.DataByteCount = 2 * reg->ReadQueue(PDU.Address, response.RegisterValue.data());
+#if !defined(__AVR__) && !defined(noStdArray)
+            response.RegisterValue.resize(response.DataByteCount);
+#endif
+            break;
+        default:
+            // printf("IllegalFunction address: %u, and func code: %u", PDU.Address, (uint8_t)PDU.FunctionCode);
+            response.Error = ModbusError::IllegalFunction;
+        }
+        return response;
+    }
+    uint8_t ProcessStream(uint8_t *ModbusFrame)
+    {
+        const auto FunctionCode = static_cast<ModbusFunction>(ModbusFrame[0]);
+        if (ResponseCache::Cacheable(FunctionCode))
+        {
+            return processRead(getRegister(FunctionCode, CombineBytes(ModbusFrame[1], ModbusFrame[2])), ModbusFrame);
+        }
+        if (FunctionCode == ModbusFunction::ReadFileRecord || FunctionCode == ModbusFunction::WriteFileRecord)
+        {
+            return processFileRecords(ModbusFrame);
+        }
+        return processGeneral(ModbusFrame);
+    }
+
+    // Processes count request PDUs (eg. every datagram one recvmmsg() delivered) in order, writing each response over its request
+    // and its length to ResponseLengths. A convenience loop over ProcessStream()
+    void ProcessStreams(uint8_t *const *ModbusFrames, uint8_t *ResponseLengths, const size_t count)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            ResponseLengths[i] = ProcessStream(ModbusFrames[i]);
+        }
+    }
+};
+
+// Framing used on a stream transport, RTU and ASCII over TCP are common with serial to Ethernet converters
+enum ModbusFraming : uint8_t
+{
+    MBAPFraming,
+    RTUFraming,
+    ASCIIFraming,
+};
+
+const size_t ModbusTCPMaxFrame = 260; // MBAP header + largest PDU
+
+// Total length of the TCP frame starting at buffer as declared by its MBAP header, 0 if the header isn't complete yet.
+// Used to split a stream of pipelined requests, the declared length may exceed what has been received so far
+size_t TCPFrameLength(const uint8_t *buffer, const size_t byteCount)
+{
+    if (byteCount < 7)
+    {
+        return 0;
+    }
+    return 6 + CombineBytes(buffer[4], buffer[5]);
+}
+
+// Pointer based form of ReceiveTCPStream for frames that live in a larger buffer, BufferSize is the space available at ModbusFrame
+// and should be at least ModbusTCPMaxFrame to hold any response
+size_t ReceiveTCPFrame(Registers &registers, uint8_t *ModbusFrame, const size_t BufferSize, const uint16_t byteCount)
+{
+    if (byteCount > BufferSize)
+    {
+        return 0;
+    }
+    CaptureFrame(MBAPFraming, CapturedRequest, ModbusFrame, byteCount);
+
+    const MBAPHead header = MBAPfromBytes(ModbusFrame);
+    if (byteCount <= 7 || header.ProtocolID != 0 || header.Length + 6 > byteCount)
+    {
+        return 0;
+    }
+
+    const auto size = registers.ProcessStream(ModbusFrame + 7);
+    ModbusFrame[4] = 0;
+    ModbusFrame[5] = size + 1;
+    return CaptureFrame(MBAPFraming, CapturedResponse, ModbusFrame, 7 + size);
+}
+
+template <size_t BufferSize>
+size_t ReceiveTCPStream(Registers &registers, array<uint8_t, BufferSize> &ModbusFrame, const uint16_t byteCount)
+{
+    return ReceiveTCPFrame(registers, ModbusFrame.data(), BufferSize, byteCount);
+}
+
+// Answers a TCP request with an exception without processing it, eg SlaveDeviceBusy when the server is overloaded
+size_t RejectTCPFrame(uint8_t *ModbusFrame, const size_t BufferSize, const uint16_t byteCount, const ModbusError Error)
+{
+    if (byteCount > BufferSize)
+    {
+        return 0;
+    }
+    CaptureFrame(MBAPFraming, CapturedRequest, ModbusFrame, byteCount);
+
+    const MBAPHead header = MBAPfromBytes(ModbusFrame);
+    if (byteCount <= 7 || header.ProtocolID != 0 || header.Length + 6 > byteCount)
+    {
+        return 0;
+    }
+
+    const auto size = ModbusResponsePDUtoStream(CreateErroredResponse(Error), ModbusFrame + 7);
+    ModbusFrame[4] = 0;
+    ModbusFrame[5] = size + 1;
+    return CaptureFrame(MBAPFraming, CapturedResponse, ModbusFrame, 7 + size);
+}
+
+template <size_t BufferSize>
+size_t RejectTCPStream(array<uint8_t, BufferSize> &ModbusFrame, const uint16_t byteCount, const ModbusError Error)
+{
+    return RejectTCPFrame(ModbusFrame.data(), BufferSize, byteCount, Error);
+}
+
+// Pointer based form of ReceiveRTUStream, BufferSize is the space available at ModbusFrame for the response
+size_t ReceiveRTUFrame(Registers &registers, uint8_t *ModbusFrame, const size_t BufferSize, const uint16_t byteCount)
+{
+    if (byteCount > BufferSize)
+    {
+        return 0;
+    }
+    CaptureFrame(RTUFraming, CapturedRequest, ModbusFrame, byteCount);
+    if (byteCount < 4 || !CRC16Check(ModbusFrame, byteCount)) // Address, function code and CRC, unknown functions are answered too
+    {
+        return 0;
+    }
+    FastCRC16 CRC16;
+    const auto size = registers.ProcessStream(ModbusFrame + 1) + 1;
+    // ((uint16_t *)(ModbusFrame + size))[0] = CRC16.modbus(ModbusFrame, size);
+    const auto CRC = CRC16.modbus(ModbusFrame, size);
+    memcpy(ModbusFrame + size, &CRC, 2);
+
+    if (ModbusFrame[0] != 0) // Broadcasts are never answered, so there is no response to record
+    {
+        CaptureFrame(RTUFraming, CapturedResponse, ModbusFrame, size + 2);
+    }
+    return size + 2;
+}
+
+template <size_t BufferSize>
+size_t ReceiveRTUStream(Registers &registers, array<uint8_t, BufferSize> &ModbusFrame, const uint8_t byteCount)
+{
+    return ReceiveRTUFrame(registers, ModbusFrame.data(), BufferSize, byteCount);
+}
+
+const size_t ModbusRTUMaxFrame = 256;
+const size_t ModbusASCIIMaxFrame = 513; // ':' + hex of address, PDU and LRC + CRLF
+
+// Length of the RTU request frame starting at buffer, derived from its function code as RTU has no length field.
+// Returns 0 until enough bytes have arrived to tell. Unknown function codes end at the first CRC that checks out, so they
+// can be answered with IllegalFunction; if none does within a maximum frame, 1 is returned to drop a byte and resynchronise.
+// The same is done for a byte count that would make the frame longer than ModbusRTUMaxFrame
+size_t RTURequestLength(const uint8_t *buffer, const size_t byteCount)
+{
+    if (byteCount < 2)
+    {
+        return 0;
+    }
+
+    size_t length;
+    switch (buffer[1])
+    {
+    case ModbusFunction::ReadCoils:
+    case ModbusFunction::ReadDiscreteInputs:
+    case ModbusFunction::ReadHoldingRegisters:
+    case ModbusFunction::ReadInputRegisters:
+    case ModbusFunction::WriteSingleCoil:
+    case ModbusFunction::WriteSingleHoldingRegister:
+        return 8;
+    case ModbusFunction::WriteMultipleCoils:
+    case ModbusFunction::WriteMultipleHoldingRegisters:
+        length = byteCount < 7 ? 0 : 9 + buffer[6];
+        return length > ModbusRTUMaxFrame ? 1 : length;
+    case ModbusFunction::ReadFIFOQueue:
+        return 6;
+    case ModbusFunction::ReadFileRecord:
+    case ModbusFunction::WriteFileRecord:
+        length = byteCount < 3 ? 0 : 5 + buffer[2];
+        return length > ModbusRTUMaxFrame ? 1 : length;
+    default:
+        for (size_t length = 4; length <= byteCount && length < ModbusRTUMaxFrame; length++)
+        {
+            if (CRC16Check(buffer, length))
+            {
+                return length;
+            }
+        }
+        return byteCount >= ModbusRTUMaxFrame - 1 ? 1 : 0;
+    }
+}
+
+// Length of the ASCII frame starting at buffer up to and including its CR LF, 0 if the end hasn't arrived yet
+size_t ASCIIFrameLength(const uint8_t *buffer, const size_t byteCount)
+{
+    for (size_t i = 1; i < byteCount; i++)
+    {
+        if (buffer[i - 1] == '\r' && buffer[i] == '\n')
+        {
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+uint8_t LRC(const uint8_t *data, const size_t byteCount)
+{
+    uint8_t sum = 0;
+    for (size_t i = 0; i < byteCount; i++)
+    {
+        sum += data[i];
+    }
+    return -sum;
+}
+
+// Decodes an ASCII frame (":AAFF...LRC\r\n") in place, processes it and encodes the response over it.
+// BufferSize should be at least ModbusASCIIMaxFrame to hold any response. Like ReceiveRTUStream the address is left for the caller to check
+size_t ReceiveASCIIFrame(Registers &registers, uint8_t *ModbusFrame, const size_t BufferSize, const uint16_t byteCount)
+{
+    if (byteCount > BufferSize)
+    {
+        return 0;
+    }
+    CaptureFrame(ASCIIFraming, CapturedRequest, ModbusFrame, byteCount);
+
+    // ':' + address, function code and LRC as hex + CR LF at least
+    if (byteCount < 9 || ModbusFrame[0] != ':' || ModbusFrame[byteCount - 2] != '\r' || ModbusFrame[byteCount - 1] != '\n' || (byteCount - 3) % 2 != 0)
+    {
+        return 0;
+    }
+
+    uint8_t *binary = ModbusFrame + 1;
+    const size_t binaryCount = (byteCount - 3) / 2;
+    if (!DecodeHex(binary, binary, binaryCount) || LRC(binary, binaryCount) != 0)
+    {
+        return 0;
+    }
+
+    const bool broadcast = binary[0] == 0;
+    const size_t size = registers.ProcessStream(binary + 1) + 1;
+    binary[size] = LRC(binary, size);
+    EncodeHex(binary, binary, size + 1);
+    const size_t length = 1 + 2 * (size + 1);
+    ModbusFrame[length] = '\r';
+    ModbusFrame[length + 1] = '\n';
+    if (!broadcast)
+    {
+        CaptureFrame(ASCIIFraming, CapturedResponse, ModbusFrame, length + 2);
+    }
+    return length + 2;
+}
+
+template <size_t BufferSize>
+size_t ReceiveASCIIStream(Registers &registers, array<uint8_t, BufferSize> &ModbusFrame, const uint16_t byteCount)
+{
+    return ReceiveASCIIFrame(registers, ModbusFrame.data(), BufferSize, byteCount);
+}
+
+size_t MaxFrameLength(const ModbusFraming Framing)
+{
+    return Framing == ASCIIFraming ? ModbusASCIIMaxFrame : Framing == RTUFraming ? ModbusRTUMaxFrame
+                                                                                  : ModbusTCPMaxFrame;
+}
+
+// Length of the first frame in a receive buffer, 0 if it can't be told yet. May exceed byteCount when the rest hasn't arrived
+size_t FrameLength(const ModbusFraming Framing, const uint8_t *buffer, const size_t byteCount)
+{
+    switch (Framing)
+    {
+    case RTUFraming:
+        return RTURequestLength(buffer, byteCount);
+    case ASCIIFraming:
+        if (byteCount > 0 && buffer[0] != ':')
+        {
+            return 1; // Skip noise between frames
+        }
+        return ASCIIFrameLength(buffer, byteCount);
+    default:
+        return TCPFrameLength(buffer, byteCount);
+    }
+}
+
+// Processes one complete frame in place, returns the response length or 0 if there is nothing to send (invalid frame or broadcast)
+size_t ReceiveFrame(const ModbusFraming Framing, Registers &registers, uint8_t *ModbusFrame, const size_t BufferSize, const uint16_t byteCount)
+{
+    switch (Framing)
+    {
+    case RTUFraming:
+        return ReceiveRTUFrame(registers, ModbusFrame, BufferSize, byteCount) * (ModbusFrame[0] != 0);
+    case ASCIIFraming:
+    {
+        const bool broadcast = byteCount > 3 && ModbusFrame[1] == '0' && ModbusFrame[2] == '0';
+        return ReceiveASCIIFrame(registers, ModbusFrame, BufferSize, byteCount) * !broadcast;
+    }
+    default:
+        return ReceiveTCPFrame(registers, ModbusFrame, BufferSize, byteCount);
+    }
+}
+
+// Answers one complete frame with an exception without processing it, eg SlaveDeviceBusy when the server is overloaded
+size_t RejectFrame(const ModbusFraming Framing, uint8_t *ModbusFrame, const size_t BufferSize, const uint16_t byteCount, const ModbusError Error)
+{
+    switch (Framing)
+    {
+    case RTUFraming:
+    {
+        if (byteCount > BufferSize)
+        {
+            return 0;
+        }
+        CaptureFrame(RTUFraming, CapturedRequest, ModbusFrame, byteCount);
+        if (byteCount < 4 || !CRC16Check(ModbusFrame, byteCount) || ModbusFrame[0] == 0)
+        {
+            return 0;
+        }
+        FastCRC16 CRC16;
+        const auto size = ModbusResponsePDUtoStream(CreateErroredResponse(Error), ModbusFrame + 1) + 1;
+        const auto CRC = CRC16.modbus(ModbusFrame, size);
+        memcpy(ModbusFrame + size, &CRC, 2);
+        return CaptureFrame(RTUFraming, CapturedResponse, ModbusFrame, size + 2);
+    }
+    case ASCIIFraming:
+    {
+        if (byteCount > BufferSize)
+        {
+            return 0;
+        }
+        CaptureFrame(ASCIIFraming, CapturedRequest, ModbusFrame, byteCount);
+        uint8_t *binary = ModbusFrame + 1;
+        if (byteCount < 9 || ModbusFrame[0] != ':' || !DecodeHex(binary, binary, 2) || binary[0] == 0)
+        {
+            return 0;
+        }
+        const size_t size = ModbusResponsePDUtoStream(CreateErroredResponse(Error), binary + 1) + 1;
+        binary[size] = LRC(binary, size);
+        EncodeHex(binary, binary, size + 1);
+        const size_t length = 1 + 2 * (size + 1);
+        ModbusFrame[length] = '\r';
+        ModbusFrame[length + 1] = '\n';
+        return CaptureFrame(ASCIIFraming, CapturedResponse, ModbusFrame, length + 2);
+    }
+    default:
+        return RejectTCPFrame(ModbusFrame, BufferSize, byteCount, Error);
     }
-    FastCRC16 CRC16;
-    const auto size = registers.ProcessStream(ModbusFrame.data() + 1) + 1;
-    // ((uint16_t *)(ModbusFrame.data() + size))[0] = CRC16.modbus(ModbusFrame.data(), size);
-    const auto CRC = CRC16.modbus(ModbusFrame.data(), size);
-    memcpy(ModbusFrame.data() + size, &CRC, 2);
-
-    return size + 2;
 }
 
 #endif
\ No newline at end of file
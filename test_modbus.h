@@ -1,5 +1,16 @@
 #include "unity.h"
 #include <registers.h>
+#ifndef __AVR__
+#include <ModbusHotReload.h>
+#include <limits>
+#endif
+#ifdef __linux__
+#include <StdLinuxModbusReplay.h>
+#include <StdLinuxModbusSimulator.h>
+#include <StdLinuxModbusUring.h>
+#include <StdLinuxSharedRegisters.h>
+#include <sys/wait.h>
+#endif
 
 namespace ModbusServer
 {
@@ -312,6 +323,1311 @@ namespace ModbusServer
         TEST_ASSERT_EQUAL(true, LocalValues[2]);
     }
 
+    void test_Server_ResponseCache()
+    {
+        uint16_t LocalValues[3] = {0, 2, 3};
+#ifdef __AVR__
+        ModbusFunction ModbusFunctions[2] = {ModbusFunction::ReadHoldingRegisters, ModbusFunction::WriteSingleHoldingRegister};
+        HoldingRegister LocalHoldingRegister(0, 3, vector<ModbusFunction>(ModbusFunctions, 2), LocalValues, false, false);
+        Register *RegistersArray[1] = {&LocalHoldingRegister};
+        vector<Register *> asVec(RegistersArray, 1);
+        Registers regs(asVec);
+#else
+        HoldingRegister LocalHoldingRegister(0, 3, std::vector<ModbusFunction>{ModbusFunction::ReadHoldingRegisters, ModbusFunction::WriteSingleHoldingRegister}, LocalValues, false, false);
+        Registers regs(std::vector<Register *>{&LocalHoldingRegister});
+#endif
+        CachedResponse entries[4];
+        ResponseCache cache(entries, 4);
+        regs.EnableResponseCache(&cache);
+
+        ModbusRequestPDU reqPDU = {.FunctionCode = ModbusFunction::ReadHoldingRegisters,
+                                   .Address = 1,
+                                   .NumberOfRegisters = 2,
+                                   .RegisterValue = 0,
+                                   .DataByteCount = 0,
+                                   .Values = {}};
+
+        uint8_t buffer[256] = {0};
+        getRequestBytes(reqPDU, buffer);
+        TEST_ASSERT_EQUAL(6, regs.ProcessStream(buffer));
+        TEST_ASSERT_EQUAL(2, reinterpret_cast<uint16_t *>(buffer + 2)[0]);
+
+        LocalValues[1] = 5; // Not visible until the scan completes
+        getRequestBytes(reqPDU, buffer);
+        TEST_ASSERT_EQUAL(6, regs.ProcessStream(buffer));
+        TEST_ASSERT_EQUAL(2, reinterpret_cast<uint16_t *>(buffer + 2)[0]);
+
+        regs.ScanComplete();
+        getRequestBytes(reqPDU, buffer);
+        TEST_ASSERT_EQUAL(6, regs.ProcessStream(buffer));
+        TEST_ASSERT_EQUAL(5, reinterpret_cast<uint16_t *>(buffer + 2)[0]);
+
+        ModbusRequestPDU writePDU = {.FunctionCode = ModbusFunction::WriteSingleHoldingRegister,
+                                     .Address = 2,
+                                     .NumberOfRegisters = 1,
+                                     .RegisterValue = 7,
+                                     .DataByteCount = 0,
+                                     .Values = {}};
+        getRequestBytes(writePDU, buffer);
+        TEST_ASSERT_EQUAL(5, regs.ProcessStream(buffer));
+
+        getRequestBytes(reqPDU, buffer);
+        TEST_ASSERT_EQUAL(6, regs.ProcessStream(buffer));
+        TEST_ASSERT_TRUE(LocalValues[2] != 3);
+        TEST_ASSERT_EQUAL(LocalValues[2], reinterpret_cast<uint16_t *>(buffer + 2)[1]);
+    }
+
+    void test_RejectTCPStream()
+    {
+        array<uint8_t, 256> frame = {0};
+        const MBAPHead header = {.TransactionID = 9, .ProtocolID = 0, .Length = 6, .UnitID = 1};
+        getMBAPBytes(header, frame.data());
+        ModbusRequestPDU reqPDU = {.FunctionCode = ModbusFunction::ReadHoldingRegisters,
+                                   .Address = 1,
+                                   .NumberOfRegisters = 2,
+                                   .RegisterValue = 0,
+                                   .DataByteCount = 0,
+                                   .Values = {}};
+        getRequestBytes(reqPDU, frame.data() + 7);
+
+        TEST_ASSERT_EQUAL(9, RejectTCPStream(frame, 12, ModbusError::SlaveDeviceBusy));
+        TEST_ASSERT_EQUAL(9, frame[1]);
+        TEST_ASSERT_EQUAL(3, frame[5]);
+        TEST_ASSERT_EQUAL(ModbusFunction::ReadHoldingRegisters | 0b10000000, frame[7]);
+        TEST_ASSERT_EQUAL(ModbusError::SlaveDeviceBusy, frame[8]);
+    }
+
+    void test_ReceiveTCPPipelined()
+    {
+        uint16_t LocalValues[3] = {4, 5, 6};
+#ifdef __AVR__
+        ModbusFunction ModbusFunctions[1] = {ModbusFunction::ReadHoldingRegisters};
+        HoldingRegister LocalHoldingRegister(0, 2, vector<ModbusFunction>(ModbusFunctions, 1), LocalValues);
+        Register *RegistersArray[1] = {&LocalHoldingRegister};
+        vector<Register *> asVec(RegistersArray, 1);
+        Registers regs(asVec);
+#else
+        HoldingRegister LocalHoldingRegister(0, 2, std::vector<ModbusFunction>{ModbusFunction::ReadHoldingRegisters}, LocalValues, true, true);
+        Registers regs(std::vector<Register *>{&LocalHoldingRegister});
+#endif
+
+        // Three requests back to back, the last cut short as a stream read can leave it
+        uint8_t stream[36] = {0};
+        for (uint8_t i = 0; i < 3; i++)
+        {
+            const MBAPHead header = {.TransactionID = static_cast<uint16_t>(i + 1), .ProtocolID = 0, .Length = 6, .UnitID = 1};
+            getMBAPBytes(header, stream + 12 * i);
+            const uint8_t pdu[5] = {ModbusFunction::ReadHoldingRegisters, 0, i, 0, 1};
+            memcpy(stream + 12 * i + 7, pdu, sizeof(pdu));
+        }
+        const size_t received = 32;
+
+        TEST_ASSERT_EQUAL(0, TCPFrameLength(stream, 6));
+        size_t offset = 0;
+        for (uint8_t i = 0; i < 2; i++)
+        {
+            const size_t length = TCPFrameLength(stream + offset, received - offset);
+            TEST_ASSERT_EQUAL(12, length);
+            uint8_t frame[ModbusTCPMaxFrame];
+            memcpy(frame, stream + offset, length);
+            TEST_ASSERT_EQUAL(11, ReceiveTCPFrame(regs, frame, sizeof(frame), length));
+            TEST_ASSERT_EQUAL(i + 1, frame[1]);
+            TEST_ASSERT_EQUAL(LocalValues[i], CombineBytes(frame[9], frame[10]));
+            offset += length;
+        }
+        TEST_ASSERT_EQUAL(12, TCPFrameLength(stream + offset, received - offset)); // Declared, not all received yet
+        uint8_t partial[ModbusTCPMaxFrame];
+        memcpy(partial, stream + offset, received - offset);
+        TEST_ASSERT_EQUAL(0, ReceiveTCPFrame(regs, partial, sizeof(partial), received - offset));
+    }
+
+    void test_Server_ProcessStreams()
+    {
+        uint16_t LocalValues[3] = {0, 2, 3};
+        bool LocalCoils[3] = {true, false, true};
+#ifdef __AVR__
+        ModbusFunction HoldingFunctions[2] = {ModbusFunction::ReadHoldingRegisters, ModbusFunction::WriteSingleHoldingRegister};
+        HoldingRegister LocalHoldingRegister(0, 3, vector<ModbusFunction>(HoldingFunctions, 2), LocalValues, false, false);
+        ModbusFunction CoilFunctions[1] = {ModbusFunction::ReadCoils};
+        CoilRegister Coils(100, 103, vector<ModbusFunction>(CoilFunctions, 1), reinterpret_cast<uint8_t *>(LocalCoils));
+        Register *RegistersArray[2] = {&LocalHoldingRegister, &Coils};
+        vector<Register *> asVec(RegistersArray, 2);
+        Registers regs(asVec);
+#else
+        HoldingRegister LocalHoldingRegister(0, 3, std::vector<ModbusFunction>{ModbusFunction::ReadHoldingRegisters, ModbusFunction::WriteSingleHoldingRegister}, LocalValues, false, false);
+        CoilRegister Coils(100, 103, std::vector<ModbusFunction>{ModbusFunction::ReadCoils}, reinterpret_cast<uint8_t *>(LocalCoils));
+        Registers regs(std::vector<Register *>{&LocalHoldingRegister, &Coils});
+#endif
+        ModbusRequestPDU readPDU = {.FunctionCode = ModbusFunction::ReadHoldingRegisters,
+                                    .Address = 1,
+                                    .NumberOfRegisters = 2,
+                                    .RegisterValue = 0,
+                                    .DataByteCount = 0,
+                                    .Values = {}};
+        ModbusRequestPDU coilPDU = {.FunctionCode = ModbusFunction::ReadCoils,
+                                    .Address = 100,
+                                    .NumberOfRegisters = 3,
+                                    .RegisterValue = 0,
+                                    .DataByteCount = 0,
+                                    .Values = {}};
+        ModbusRequestPDU writePDU = {.FunctionCode = ModbusFunction::WriteSingleHoldingRegister,
+                                     .Address = 1,
+                                     .NumberOfRegisters = 1,
+                                     .RegisterValue = 0,
+                                     .DataByteCount = 0,
+                                     .Values = {}};
+        ModbusRequestPDU badPDU = readPDU;
+        badPDU.Address = 50;
+
+        uint8_t buffers[5][256] = {{0}};
+        getRequestBytes(readPDU, buffers[0]);
+        getRequestBytes(coilPDU, buffers[1]);
+        getRequestBytes(badPDU, buffers[2]);
+        getRequestBytes(writePDU, buffers[3]);
+        getRequestBytes(readPDU, buffers[4]);
+        uint8_t *frames[5] = {buffers[0], buffers[1], buffers[2], buffers[3], buffers[4]};
+        uint8_t lengths[5] = {0};
+        regs.ProcessStreams(frames, lengths, 5);
+
+        TEST_ASSERT_EQUAL(6, lengths[0]);
+        TEST_ASSERT_EQUAL(2, reinterpret_cast<uint16_t *>(buffers[0] + 2)[0]);
+        TEST_ASSERT_EQUAL(3, lengths[1]);
+        TEST_ASSERT_EQUAL(0b101, buffers[1][2] & 0b111);
+        TEST_ASSERT_EQUAL(2, lengths[2]);
+        TEST_ASSERT_EQUAL(ModbusError::IllegalDataAddress, buffers[2][1]);
+        TEST_ASSERT_EQUAL(5, lengths[3]);
+        TEST_ASSERT_EQUAL(6, lengths[4]);
+        TEST_ASSERT_EQUAL(0, reinterpret_cast<uint16_t *>(buffers[4] + 2)[0]); // Sees the write before it
+    }
+
+    void test_ReceiveASCIIStream()
+    {
+        uint16_t LocalValues[3] = {0, 2, 3};
+#ifdef __AVR__
+        ModbusFunction ModbusFunctions[1] = {ModbusFunction::ReadHoldingRegisters};
+        HoldingRegister LocalHoldingRegister(0, 3, vector<ModbusFunction>(ModbusFunctions, 1), LocalValues);
+        Register *RegistersArray[1] = {&LocalHoldingRegister};
+        vector<Register *> asVec(RegistersArray, 1);
+        Registers regs(asVec);
+#else
+        HoldingRegister LocalHoldingRegister(0, 3, std::vector<ModbusFunction>{ModbusFunction::ReadHoldingRegisters}, LocalValues);
+        Registers regs(std::vector<Register *>{&LocalHoldingRegister});
+#endif
+        ModbusRequestPDU reqPDU = {.FunctionCode = ModbusFunction::ReadHoldingRegisters,
+                                   .Address = 1,
+                                   .NumberOfRegisters = 2,
+                                   .RegisterValue = 0,
+                                   .DataByteCount = 0,
+                                   .Values = {}};
+
+        uint8_t binary[8] = {1};
+        getRequestBytes(reqPDU, binary + 1);
+        binary[6] = LRC(binary, 6);
+
+        array<uint8_t, ModbusASCIIMaxFrame> frame = {0};
+        frame[0] = ':';
+        EncodeHex(binary, frame.data() + 1, 7);
+        frame[15] = '\r';
+        frame[16] = '\n';
+        TEST_ASSERT_EQUAL(17, FrameLength(ASCIIFraming, frame.data(), 20));
+
+        // ":01" "03" "04" "0002" "0003" LRC CR LF
+        TEST_ASSERT_EQUAL(19, ReceiveASCIIStream(regs, frame, 17));
+        TEST_ASSERT_EQUAL(':', frame[0]);
+        TEST_ASSERT_EQUAL(0, memcmp(frame.data() + 1, "01030400020003F3", 16));
+        TEST_ASSERT_TRUE(DecodeHex(frame.data() + 1, binary, 8));
+        TEST_ASSERT_EQUAL(0, LRC(binary, 8));
+        TEST_ASSERT_EQUAL('\n', frame[18]);
+    }
+
+    void test_RTURequestLength()
+    {
+        uint8_t read[8] = {1, ModbusFunction::ReadHoldingRegisters, 0, 1, 0, 2};
+        TEST_ASSERT_EQUAL(0, RTURequestLength(read, 1));
+        TEST_ASSERT_EQUAL(8, RTURequestLength(read, 2));
+        uint8_t write[13] = {1, ModbusFunction::WriteMultipleHoldingRegisters, 0, 1, 0, 2, 4};
+        TEST_ASSERT_EQUAL(0, RTURequestLength(write, 6));
+        TEST_ASSERT_EQUAL(13, RTURequestLength(write, 7));
+        uint8_t fifo[6] = {1, ModbusFunction::ReadFIFOQueue, 0, 1};
+        TEST_ASSERT_EQUAL(6, RTURequestLength(fifo, 2));
+    }
+
+    void test_Server_FileRecords()
+    {
+        uint16_t LocalValues[1] = {0};
+        uint8_t Waveform[20] = {0};
+        uint8_t Log[4] = {0xAB, 0xCD, 0x12, 0x34};
+        RecordFile Files[2] = {{Waveform, 10, true}, {Log, 2, false}};
+        MemoryFileStore store(Files, 2);
+#ifdef __AVR__
+        ModbusFunction HoldingFunctions[1] = {ModbusFunction::ReadHoldingRegisters};
+        HoldingRegister TestRegister(0, 0, vector<ModbusFunction>(HoldingFunctions, 1), LocalValues);
+        Register *RegistersArray[1] = {&TestRegister};
+        vector<Register *> asVec(RegistersArray, 1);
+        Registers regs(asVec);
+#else
+        HoldingRegister TestRegister(0, 0, std::vector<ModbusFunction>{ModbusFunction::ReadHoldingRegisters}, LocalValues);
+        Registers regs(std::vector<Register *>{&TestRegister});
+#endif
+        uint8_t buffer[256] = {ModbusFunction::ReadFileRecord, 7, 6, 0, 1, 0, 0, 0, 1};
+        TEST_ASSERT_EQUAL(2, regs.ProcessStream(buffer)); // No store yet
+        TEST_ASSERT_EQUAL(ModbusError::IllegalFunction, buffer[1]);
+        regs.SetFileStore(&store);
+
+        // Two sub-requests, records 2-3 of file 1 and record 1 of file 2 (read only)
+        const uint8_t write[23] = {ModbusFunction::WriteFileRecord, 21, 6, 0, 1, 0, 2, 0, 2, 0x11, 0x22, 0x33, 0x44, 6, 0, 2, 0, 1, 0, 1, 0x55, 0x66};
+        memcpy(buffer, write, sizeof(write));
+        TEST_ASSERT_EQUAL(2, regs.ProcessStream(buffer));
+        TEST_ASSERT_EQUAL(ModbusError::IllegalDataAddress, buffer[1]);
+        TEST_ASSERT_EQUAL(0, Waveform[4]); // Nothing written
+        memcpy(buffer, write, 13);
+        buffer[1] = 11;
+        TEST_ASSERT_EQUAL(13, regs.ProcessStream(buffer));
+        TEST_ASSERT_EQUAL(0x11, Waveform[4]);
+        TEST_ASSERT_EQUAL(0x44, Waveform[7]);
+
+        const uint8_t read[16] = {ModbusFunction::ReadFileRecord, 14, 6, 0, 1, 0, 3, 0, 1, 6, 0, 2, 0, 0, 0, 2};
+        ModbusRequestPDU readPDU = {.FunctionCode = ModbusFunction::ReadFileRecord,
+                                    .Address = 0,
+                                    .NumberOfRegisters = 0,
+                                    .RegisterValue = 0,
+                                    .DataByteCount = 14,
+                                    .Values = {}};
+#ifdef __AVR__
+        readPDU.Values.setStorage(dataBuffer, readPDU.DataByteCount);
+#else
+        readPDU.Values.resize(readPDU.DataByteCount);
+#endif
+        memcpy(readPDU.Values.data(), read + 2, readPDU.DataByteCount);
+        TEST_ASSERT_EQUAL(sizeof(read), getRequestByteLength(readPDU));
+        getRequestBytes(readPDU, buffer);
+        TEST_ASSERT_EQUAL(0, memcmp(buffer, read, sizeof(read)));
+        TEST_ASSERT_EQUAL(2 + 4 + 6, regs.ProcessStream(buffer));
+        TEST_ASSERT_EQUAL(10, buffer[1]);
+        TEST_ASSERT_EQUAL(3, buffer[2]);
+        TEST_ASSERT_EQUAL(6, buffer[3]);
+        TEST_ASSERT_EQUAL(0x33, buffer[4]);
+        TEST_ASSERT_EQUAL(5, buffer[6]);
+        TEST_ASSERT_EQUAL(0xAB, buffer[8]);
+        TEST_ASSERT_EQUAL(0x34, buffer[11]);
+
+        memcpy(buffer, read, sizeof(read));
+        buffer[15] = 3; // Past the end of file 2
+        TEST_ASSERT_EQUAL(2, regs.ProcessStream(buffer));
+        TEST_ASSERT_EQUAL(ModbusError::IllegalDataAddress, buffer[1]);
+        memcpy(buffer, read, sizeof(read));
+        buffer[2] = 5; // Reference type must be 6
+        TEST_ASSERT_EQUAL(2, regs.ProcessStream(buffer));
+        TEST_ASSERT_EQUAL(ModbusError::IllegalDataValue, buffer[1]);
+
+        uint8_t rtu[4] = {1, ModbusFunction::ReadFileRecord, 14};
+        TEST_ASSERT_EQUAL(19, RTURequestLength(rtu, 3));
+    }
+
+    uint32_t historyClock() { return 0x12345; }
+
+    void test_Server_HistoryRegister()
+    {
+        uint16_t LocalValues[3] = {0, 0, 0};
+        const uint16_t Sampled[2] = {0, 2};
+        uint16_t Samples[2 * 4];
+        uint32_t Timestamps[4];
+#ifdef __AVR__
+        ModbusFunction HoldingFunctions[1] = {ModbusFunction::ReadHoldingRegisters};
+        HoldingRegister Source(0, 2, vector<ModbusFunction>(HoldingFunctions, 1), LocalValues);
+        HistoryRegister History(100, vector<ModbusFunction>(HoldingFunctions, 1), Source, Sampled, 2, Samples, Timestamps, 4, historyClock);
+        Register *RegistersArray[2] = {&Source, &History};
+        vector<Register *> asVec(RegistersArray, 2);
+        Registers regs(asVec);
+#else
+        HoldingRegister Source(0, 2, std::vector<ModbusFunction>{ModbusFunction::ReadHoldingRegisters}, LocalValues);
+        HistoryRegister History(100, std::vector<ModbusFunction>{ModbusFunction::ReadHoldingRegisters}, Source, Sampled, 2, Samples, Timestamps, 4, historyClock);
+        Registers regs(std::vector<Register *>{&Source, &History});
+#endif
+        TEST_ASSERT_EQUAL(100 + 4 + 2 * 4 + 2 * 4 - 1, History.getLastAddress());
+        for (uint16_t scan = 1; scan <= 6; scan++)
+        {
+            LocalValues[0] = scan;
+            LocalValues[2] = 100 + scan;
+            regs.ScanComplete();
+        }
+        TEST_ASSERT_EQUAL(6, History.Taken());
+
+        // Header and the channel 1 row, newest first
+        uint8_t buffer[256] = {ModbusFunction::ReadHoldingRegisters, 0, 100, 0, 12};
+        TEST_ASSERT_EQUAL(2 + 2 * 12, regs.ProcessStream(buffer));
+        TEST_ASSERT_EQUAL(6, CombineBytes(buffer[4], buffer[5]));
+        TEST_ASSERT_EQUAL(4, CombineBytes(buffer[6], buffer[7]));
+        TEST_ASSERT_EQUAL(2, CombineBytes(buffer[8], buffer[9]));
+        TEST_ASSERT_EQUAL(6, CombineBytes(buffer[10], buffer[11]));
+        TEST_ASSERT_EQUAL(3, CombineBytes(buffer[16], buffer[17]));
+        TEST_ASSERT_EQUAL(106, CombineBytes(buffer[18], buffer[19]));
+        TEST_ASSERT_EQUAL(103, CombineBytes(buffer[24], buffer[25]));
+
+        // Timestamps of the two newest samples
+        uint8_t times[256] = {ModbusFunction::ReadHoldingRegisters, 0, 112, 0, 4};
+        TEST_ASSERT_EQUAL(10, regs.ProcessStream(times));
+        TEST_ASSERT_EQUAL(0x1, CombineBytes(times[2], times[3]));
+        TEST_ASSERT_EQUAL(0x2345, CombineBytes(times[4], times[5]));
+
+        History.SampleEvery = 2;
+        regs.ScanComplete();
+        TEST_ASSERT_EQUAL(6, History.Taken());
+        regs.ScanComplete();
+        TEST_ASSERT_EQUAL(7, History.Taken());
+
+        // Depth is cut to what fits below address 0xFFFF rather than wrapping the address range. Never sampled
+#ifdef __AVR__
+        HistoryRegister Tail(0xFF00, vector<ModbusFunction>(HoldingFunctions, 1), Source, Sampled, 2, Samples, Timestamps, 4000, historyClock);
+#else
+        HistoryRegister Tail(0xFF00, std::vector<ModbusFunction>{ModbusFunction::ReadHoldingRegisters}, Source, Sampled, 2, Samples, Timestamps, 4000, historyClock);
+#endif
+        TEST_ASSERT_EQUAL(0xFF00 + 3 + 4 * 63, Tail.getLastAddress());
+    }
+
+    uint16_t computeSquare(const uint16_t Address, void *Context)
+    {
+        (*static_cast<uint16_t *>(Context))++;
+        return Address * Address;
+    }
+
+    void test_Server_ComputedRegister()
+    {
+        uint16_t Computations = 0;
+        ComputedValue Values[10];
+#ifdef __AVR__
+        ModbusFunction InputFunctions[1] = {ModbusFunction::ReadInputRegisters};
+        ComputedRegister Squares(10, 19, vector<ModbusFunction>(InputFunctions, 1), computeSquare, &Computations, Values);
+        Register *RegistersArray[1] = {&Squares};
+        vector<Register *> asVec(RegistersArray, 1);
+        Registers regs(asVec);
+#else
+        ComputedRegister Squares(10, 19, std::vector<ModbusFunction>{ModbusFunction::ReadInputRegisters}, computeSquare, &Computations, Values);
+        Registers regs(std::vector<Register *>{&Squares});
+#endif
+        regs.ScanComplete();
+        TEST_ASSERT_EQUAL(0, Computations); // Nothing is computed until read
+
+        uint8_t buffer[256] = {ModbusFunction::ReadInputRegisters, 0, 12, 0, 3};
+        TEST_ASSERT_EQUAL(8, regs.ProcessStream(buffer));
+        TEST_ASSERT_EQUAL(144, CombineBytes(buffer[2], buffer[3]));
+        TEST_ASSERT_EQUAL(196, CombineBytes(buffer[6], buffer[7]));
+        TEST_ASSERT_EQUAL(3, Computations);
+
+        const uint8_t request[5] = {ModbusFunction::ReadInputRegisters, 0, 11, 0, 3};
+        memcpy(buffer, request, sizeof(request));
+        TEST_ASSERT_EQUAL(8, regs.ProcessStream(buffer));
+        TEST_ASSERT_EQUAL(4, Computations); // Only address 11 was new this scan
+
+        regs.ScanComplete();
+        memcpy(buffer, request, sizeof(request));
+        regs.ProcessStream(buffer);
+        TEST_ASSERT_EQUAL(7, Computations);
+        TEST_ASSERT_EQUAL(121, CombineBytes(buffer[2], buffer[3]));
+    }
+
+    void test_Server_ScaledRegister()
+    {
+        float Values[3] = {12.34f, -5.0f, 20000.0f};
+        const float Gain[3] = {0.5f, 0.5f, 0.5f};
+        const float Offset[3] = {0, 0, 0};
+        const ScaleTable Scale = {.Gain = Gain, .Offset = Offset, .Min = nullptr, .Max = nullptr};
+#ifdef __AVR__
+        ModbusFunction HoldingFunctions[2] = {ModbusFunction::ReadHoldingRegisters, ModbusFunction::WriteMultipleHoldingRegisters};
+        ScaledRegister Scaled(0, 2, vector<ModbusFunction>(HoldingFunctions, 2), Values, Scale, true);
+        Register *RegistersArray[1] = {&Scaled};
+        vector<Register *> asVec(RegistersArray, 1);
+        Registers regs(asVec);
+#else
+        ScaledRegister Scaled(0, 2, std::vector<ModbusFunction>{ModbusFunction::ReadHoldingRegisters, ModbusFunction::WriteMultipleHoldingRegisters}, Values, Scale, true);
+        Registers regs(std::vector<Register *>{&Scaled});
+#endif
+        uint8_t buffer[256] = {ModbusFunction::ReadHoldingRegisters, 0, 0, 0, 3};
+        TEST_ASSERT_EQUAL(8, regs.ProcessStream(buffer));
+        TEST_ASSERT_EQUAL(25, CombineBytes(buffer[2], buffer[3]));
+        TEST_ASSERT_EQUAL(-10, static_cast<int16_t>(CombineBytes(buffer[4], buffer[5])));
+        TEST_ASSERT_EQUAL(32767, CombineBytes(buffer[6], buffer[7])); // 40000 counts clamped
+
+        const uint8_t write[12] = {ModbusFunction::WriteMultipleHoldingRegisters, 0, 1, 0, 2, 4, 0xFF, 0x38, 0x01, 0xF4};
+        memcpy(buffer, write, sizeof(write));
+        TEST_ASSERT_EQUAL(5, regs.ProcessStream(buffer));
+        TEST_ASSERT_EQUAL(-100.0f, Values[1]);
+        TEST_ASSERT_EQUAL(250.0f, Values[2]);
+    }
+
+    void test_Server_SparseHoldingRegister()
+    {
+        static uint16_t Pages[2][256];
+#ifdef __AVR__
+        ModbusFunction ModbusFunctions[2] = {ModbusFunction::ReadHoldingRegisters, ModbusFunction::WriteMultipleHoldingRegisters};
+        SparseHoldingRegister Sparse(vector<ModbusFunction>(ModbusFunctions, 2), Pages, 2, false, false);
+        Register *RegistersArray[1] = {&Sparse};
+        vector<Register *> asVec(RegistersArray, 1);
+        Registers regs(asVec);
+#else
+        SparseHoldingRegister Sparse(std::vector<ModbusFunction>{ModbusFunction::ReadHoldingRegisters, ModbusFunction::WriteMultipleHoldingRegisters}, Pages, 2, false, false);
+        Registers regs(std::vector<Register *>{&Sparse});
+#endif
+        TEST_ASSERT_TRUE(Sparse.Map(0x10F0, 0x1110));
+        TEST_ASSERT_TRUE(Sparse.Locate(0x9000) == nullptr); // Pool exhausted
+        *Sparse.Locate(0x10FF) = 2;
+        *Sparse.Locate(0x1100) = 3;
+
+        ModbusRequestPDU reqPDU = {.FunctionCode = ModbusFunction::ReadHoldingRegisters,
+                                   .Address = 0x10FF,
+                                   .NumberOfRegisters = 2,
+                                   .RegisterValue = 0,
+                                   .DataByteCount = 0,
+                                   .Values = {}};
+        const ModbusResponsePDU response = regs.ProcessRequest(reqPDU);
+        const uint16_t *valuesAsInt = reinterpret_cast<const uint16_t *>(response.RegisterValue.data());
+        TEST_ASSERT_EQUAL(ModbusError::NoError, response.Error);
+        TEST_ASSERT_EQUAL(2, valuesAsInt[0]);
+        TEST_ASSERT_EQUAL(3, valuesAsInt[1]);
+
+        reqPDU.Address = 0x11FF;
+        TEST_ASSERT_EQUAL(ModbusError::IllegalDataAddress, regs.ProcessRequest(reqPDU).Error);
+        reqPDU.Address = 0x2000;
+        TEST_ASSERT_EQUAL(ModbusError::IllegalDataAddress, regs.ProcessRequest(reqPDU).Error);
+    }
+
+    void test_Server_SpanningRequests()
+    {
+        uint16_t Integers[4] = {0, 1, 2, 3};
+        uint16_t Doubles[4] = {4, 5, 6, 7};
+        bool CoilsA[4] = {false, false, true, false};
+        bool CoilsB[8] = {true, true, false, false, false, false, false, false};
+#ifdef __AVR__
+        ModbusFunction HoldingFunctions[2] = {ModbusFunction::ReadHoldingRegisters, ModbusFunction::WriteMultipleHoldingRegisters};
+        HoldingRegister IntegerRegister(0, 3, vector<ModbusFunction>(HoldingFunctions, 2), Integers, false, false);
+        HoldingRegister DoubleRegister(4, 7, vector<ModbusFunction>(HoldingFunctions, 2), Doubles, false, false);
+        ModbusFunction CoilFunctions[1] = {ModbusFunction::ReadCoils};
+        CoilRegister CoilRegisterA(100, 103, vector<ModbusFunction>(CoilFunctions, 1), reinterpret_cast<uint8_t *>(CoilsA));
+        CoilRegister CoilRegisterB(104, 111, vector<ModbusFunction>(CoilFunctions, 1), reinterpret_cast<uint8_t *>(CoilsB));
+        Register *RegistersArray[4] = {&IntegerRegister, &DoubleRegister, &CoilRegisterA, &CoilRegisterB};
+        vector<Register *> asVec(RegistersArray, 4);
+        Registers regs(asVec);
+#else
+        HoldingRegister IntegerRegister(0, 3, std::vector<ModbusFunction>{ModbusFunction::ReadHoldingRegisters, ModbusFunction::WriteMultipleHoldingRegisters}, Integers, false, false);
+        HoldingRegister DoubleRegister(4, 7, std::vector<ModbusFunction>{ModbusFunction::ReadHoldingRegisters, ModbusFunction::WriteMultipleHoldingRegisters}, Doubles, false, false);
+        CoilRegister CoilRegisterA(100, 103, std::vector<ModbusFunction>{ModbusFunction::ReadCoils}, reinterpret_cast<uint8_t *>(CoilsA));
+        CoilRegister CoilRegisterB(104, 111, std::vector<ModbusFunction>{ModbusFunction::ReadCoils}, reinterpret_cast<uint8_t *>(CoilsB));
+        Registers regs(std::vector<Register *>{&IntegerRegister, &DoubleRegister, &CoilRegisterA, &CoilRegisterB});
+#endif
+        ModbusRequestPDU reqPDU = {.FunctionCode = ModbusFunction::ReadHoldingRegisters,
+                                   .Address = 2,
+                                   .NumberOfRegisters = 4,
+                                   .RegisterValue = 0,
+                                   .DataByteCount = 0,
+                                   .Values = {}};
+        uint8_t buffer[256] = {0};
+        getRequestBytes(reqPDU, buffer);
+        TEST_ASSERT_EQUAL(2, regs.ProcessStream(buffer));
+        TEST_ASSERT_EQUAL(ModbusError::IllegalDataAddress, buffer[1]);
+
+        regs.AllowSpanningRequests(true);
+        getRequestBytes(reqPDU, buffer);
+        TEST_ASSERT_EQUAL(10, regs.ProcessStream(buffer));
+        const uint16_t *valuesAsInt = reinterpret_cast<const uint16_t *>(buffer + 2);
+        TEST_ASSERT_EQUAL(2, valuesAsInt[0]);
+        TEST_ASSERT_EQUAL(3, valuesAsInt[1]);
+        TEST_ASSERT_EQUAL(4, valuesAsInt[2]);
+        TEST_ASSERT_EQUAL(5, valuesAsInt[3]);
+
+        uint16_t RequestValues[3] = {10, 11, 12};
+        ModbusRequestPDU writePDU = {.FunctionCode = ModbusFunction::WriteMultipleHoldingRegisters,
+                                     .Address = 3,
+                                     .NumberOfRegisters = 3,
+                                     .RegisterValue = 0,
+                                     .DataByteCount = 6,
+                                     .Values = {}};
+#ifdef __AVR__
+        writePDU.Values.setStorage(dataBuffer, writePDU.DataByteCount);
+#else
+        writePDU.Values.resize(writePDU.DataByteCount);
+#endif
+        memcpy(writePDU.Values.data(), RequestValues, writePDU.DataByteCount);
+        TEST_ASSERT_EQUAL(ModbusError::NoError, regs.ProcessRequest(writePDU).Error);
+        TEST_ASSERT_EQUAL(10, Integers[3]);
+        TEST_ASSERT_EQUAL(11, Doubles[0]);
+        TEST_ASSERT_EQUAL(12, Doubles[1]);
+
+        writePDU.Address = 6; // Runs off the end of the map, nothing may be written
+        TEST_ASSERT_EQUAL(ModbusError::IllegalDataAddress, regs.ProcessRequest(writePDU).Error);
+        TEST_ASSERT_EQUAL(6, Doubles[2]);
+
+        ModbusRequestPDU coilPDU = {.FunctionCode = ModbusFunction::ReadCoils,
+                                    .Address = 102,
+                                    .NumberOfRegisters = 4,
+                                    .RegisterValue = 0,
+                                    .DataByteCount = 0,
+                                    .Values = {}};
+        getRequestBytes(coilPDU, buffer);
+        TEST_ASSERT_EQUAL(3, regs.ProcessStream(buffer));
+        TEST_ASSERT_EQUAL(0b1101, buffer[2]);
+    }
+
+#ifndef __AVR__
+    void test_Server_TransactionArena()
+    {
+        uint16_t LocalValues[4] = {0, 1, 2, 3};
+        HoldingRegister TestRegister(0, 3, std::vector<ModbusFunction>{ModbusFunction::ReadHoldingRegisters, ModbusFunction::WriteMultipleHoldingRegisters}, LocalValues, false, false);
+        Registers regs(std::vector<Register *>{&TestRegister});
+
+        uint16_t RequestValues[2] = {8, 9};
+        uint8_t buffer[256] = {0};
+        FixedArena<ModbusArenaSize> arena;
+        const AllocationStats before = ModbusAllocationStats;
+        {
+            ArenaScope scope(arena);
+            ModbusRequestPDU writePDU = {.FunctionCode = ModbusFunction::WriteMultipleHoldingRegisters,
+                                         .Address = 1,
+                                         .NumberOfRegisters = 2,
+                                         .RegisterValue = 0,
+                                         .DataByteCount = 4,
+                                         .Values = {}};
+            writePDU.Values.resize(writePDU.DataByteCount);
+            memcpy(writePDU.Values.data(), RequestValues, writePDU.DataByteCount);
+            getRequestBytes(writePDU, buffer);
+        }
+        {
+            ArenaScope scope(arena);
+            TEST_ASSERT_EQUAL(5, regs.ProcessStream(buffer));
+            TEST_ASSERT_EQUAL(0, arena.Used()); // Reset once the transaction completed
+        }
+        TEST_ASSERT_EQUAL(9, LocalValues[2]);
+        TEST_ASSERT_EQUAL(before.HeapAllocations, ModbusAllocationStats.HeapAllocations);
+        TEST_ASSERT_TRUE(ModbusAllocationStats.ArenaAllocations > before.ArenaAllocations);
+    }
+
+    void test_ArenaOwnership()
+    {
+        FixedArena<64> first;
+        FixedArena<64> second;
+        ByteVector *values;
+        {
+            ArenaScope scope(first);
+            values = new ByteVector(8);
+            TEST_ASSERT_TRUE(first.Owns(values->data()));
+        }
+        {
+            ArenaScope scope(second);
+            delete values; // Returned to first, not passed to the heap
+        }
+
+        // A nested scope only releases what was allocated inside it
+        ArenaScope outer(first);
+        ByteVector kept(8, 0x55);
+        const size_t mark = first.Used();
+        {
+            ArenaScope inner(first);
+            ByteVector temporary(16);
+            TEST_ASSERT_TRUE(first.Used() > mark);
+        }
+        TEST_ASSERT_EQUAL(mark, first.Used());
+        TEST_ASSERT_EQUAL(0x55, kept[7]);
+    }
+
+    void test_ReceiveRTUFIFOQueue()
+    {
+        uint16_t Storage[4];
+        FIFORegister Events(10, std::vector<ModbusFunction>{ModbusFunction::ReadFIFOQueue}, Storage, 4);
+        Registers regs(std::vector<Register *>{&Events});
+        Events.Push(7);
+
+        uint8_t request[6] = {1, ModbusFunction::ReadFIFOQueue, 0, 10};
+        FastCRC16 CRC16;
+        const auto CRC = CRC16.modbus(request, 4);
+        memcpy(request + 4, &CRC, 2);
+        TEST_ASSERT_EQUAL(6, FrameLength(RTUFraming, request, sizeof(request)));
+
+        uint8_t frame[ModbusRTUMaxFrame];
+        memcpy(frame, request, sizeof(request));
+        TEST_ASSERT_EQUAL(10, ReceiveFrame(RTUFraming, regs, frame, sizeof(frame), sizeof(request)));
+        TEST_ASSERT_TRUE(CRC16Check(frame, 10));
+        TEST_ASSERT_EQUAL(ModbusFunction::ReadFIFOQueue, frame[1]);
+        TEST_ASSERT_EQUAL(1, CombineBytes(frame[4], frame[5]));
+        TEST_ASSERT_EQUAL(7, CombineBytes(frame[6], frame[7]));
+
+        memcpy(frame, request, sizeof(request));
+        TEST_ASSERT_EQUAL(5, RejectFrame(RTUFraming, frame, sizeof(frame), sizeof(request), ModbusError::SlaveDeviceBusy));
+        TEST_ASSERT_EQUAL(ModbusFunction::ReadFIFOQueue | 0b10000000, frame[1]);
+    }
+
+    // Frames of an RTU over TCP stream answered as a server does, returns the bytes consumed
+    size_t serveRTUStream(Registers &regs, uint8_t *stream, const size_t received, uint8_t *responses, size_t &responded)
+    {
+        size_t offset = 0;
+        for (;;)
+        {
+            const size_t length = FrameLength(RTUFraming, stream + offset, received - offset);
+            if (length == 0 || length > received - offset)
+            {
+                return offset;
+            }
+            uint8_t frame[ModbusRTUMaxFrame];
+            memcpy(frame, stream + offset, length);
+            const size_t size = ReceiveFrame(RTUFraming, regs, frame, sizeof(frame), length);
+            memcpy(responses + responded, frame, size);
+            responded += size;
+            offset += length;
+        }
+    }
+
+    void test_ReceiveRTUSplitUnknownFunction()
+    {
+        uint16_t LocalValues[2] = {8, 9};
+        HoldingRegister TestRegister(0, 1, std::vector<ModbusFunction>{ModbusFunction::ReadHoldingRegisters}, LocalValues, true, true);
+        Registers regs(std::vector<Register *>{&TestRegister});
+        FastCRC16 CRC16;
+
+        // An unknown function code followed by a read, the first delivery ends mid frame
+        uint8_t stream[14] = {1, 0x41, 0, 0, 0, 0, 1, ModbusFunction::ReadHoldingRegisters, 0, 1, 0, 1};
+        auto CRC = CRC16.modbus(stream, 4);
+        memcpy(stream + 4, &CRC, 2);
+        CRC = CRC16.modbus(stream + 6, 6);
+        memcpy(stream + 12, &CRC, 2);
+
+        uint8_t responses[32];
+        size_t responded = 0;
+        TEST_ASSERT_EQUAL(0, serveRTUStream(regs, stream, 3, responses, responded));
+        TEST_ASSERT_EQUAL(0, responded);
+        TEST_ASSERT_EQUAL(14, serveRTUStream(regs, stream, sizeof(stream), responses, responded));
+        TEST_ASSERT_EQUAL(5 + 7, responded);
+        TEST_ASSERT_EQUAL(0x41 | 0b10000000, responses[1]);
+        TEST_ASSERT_EQUAL(ModbusError::IllegalFunction, responses[2]);
+        TEST_ASSERT_EQUAL(ModbusFunction::ReadHoldingRegisters, responses[6]);
+        TEST_ASSERT_EQUAL(9, CombineBytes(responses[8], responses[9]));
+
+        // Noise that never checks out is dropped a byte at a time once a maximum frame has arrived
+        uint8_t noise[ModbusRTUMaxFrame];
+        memset(noise, 0x41, sizeof(noise));
+        TEST_ASSERT_EQUAL(0, RTURequestLength(noise, 100));
+        TEST_ASSERT_EQUAL(1, RTURequestLength(noise, sizeof(noise)));
+    }
+
+    void test_ReceiveRTUMaximumFrame()
+    {
+        static uint16_t LocalValues[125];
+        HoldingRegister TestRegister(0, 124, std::vector<ModbusFunction>{ModbusFunction::WriteMultipleHoldingRegisters}, LocalValues, true, true);
+        Registers regs(std::vector<Register *>{&TestRegister});
+        FastCRC16 CRC16;
+
+        // FC16 claiming 247 data bytes fills a whole 256 byte frame, the byte count doesn't match 123 registers
+        uint8_t frame[ModbusRTUMaxFrame] = {1, ModbusFunction::WriteMultipleHoldingRegisters, 0, 0, 0, 123, 247};
+        const auto CRC = CRC16.modbus(frame, sizeof(frame) - 2);
+        memcpy(frame + sizeof(frame) - 2, &CRC, 2);
+        TEST_ASSERT_EQUAL(sizeof(frame), FrameLength(RTUFraming, frame, sizeof(frame)));
+        TEST_ASSERT_EQUAL(5, ReceiveFrame(RTUFraming, regs, frame, sizeof(frame), sizeof(frame)));
+        TEST_ASSERT_EQUAL(ModbusError::IllegalDataValue, frame[2]);
+        TEST_ASSERT_TRUE(CRC16Check(frame, 5));
+
+        // A byte count that can't fit a frame resynchronises rather than waiting for it
+        const uint8_t oversized[7] = {1, ModbusFunction::WriteMultipleHoldingRegisters, 0, 0, 0, 123, 255};
+        TEST_ASSERT_EQUAL(1, RTURequestLength(oversized, sizeof(oversized)));
+    }
+
+    void test_Server_DerivedQuantityLimits()
+    {
+        uint16_t Computations = 0;
+        static ComputedValue Values[300];
+        ComputedRegister Squares(0, 299, std::vector<ModbusFunction>{ModbusFunction::ReadInputRegisters}, computeSquare, &Computations, Values);
+        uint16_t LocalValues[1] = {0};
+        const uint16_t Sampled[1] = {0};
+        static uint16_t Samples[200];
+        static uint32_t Timestamps[200];
+        HoldingRegister Source(0, 0, std::vector<ModbusFunction>{ModbusFunction::ReadHoldingRegisters}, LocalValues);
+        HistoryRegister History(1000, std::vector<ModbusFunction>{ModbusFunction::ReadHoldingRegisters}, Source, Sampled, 1, Samples, Timestamps, 200, historyClock);
+        Registers regs(std::vector<Register *>{&Squares, &Source, &History});
+
+        // 200 registers would overrun the response, both are refused before the block is read
+        uint8_t buffer[ModbusTCPMaxFrame] = {ModbusFunction::ReadInputRegisters, 0, 0, 0, 200};
+        TEST_ASSERT_EQUAL(2, regs.ProcessStream(buffer));
+        TEST_ASSERT_EQUAL(ModbusError::IllegalDataValue, buffer[1]);
+        TEST_ASSERT_EQUAL(0, Computations);
+
+        const uint8_t history[5] = {ModbusFunction::ReadHoldingRegisters, 0x03, 0xE8, 0, 200};
+        memcpy(buffer, history, sizeof(history));
+        TEST_ASSERT_EQUAL(2, regs.ProcessStream(buffer));
+        TEST_ASSERT_EQUAL(ModbusError::IllegalDataValue, buffer[1]);
+    }
+
+    void test_ScaledRegisterLongBlock()
+    {
+        static float Values[240];
+        static float Gain[240];
+        static float Offset[240];
+        for (uint16_t i = 0; i < 240; i++)
+        {
+            Values[i] = i;
+            Gain[i] = 1;
+        }
+        const ScaleTable Scale = {.Gain = Gain, .Offset = Offset, .Min = nullptr, .Max = nullptr};
+        ScaledRegister Scaled(0, 239, std::vector<ModbusFunction>{ModbusFunction::ReadHoldingRegisters}, Values, Scale, false);
+
+        // More than 224 registers used to wrap the chunk counter and never finish
+        static uint8_t buffer[2 * 240];
+        Scaled.Read(0, 240, buffer);
+        TEST_ASSERT_EQUAL(239, CombineBytes(buffer[478], buffer[479]));
+        Values[239] = 0;
+        Scaled.Write(0, 240, buffer);
+        TEST_ASSERT_EQUAL(239.0f, Values[239]);
+
+        // A NaN reading must not reach the integer cast
+        Values[7] = std::numeric_limits<float>::quiet_NaN();
+        Scaled.Read(7, 1, buffer);
+        TEST_ASSERT_EQUAL(0, CombineBytes(buffer[0], buffer[1]));
+    }
+
+    void test_Server_QuantityLimits()
+    {
+        uint16_t LocalValues[130] = {0};
+        LocalValues[124] = 7;
+        static uint8_t LowCoils[1000] = {0};
+        static uint8_t HighCoils[1000] = {0};
+        LowCoils[300] = 1;
+        HighCoils[999] = 1;
+        HoldingRegister Holding(0, 129, std::vector<ModbusFunction>{ModbusFunction::ReadHoldingRegisters, ModbusFunction::WriteMultipleHoldingRegisters}, LocalValues, true, true);
+        CoilRegister Low(0, 999, std::vector<ModbusFunction>{ModbusFunction::ReadCoils, ModbusFunction::WriteMultipleCoils}, LowCoils);
+        CoilRegister High(1000, 1999, std::vector<ModbusFunction>{ModbusFunction::ReadCoils, ModbusFunction::WriteMultipleCoils}, HighCoils);
+        Registers regs(std::vector<Register *>{&Holding, &Low, &High});
+        regs.AllowSpanningRequests(true);
+
+        uint8_t buffer[ModbusTCPMaxFrame] = {ModbusFunction::ReadHoldingRegisters, 0, 0, 0, 125};
+        TEST_ASSERT_EQUAL(252, regs.ProcessStream(buffer));
+        TEST_ASSERT_EQUAL(250, buffer[1]);
+        TEST_ASSERT_EQUAL(7, CombineBytes(buffer[250], buffer[251]));
+
+        const uint8_t tooMany[5] = {ModbusFunction::ReadHoldingRegisters, 0, 0, 0, 126};
+        memcpy(buffer, tooMany, sizeof(tooMany));
+        TEST_ASSERT_EQUAL(2, regs.ProcessStream(buffer));
+        TEST_ASSERT_EQUAL(ModbusFunction::ReadHoldingRegisters | 0b10000000, buffer[0]);
+        TEST_ASSERT_EQUAL(ModbusError::IllegalDataValue, buffer[1]);
+
+        const uint8_t none[5] = {ModbusFunction::ReadHoldingRegisters, 0, 0, 0, 0};
+        memcpy(buffer, none, sizeof(none));
+        TEST_ASSERT_EQUAL(2, regs.ProcessStream(buffer));
+        TEST_ASSERT_EQUAL(ModbusError::IllegalDataValue, buffer[1]);
+
+        // 2000 coils across both blocks
+        const uint8_t allCoils[5] = {ModbusFunction::ReadCoils, 0, 0, 0x07, 0xD0};
+        memcpy(buffer, allCoils, sizeof(allCoils));
+        TEST_ASSERT_EQUAL(252, regs.ProcessStream(buffer));
+        TEST_ASSERT_EQUAL(250, buffer[1]);
+        TEST_ASSERT_EQUAL(1 << 4, buffer[2 + 300 / 8]);
+        TEST_ASSERT_EQUAL(0x80, buffer[251]);
+
+        const uint8_t tooManyCoils[5] = {ModbusFunction::ReadCoils, 0, 0, 0x07, 0xD1};
+        memcpy(buffer, tooManyCoils, sizeof(tooManyCoils));
+        TEST_ASSERT_EQUAL(2, regs.ProcessStream(buffer));
+        TEST_ASSERT_EQUAL(ModbusError::IllegalDataValue, buffer[1]);
+
+        // 1968 coils written from 32, the most a request carries
+        uint8_t write[6 + 246] = {ModbusFunction::WriteMultipleCoils, 0, 32, 0x07, 0xB0, 246};
+        memset(write + 6, 0xFF, 246);
+        memcpy(buffer, write, sizeof(write));
+        TEST_ASSERT_EQUAL(5, regs.ProcessStream(buffer));
+        TEST_ASSERT_EQUAL(0, LowCoils[31]);
+        TEST_ASSERT_EQUAL(1, LowCoils[999]);
+        TEST_ASSERT_EQUAL(1, HighCoils[999]);
+
+        // The byte count has to match the quantity
+        const uint8_t mismatched[8] = {ModbusFunction::WriteMultipleHoldingRegisters, 0, 0, 0, 100, 2, 0, 1};
+        memcpy(buffer, mismatched, sizeof(mismatched));
+        TEST_ASSERT_EQUAL(2, regs.ProcessStream(buffer));
+        TEST_ASSERT_EQUAL(ModbusError::IllegalDataValue, buffer[1]);
+        TEST_ASSERT_EQUAL(0, LocalValues[0]);
+
+        uint8_t first[ModbusTCPMaxFrame] = {ModbusFunction::ReadHoldingRegisters, 0, 0, 0, 200};
+        uint8_t second[ModbusTCPMaxFrame] = {ModbusFunction::ReadHoldingRegisters, 0, 124, 0, 1};
+        uint8_t *frames[2] = {first, second};
+        uint8_t lengths[2] = {0};
+        regs.ProcessStreams(frames, lengths, 2);
+        TEST_ASSERT_EQUAL(2, lengths[0]);
+        TEST_ASSERT_EQUAL(ModbusError::IllegalDataValue, first[1]);
+        TEST_ASSERT_EQUAL(4, lengths[1]);
+    }
+
+    void test_Server_FIFOQueue()
+    {
+        uint16_t Storage[64];
+        FIFORegister Events(10, std::vector<ModbusFunction>{ModbusFunction::ReadFIFOQueue, ModbusFunction::ReadHoldingRegisters}, Storage, 64);
+        Registers regs(std::vector<Register *>{&Events});
+        for (uint16_t i = 0; i < 70; i++)
+        {
+            Events.Push(1000 + i);
+        }
+        TEST_ASSERT_EQUAL(6, Events.Overflows.load());
+
+        uint8_t buffer[256] = {ModbusFunction::ReadHoldingRegisters, 0, 10, 0, 1};
+        TEST_ASSERT_EQUAL(4, regs.ProcessStream(buffer));
+        TEST_ASSERT_EQUAL(64, CombineBytes(buffer[2], buffer[3]));
+
+        const ModbusRequestPDU fifoPDU = {.FunctionCode = ModbusFunction::ReadFIFOQueue,
+                                          .Address = 10,
+                                          .NumberOfRegisters = 0,
+                                          .RegisterValue = 0,
+                                          .DataByteCount = 0,
+                                          .Values = {}};
+        TEST_ASSERT_EQUAL(3, getRequestByteLength(fifoPDU));
+        getRequestBytes(fifoPDU, buffer);
+        TEST_ASSERT_EQUAL(5 + 2 * ModbusFIFOMaxCount, regs.ProcessStream(buffer));
+        TEST_ASSERT_EQUAL(2 + 2 * ModbusFIFOMaxCount, CombineBytes(buffer[1], buffer[2]));
+        TEST_ASSERT_EQUAL(ModbusFIFOMaxCount, CombineBytes(buffer[3], buffer[4]));
+        TEST_ASSERT_EQUAL(1000, CombineBytes(buffer[5], buffer[6]));
+
+        getRequestBytes(fifoPDU, buffer);
+        regs.ProcessStream(buffer);
+        getRequestBytes(fifoPDU, buffer);
+        TEST_ASSERT_EQUAL(9, regs.ProcessStream(buffer)); // The last 2 of the 64 queued
+        const ModbusResponsePDU last = ParseResponsePDU(buffer);
+        TEST_ASSERT_EQUAL(4, last.DataByteCount);
+        TEST_ASSERT_EQUAL(1063, CombineBytes(last.RegisterValue[2], last.RegisterValue[3]));
+        TEST_ASSERT_EQUAL(0, Events.Count());
+    }
+
+#ifdef __linux__
+    // Sends three reads and then a complete MBAP frame longer than any request, which would no longer fit the output
+    // buffer behind their responses. Returns the bytes the server answered with before closing the connection
+    template <typename Server>
+    size_t serveOversizedFrame(Server &server, const uint16_t port)
+    {
+        const int client = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(port);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (connect(client, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0)
+        {
+            close(client);
+            return 0;
+        }
+
+        uint8_t stream[3 * 12 + 477] = {0};
+        for (uint8_t i = 0; i < 3; i++)
+        {
+            const uint8_t request[12] = {0, i, 0, 0, 0, 6, 1, ModbusFunction::ReadHoldingRegisters, 0, 0, 0, static_cast<uint8_t>(i < 2 ? 125 : 20)};
+            memcpy(stream + 12 * i, request, sizeof(request));
+        }
+        const uint8_t oversized[8] = {0, 3, 0, 0, (477 - 6) >> 8, (477 - 6) & 0xFF, 1, ModbusFunction::WriteMultipleHoldingRegisters};
+        memcpy(stream + 36, oversized, sizeof(oversized));
+        send(client, stream, sizeof(stream), MSG_NOSIGNAL);
+
+        uint8_t received[2048];
+        size_t receivedBytes = 0;
+        for (uint16_t round = 0; round < 1000; round++)
+        {
+            server.Poll(1);
+            const ssize_t result = recv(client, received + receivedBytes, sizeof(received) - receivedBytes, MSG_DONTWAIT);
+            if (result == 0 || (result < 0 && errno != EAGAIN))
+            {
+                break; // Closed by the server
+            }
+            receivedBytes += result > 0 ? result : 0;
+        }
+        close(client);
+        return receivedBytes;
+    }
+
+    void test_TCPServerOversizedFrame()
+    {
+        static uint16_t LocalValues[125];
+        HoldingRegister TestRegister(0, 124, std::vector<ModbusFunction>{ModbusFunction::ReadHoldingRegisters}, LocalValues, true, true);
+        Registers regs(std::vector<Register *>{&TestRegister});
+        StdLinuxModbusTCPServer server({.ServerPort = 15296, .ClientTimeout = 0}, regs);
+        TEST_ASSERT_TRUE(server.Initialize());
+        TEST_ASSERT_EQUAL(2 * 259 + 49, serveOversizedFrame(server, 15296)); // Only the real responses, then closed
+        server.Poll(0);
+        TEST_ASSERT_EQUAL(0, server.ClientCount());
+    }
+
+    void test_UringServerOversizedFrame()
+    {
+        static uint16_t LocalValues[125];
+        HoldingRegister TestRegister(0, 124, std::vector<ModbusFunction>{ModbusFunction::ReadHoldingRegisters}, LocalValues, true, true);
+        Registers regs(std::vector<Register *>{&TestRegister});
+        StdLinuxModbusUringServer server({.ServerPort = 15295, .ClientTimeout = 0}, regs);
+        if (!server.Initialize())
+        {
+            return; // Kernel older than 6.3
+        }
+        TEST_ASSERT_EQUAL(2 * 259 + 49, serveOversizedFrame(server, 15295));
+        server.Poll(0);
+        TEST_ASSERT_EQUAL(0, server.ClientCount());
+    }
+
+    void test_TCPServerStalledClient()
+    {
+        static uint16_t LocalValues[125];
+        HoldingRegister TestRegister(0, 124, std::vector<ModbusFunction>{ModbusFunction::ReadHoldingRegisters}, LocalValues, true, true);
+        Registers regs(std::vector<Register *>{&TestRegister});
+        StdLinuxModbusTCPServer server({.ServerPort = 15298, .ClientTimeout = 0}, regs);
+        TEST_ASSERT_TRUE(server.Initialize());
+
+        // A small receive buffer keeps the client from soaking up the responses
+        const int client = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        const int size = 4096;
+        setsockopt(client, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(15298);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        TEST_ASSERT_EQUAL(0, connect(client, reinterpret_cast<sockaddr *>(&address), sizeof(address)));
+
+        const size_t Requests = 40000; // About 10MB of responses, more than the socket buffers hold
+        static uint8_t stream[Requests * 12];
+        for (size_t i = 0; i < Requests; i++)
+        {
+            const uint8_t request[12] = {0, 1, 0, 0, 0, 6, 1, ModbusFunction::ReadHoldingRegisters, 0, 0, 0, 125};
+            memcpy(stream + 12 * i, request, sizeof(request));
+        }
+
+        // Pipeline requests without reading until the server stops answering
+        size_t sent = 0;
+        size_t processed = 0;
+        for (uint16_t idle = 0; idle < 100;)
+        {
+            const ssize_t result = send(client, stream + sent, sizeof(stream) - sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+            sent += result > 0 ? result : 0;
+            const uint16_t frames = server.Poll(0);
+            processed += frames;
+            idle = frames == 0 ? idle + 1 : 0;
+        }
+        TEST_ASSERT_TRUE(processed < Requests);
+
+        // The stalled client is only watched for EPOLLOUT, so Poll() doesn't read it again. Write space freed by the
+        // kernel may still wake Poll() early, so only the absence of reads is checked
+        for (uint8_t i = 0; i < 3; i++)
+        {
+            TEST_ASSERT_EQUAL(0, server.Poll(20));
+        }
+        TEST_ASSERT_EQUAL(1, server.ClientCount());
+
+        // Once the client reads, every request is answered
+        static uint8_t received[65536];
+        size_t receivedBytes = 0;
+        for (uint32_t round = 0; round < 1000000 && receivedBytes < Requests * 259; round++)
+        {
+            if (sent < sizeof(stream))
+            {
+                const ssize_t result = send(client, stream + sent, sizeof(stream) - sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+                sent += result > 0 ? result : 0;
+            }
+            const ssize_t result = recv(client, received, sizeof(received), MSG_DONTWAIT);
+            receivedBytes += result > 0 ? result : 0;
+            processed += server.Poll(0);
+        }
+        TEST_ASSERT_EQUAL(Requests, processed);
+        TEST_ASSERT_EQUAL(Requests * 259, receivedBytes);
+        close(client);
+    }
+
+    void test_ReplayRejectsOversizedRecord()
+    {
+        const char *path = "/tmp/modbus_test_replay.mbcp";
+        FILE *file = fopen(path, "wb");
+        TEST_ASSERT_TRUE(file != nullptr);
+        const CaptureFileHeader fileHeader = {.Magic = CaptureFileMagic, .Version = CaptureFileVersion, .Reserved = 0, .StartMicros = 0};
+        fwrite(&fileHeader, sizeof(fileHeader), 1, file);
+        const uint8_t request[12] = {0, 1, 0, 0, 0, 6, 1, ModbusFunction::ReadHoldingRegisters, 0, 0, 0, 1};
+        CaptureRecordHeader header = {.Micros = 0, .Transaction = 1, .Length = sizeof(request), .Framing = MBAPFraming, .Direction = CapturedRequest};
+        fwrite(&header, sizeof(header), 1, file);
+        fwrite(request, sizeof(request), 1, file);
+
+        // Present in full, but longer than any frame
+        static uint8_t corrupt[1000];
+        header = {.Micros = 0, .Transaction = 2, .Length = sizeof(corrupt), .Framing = MBAPFraming, .Direction = CapturedRequest};
+        fwrite(&header, sizeof(header), 1, file);
+        fwrite(corrupt, sizeof(corrupt), 1, file);
+        fclose(file);
+
+        CaptureReplay replay;
+        TEST_ASSERT_TRUE(replay.Load(path));
+        TEST_ASSERT_EQUAL(1, replay.Count());
+        remove(path);
+    }
+
+    void test_SimulatorStop()
+    {
+        static const uint16_t HoldingValues[4] = {1, 2, 3, 4};
+        const DeviceTemplate Template = {.HoldingCount = 4, .HoldingValues = HoldingValues, .InputCount = 1};
+        ModbusExecutor executor;
+        ModbusSimulator simulator(executor);
+        simulator.Route(15299, 1, simulator.AddDevices(Template, 1));
+        TEST_ASSERT_TRUE(simulator.Start());
+        executor.RunOnce(0);
+        simulator.Stop();
+        executor.RunOnce(10);
+
+        // The port is closed without waiting for another client
+        const int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(15299);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        TEST_ASSERT_EQUAL(-1, connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)));
+        TEST_ASSERT_EQUAL(ECONNREFUSED, errno);
+        close(fd);
+    }
+
+    void test_SharedImageLock()
+    {
+        const char *name = "/modbus_test_image";
+        shm_unlink(name);
+        SharedRegisterImage image;
+        TEST_ASSERT_TRUE(image.Open(name, 16));
+        image.TimeoutMicros = 20000;
+
+        // Reopening, as a restarted server does, leaves a live writer's lock alone
+        TEST_ASSERT_TRUE(image.BeginWrite());
+        SharedRegisterImage restarted;
+        TEST_ASSERT_TRUE(restarted.Open(name, 16));
+        restarted.TimeoutMicros = 20000;
+        uint32_t sequence;
+        TEST_ASSERT_FALSE(restarted.ReadBegin(sequence));
+        TEST_ASSERT_FALSE(restarted.BeginWrite());
+        image.EndWrite();
+        TEST_ASSERT_TRUE(restarted.ReadBegin(sequence));
+        TEST_ASSERT_EQUAL(2, sequence);
+        TEST_ASSERT_EQUAL(0, image.Writer());
+
+        // A writer that exits mid update has its lock released by the next reader
+        pid_t child = fork();
+        if (child == 0)
+        {
+            image.BeginWrite();
+            _exit(0);
+        }
+        waitpid(child, nullptr, 0);
+        TEST_ASSERT_EQUAL(child, image.Writer());
+        TEST_ASSERT_TRUE(restarted.ReadBegin(sequence));
+        TEST_ASSERT_EQUAL(4, sequence);
+        TEST_ASSERT_EQUAL(0, image.Writer());
+
+        // or by Open()
+        child = fork();
+        if (child == 0)
+        {
+            image.BeginWrite();
+            _exit(0);
+        }
+        waitpid(child, nullptr, 0);
+        TEST_ASSERT_TRUE(restarted.Open(name, 16));
+        TEST_ASSERT_EQUAL(0, restarted.Writer());
+        TEST_ASSERT_TRUE(image.BeginWrite());
+        image.EndWrite();
+        TEST_ASSERT_TRUE(image.ReadBegin(sequence));
+        TEST_ASSERT_EQUAL(8, sequence);
+        shm_unlink(name);
+    }
+#endif
+
+    void releaseMap(Registers & /* Map */, void *Context) { (*static_cast<uint8_t *>(Context))++; }
+
+    void test_Server_HotReload()
+    {
+        uint16_t OldValues[2] = {1, 2};
+        uint16_t NewValues[4] = {5, 6, 7, 8};
+        HoldingRegister OldRegister(0, 1, std::vector<ModbusFunction>{ModbusFunction::ReadHoldingRegisters}, OldValues, true, true);
+        HoldingRegister NewRegister(0, 3, std::vector<ModbusFunction>{ModbusFunction::ReadHoldingRegisters}, NewValues, true, true);
+        Registers OldMap(std::vector<Register *>{&OldRegister});
+        Registers NewMap(std::vector<Register *>{&NewRegister});
+
+        uint8_t released = 0;
+        RegisterMapSwitch maps(OldMap, releaseMap, &released);
+        ReloadReader &reader = maps.AddReader();
+        ReloadReader &idle = maps.AddReader();
+        TEST_ASSERT_TRUE(&reader != &idle);
+
+        uint8_t buffer[256] = {ModbusFunction::ReadHoldingRegisters, 0, 0, 0, 4};
+        {
+            PinnedRegisters inFlight(maps, reader);
+            maps.Swap(NewMap);
+            TEST_ASSERT_EQUAL(&NewMap, &maps.Current());
+            TEST_ASSERT_EQUAL(2, inFlight.Map().ProcessStream(buffer)); // Still answered by the old map
+            TEST_ASSERT_EQUAL(0x80 | ModbusFunction::ReadHoldingRegisters, buffer[0]);
+            TEST_ASSERT_EQUAL(1, maps.Reclaim());
+            TEST_ASSERT_EQUAL(0, released);
+        }
+        TEST_ASSERT_EQUAL(0, maps.Reclaim());
+        TEST_ASSERT_EQUAL(1, released);
+
+        const uint8_t request[5] = {ModbusFunction::ReadHoldingRegisters, 0, 0, 0, 4};
+        memcpy(buffer, request, sizeof(request));
+        PinnedRegisters next(maps, reader);
+        TEST_ASSERT_EQUAL(10, next.Map().ProcessStream(buffer));
+        TEST_ASSERT_EQUAL(1, maps.Swaps());
+
+        maps.RemoveReader(idle);
+        TEST_ASSERT_EQUAL(&idle, &maps.AddReader()); // Reused
+    }
+
+    void deleteMap(Registers &Map, void * /* Context */) { delete &Map; }
+
+    void test_ServedRegistersFollowSwaps()
+    {
+        uint16_t OldValues[1] = {1};
+        uint16_t NewValues[1] = {2};
+        HoldingRegister OldRegister(0, 0, std::vector<ModbusFunction>{ModbusFunction::ReadHoldingRegisters}, OldValues, true, true);
+        HoldingRegister NewRegister(0, 0, std::vector<ModbusFunction>{ModbusFunction::ReadHoldingRegisters}, NewValues, true, true);
+        Registers NewMap(std::vector<Register *>{&NewRegister});
+
+        RegisterMapSwitch maps(*new Registers(std::vector<Register *>{&OldRegister}), deleteMap);
+        ServedRegisters served(maps);
+        maps.Swap(NewMap);
+        TEST_ASSERT_EQUAL(0, maps.Reclaim()); // The initial map is deleted
+
+        uint8_t frame[ModbusTCPMaxFrame] = {0, 1, 0, 0, 0, 6, 1, ModbusFunction::ReadHoldingRegisters, 0, 0, 0, 1};
+        TEST_ASSERT_EQUAL(11, served.Receive(MBAPFraming, frame, 12));
+        TEST_ASSERT_EQUAL(2, CombineBytes(frame[9], frame[10]));
+    }
+
+    uint64_t testClock() { return 42; }
+
+    void test_CaptureRing()
+    {
+        uint16_t LocalValues[2] = {5, 6};
+        HoldingRegister TestRegister(0, 1, std::vector<ModbusFunction>{ModbusFunction::ReadHoldingRegisters}, LocalValues, true, true);
+        Registers regs(std::vector<Register *>{&TestRegister});
+
+        uint8_t storage[64];
+        CaptureRing ring(storage, sizeof(storage), testClock);
+        SetActiveCapture(&ring);
+        array<uint8_t, ModbusTCPMaxFrame> frame = {0, 1, 0, 0, 0, 6, 1, 3, 0, 0, 0, 1};
+        TEST_ASSERT_EQUAL(11, ReceiveTCPStream(regs, frame, 12));
+        frame = {0, 2, 0, 0, 0, 6, 1, 3, 0, 0, 0, 1};
+        TEST_ASSERT_EQUAL(11, ReceiveTCPStream(regs, frame, 12)); // Ring is full, both records are dropped
+        SetActiveCapture(nullptr);
+        TEST_ASSERT_EQUAL(2, ring.Dropped.load());
+
+        CaptureRecordHeader header;
+        uint8_t captured[ModbusCaptureMaxFrame];
+        TEST_ASSERT_TRUE(ring.Next(header, captured));
+        TEST_ASSERT_EQUAL(CapturedRequest, header.Direction);
+        TEST_ASSERT_EQUAL(12, header.Length);
+        TEST_ASSERT_EQUAL(42, header.Micros);
+        TEST_ASSERT_EQUAL(1, captured[1]);
+        TEST_ASSERT_TRUE(ring.Next(header, captured));
+        TEST_ASSERT_EQUAL(CapturedResponse, header.Direction);
+        TEST_ASSERT_EQUAL(1, header.Transaction);
+        TEST_ASSERT_EQUAL(11, header.Length);
+        TEST_ASSERT_EQUAL(2, captured[8]);
+        TEST_ASSERT_FALSE(ring.Next(header, captured));
+    }
+
+    void test_CaptureRejectAndBroadcast()
+    {
+        uint16_t LocalValues[2] = {5, 6};
+        HoldingRegister TestRegister(0, 1, std::vector<ModbusFunction>{ModbusFunction::ReadHoldingRegisters}, LocalValues, true, true);
+        Registers regs(std::vector<Register *>{&TestRegister});
+
+        uint8_t storage[256];
+        CaptureRing ring(storage, sizeof(storage), testClock);
+        SetActiveCapture(&ring);
+        array<uint8_t, ModbusTCPMaxFrame> frame = {0, 1, 0, 0, 0, 6, 1, 3, 0, 0, 0, 1};
+        TEST_ASSERT_EQUAL(9, RejectTCPStream(frame, 12, ModbusError::SlaveDeviceBusy));
+
+        uint8_t broadcast[8] = {0, ModbusFunction::ReadHoldingRegisters, 0, 0, 0, 1};
+        FastCRC16 CRC16;
+        const auto CRC = CRC16.modbus(broadcast, 6);
+        memcpy(broadcast + 6, &CRC, 2);
+        uint8_t rtu[ModbusRTUMaxFrame];
+        memcpy(rtu, broadcast, sizeof(broadcast));
+        TEST_ASSERT_EQUAL(0, ReceiveFrame(RTUFraming, regs, rtu, sizeof(rtu), sizeof(broadcast)));
+        SetActiveCapture(nullptr);
+        TEST_ASSERT_EQUAL(0, ring.Dropped.load());
+
+        CaptureRecordHeader header;
+        uint8_t captured[ModbusCaptureMaxFrame];
+        TEST_ASSERT_TRUE(ring.Next(header, captured));
+        TEST_ASSERT_EQUAL(CapturedRequest, header.Direction);
+        TEST_ASSERT_EQUAL(12, header.Length);
+        TEST_ASSERT_TRUE(ring.Next(header, captured));
+        TEST_ASSERT_EQUAL(CapturedResponse, header.Direction);
+        TEST_ASSERT_EQUAL(1, header.Transaction);
+        TEST_ASSERT_EQUAL(9, header.Length);
+        TEST_ASSERT_EQUAL(0x83, captured[7]);
+        TEST_ASSERT_EQUAL(ModbusError::SlaveDeviceBusy, captured[8]);
+
+        // The broadcast request is recorded, its unsent response isn't
+        TEST_ASSERT_TRUE(ring.Next(header, captured));
+        TEST_ASSERT_EQUAL(CapturedRequest, header.Direction);
+        TEST_ASSERT_EQUAL(RTUFraming, header.Framing);
+        TEST_ASSERT_EQUAL(2, header.Transaction);
+        TEST_ASSERT_FALSE(ring.Next(header, captured));
+    }
+#endif
+
+    void test_Server_WriteConstraints()
+    {
+        uint16_t LocalValues[8] = {0, 1, 2, 3, 4, 5, 6, 7};
+        const uint16_t Modes[3] = {1, 2, 4};
+        WriteConstraint Constraints[4] = {
+            {.FirstAddress = 0, .LastAddress = 1, .Min = -10, .Max = 100, .Signed = true},
+            {.FirstAddress = 2, .LastAddress = 2, .Min = 0, .Max = 50, .Action = ClampToLimits},
+            {.FirstAddress = 3, .LastAddress = 3, .Allowed = Modes, .AllowedCount = 3},
+            {.FirstAddress = 4, .LastAddress = 5, .WriteOnce = true}};
+#ifdef __AVR__
+        ModbusFunction HoldingFunctions[2] = {ModbusFunction::WriteSingleHoldingRegister, ModbusFunction::WriteMultipleHoldingRegisters};
+        HoldingRegister TestRegister(0, 7, vector<ModbusFunction>(HoldingFunctions, 2), LocalValues);
+        Register *RegistersArray[1] = {&TestRegister};
+        vector<Register *> asVec(RegistersArray, 1);
+        Registers regs(asVec);
+#else
+        HoldingRegister TestRegister(0, 7, std::vector<ModbusFunction>{ModbusFunction::WriteSingleHoldingRegister, ModbusFunction::WriteMultipleHoldingRegisters}, LocalValues);
+        Registers regs(std::vector<Register *>{&TestRegister});
+#endif
+        TestRegister.SetConstraints(Constraints, 4);
+
+        ModbusRequestPDU singlePDU = {.FunctionCode = ModbusFunction::WriteSingleHoldingRegister,
+                                      .Address = 0,
+                                      .NumberOfRegisters = 0,
+                                      .RegisterValue = static_cast<uint16_t>(-5),
+                                      .DataByteCount = 0,
+                                      .Values = {}};
+        TEST_ASSERT_EQUAL(ModbusError::NoError, regs.ProcessRequest(singlePDU).Error);
+        TEST_ASSERT_EQUAL(static_cast<uint16_t>(-5), LocalValues[0]);
+        singlePDU.RegisterValue = 101;
+        TEST_ASSERT_EQUAL(ModbusError::IllegalDataValue, regs.ProcessRequest(singlePDU).Error);
+        singlePDU.Address = 2;
+        singlePDU.RegisterValue = 70;
+        TEST_ASSERT_EQUAL(ModbusError::NoError, regs.ProcessRequest(singlePDU).Error);
+        TEST_ASSERT_EQUAL(50, LocalValues[2]);
+        singlePDU.Address = 3;
+        singlePDU.RegisterValue = 3;
+        TEST_ASSERT_EQUAL(ModbusError::IllegalDataValue, regs.ProcessRequest(singlePDU).Error);
+        singlePDU.RegisterValue = 4;
+        TEST_ASSERT_EQUAL(ModbusError::NoError, regs.ProcessRequest(singlePDU).Error);
+        TEST_ASSERT_EQUAL(4, LocalValues[3]);
+
+        // One bad value rejects the whole request
+        uint8_t RequestValues[12] = {0, 9, 0, 8, 0, 20, 0, 2, 0, 40, 0, 41};
+        ModbusRequestPDU writePDU = {.FunctionCode = ModbusFunction::WriteMultipleHoldingRegisters,
+                                     .Address = 0,
+                                     .NumberOfRegisters = 6,
+                                     .RegisterValue = 0,
+                                     .DataByteCount = 12,
+                                     .Values = {}};
+#ifdef __AVR__
+        writePDU.Values.setStorage(dataBuffer, writePDU.DataByteCount);
+#else
+        writePDU.Values.resize(writePDU.DataByteCount);
+#endif
+        RequestValues[1] = 200;
+        memcpy(writePDU.Values.data(), RequestValues, writePDU.DataByteCount);
+        TEST_ASSERT_EQUAL(ModbusError::IllegalDataValue, regs.ProcessRequest(writePDU).Error);
+        TEST_ASSERT_EQUAL(1, LocalValues[1]);
+        TEST_ASSERT_EQUAL(4, LocalValues[4]);
+
+        RequestValues[1] = 9;
+        memcpy(writePDU.Values.data(), RequestValues, writePDU.DataByteCount);
+        TEST_ASSERT_EQUAL(ModbusError::NoError, regs.ProcessRequest(writePDU).Error);
+        TEST_ASSERT_EQUAL(8, LocalValues[1]);
+        TEST_ASSERT_EQUAL(20, LocalValues[2]);
+        TEST_ASSERT_EQUAL(41, LocalValues[5]);
+        TEST_ASSERT_EQUAL(ModbusError::IllegalDataValue, regs.ProcessRequest(writePDU).Error); // Registers 4 and 5 are now written
+    }
+
     void test_LittleEndian()
     {
         TEST_ASSERT_EQUAL(Little, EndiannessTest()); // This will fail if the System is Big Endian
@@ -347,6 +1663,42 @@ namespace ModbusServer
         RUN_TEST(test_Server_ReadCoils);
         RUN_TEST(test_Server_WriteCoil);
         RUN_TEST(test_Server_WriteMultipleCoils);
+        RUN_TEST(test_Server_ResponseCache);
+        RUN_TEST(test_RejectTCPStream);
+        RUN_TEST(test_ReceiveTCPPipelined);
+        RUN_TEST(test_Server_ProcessStreams);
+        RUN_TEST(test_ReceiveASCIIStream);
+        RUN_TEST(test_RTURequestLength);
+        RUN_TEST(test_Server_SparseHoldingRegister);
+        RUN_TEST(test_Server_SpanningRequests);
+        RUN_TEST(test_Server_WriteConstraints);
+        RUN_TEST(test_Server_FileRecords);
+        RUN_TEST(test_Server_HistoryRegister);
+        RUN_TEST(test_Server_ComputedRegister);
+        RUN_TEST(test_Server_ScaledRegister);
+#ifndef __AVR__
+        RUN_TEST(test_Server_TransactionArena);
+        RUN_TEST(test_ArenaOwnership);
+        RUN_TEST(test_CaptureRing);
+        RUN_TEST(test_CaptureRejectAndBroadcast);
+        RUN_TEST(test_Server_DerivedQuantityLimits);
+        RUN_TEST(test_ScaledRegisterLongBlock);
+        RUN_TEST(test_Server_QuantityLimits);
+        RUN_TEST(test_Server_FIFOQueue);
+        RUN_TEST(test_ReceiveRTUFIFOQueue);
+        RUN_TEST(test_ReceiveRTUSplitUnknownFunction);
+        RUN_TEST(test_ReceiveRTUMaximumFrame);
+        RUN_TEST(test_Server_HotReload);
+        RUN_TEST(test_ServedRegistersFollowSwaps);
+#endif
+#ifdef __linux__
+        RUN_TEST(test_TCPServerOversizedFrame);
+        RUN_TEST(test_UringServerOversizedFrame);
+        RUN_TEST(test_TCPServerStalledClient);
+        RUN_TEST(test_ReplayRejectsOversizedRecord);
+        RUN_TEST(test_SimulatorStop);
+        RUN_TEST(test_SharedImageLock);
+#endif
         tearDown();
     }
 } // namespace ModbusServer